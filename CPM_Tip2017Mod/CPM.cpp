@@ -62,7 +62,7 @@ void CPM::SetStep(int step)
 	_step = step;
 }
 
-int CPM::Matching(FImage& img1, FImage& img2, FImage& outMatches)
+int CPM::Matching(FImage& img1, FImage& img2, FImage& outMatches, FImage* outCosts)
 {
 	CTimer t;
 
@@ -200,10 +200,15 @@ int CPM::Matching(FImage& img1, FImage& img2, FImage& outMatches)
 	if (!outMatches.matchDimension(4, validMatCnt, 1)){
 		outMatches.allocate(4, validMatCnt, 1);
 	}
+	if (outCosts && !outCosts->matchDimension(1, validMatCnt, 1)){
+		outCosts->allocate(1, validMatCnt, 1);
+	}
 	int tmpIdx = 0;
 	for (int i = 0; i < numV; i++){
 		if (tmpMatch[4 * i + 0] >= 0){
 			memcpy(outMatches.rowPtr(tmpIdx), tmpMatch.rowPtr(i), sizeof(int) * 4);
+			if (outCosts)
+				outCosts->pData[tmpIdx] = _seedsCosts[i];
 			tmpIdx++;
 		}
 	}
@@ -653,6 +658,10 @@ void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& p
         }
     }
 
+    // keep the costs of the finest level for the match files
+    _seedsCosts.allocate(1, numV);
+    memcpy(_seedsCosts.pData, bestCosts, sizeof(float) * numV);
+
     delete[] searchRadius;
     delete[] bestCosts;
     delete[] iterCnts;
@@ -35,7 +35,8 @@ public:
     CPM(cpm_pf_params_t &cpm_pf_params);
 	~CPM();
 
-	int Matching(FImage& img1, FImage& img2, FImage& outMatches);
+	// outCosts, when given, receives the matching cost of each match (1 x number of matches)
+	int Matching(FImage& img1, FImage& img2, FImage& outMatches, FImage* outCosts = NULL);
 	void SetStereoFlag(int needStereo);
 	void SetStep(int step);
 
@@ -84,6 +85,7 @@ private:
 	FImage* _pydSeedsFlow2;
 
 	IntImage _seeds;
+	FImage _seedsCosts;	// forward matching cost of each seed at the finest level
 	IntImage _seeds2;
 	IntImage _neighbors;
 	IntImage _neighbors2;
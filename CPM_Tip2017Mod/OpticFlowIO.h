@@ -8,7 +8,11 @@
 #include <string.h>
 
 #include <stdint.h>
+#ifdef WITH_SSE
+#include <emmintrin.h>
+#endif
 #include "opencv2/opencv.hpp" // for KITTI
+#include "../PFilter/variational/flow_io.h"
 
 using namespace cv;
 
@@ -53,9 +57,9 @@ public:
 	template <class T>
 	static int ReadFlowFile(T* U, T* V, int* w, int* h, const char* filename);
 
-	// write a 2-band image into flow file 
+	// write a 2-band image into flow file, a .cflo file is coded with codec (FLOW_CODEC_*)
 	template <class T>
-	static int WriteFlowFile(T* U, T* V, int w, int h, const char* filename);
+	static int WriteFlowFile(T* U, T* V, int w, int h, const char* filename, int codec = FLOW_CODEC_FLOAT32);
 
 	// read a KITTI flow file into 2-band image
 	template <class T>
@@ -65,14 +69,15 @@ public:
 	template <class T>
 	static int WriteKittiFlowFile(T* U, T* V, int w, int h, const char* filename);
 
-	// render the motion to a 4-band BGRA color image
+	// render the motion to a 4-band BGRA color image, of (w+scale-1)/scale x (h+scale-1)/scale pixels
+	// sampled every scale pixels when scale > 1
 	template <class T>
-	static double MotionToColor(unsigned char* fillPix, T* U, T* V, int w, int h, float range = -1);
+	static double MotionToColor(unsigned char* fillPix, T* U, T* V, int w, int h, float range = -1, int scale = 1);
 
 	template <class T>
 	static float ShowFlow(const char* winname, T* U, T* V, int w, int h, float range = -1, int waittime = 1);
 	template <class T>
-	static void SaveFlowAsImage(const char* imgName, T* U, T* V, int w, int h, float range = -1);
+	static void SaveFlowAsImage(const char* imgName, T* U, T* V, int w, int h, float range = -1, int scale = 1);
 
 	template <class T>
 	static float ErrorImage(unsigned char* fillPix, T* u1, T* v1, T* u2, T* v2, int w, int h);
@@ -87,6 +92,14 @@ public:
 	static FlowErr CalcFlowError(T1* u1, T1* v1, T2* u2, T2*v2, int w, int h);
 
 private:
+	// split the interleaved payload of a flow file, the float flows use the vectorized flow_io.c versions
+	static void Deinterleave(float* U, float* V, const float* uv, int n) { flow_deinterleave(U, V, uv, n); }
+	template <class T>
+	static void Deinterleave(T* U, T* V, const float* uv, int n);
+	static void Interleave(float* uv, const float* U, const float* V, int n) { flow_interleave(uv, U, V, n); }
+	template <class T>
+	static void Interleave(float* uv, const T* U, const T* V, int n);
+
 	// first four bytes, should be the same in little endian
 	#define TAG_FLOAT 202021.25  // check for this when READING the file
 	#define TAG_STRING "PIEH"    // use this when WRITING the file
@@ -113,6 +126,21 @@ private:
 	static int makecolorwheel(T* colorwheel);
 	template <class T>
 	static void computeColor(double fx, double fy, unsigned char *pix, T* colorwheel, int ncols);
+
+	// colors of computeColor precomputed on a COLORLUT_SIZE x COLORLUT_SIZE grid of the normalized
+	// flow [-1,1]x[-1,1], BGRA packed in a word, built once on the first use
+	#define COLORLUT_SIZE 512
+	static const uint32_t* ColorLut();
+
+	// max flow magnitude of the known vectors of a row sampled every step pixels, as a squared value
+	static float MaxSquaredRadius(const float* U, const float* V, int n, int step);
+	template <class T>
+	static float MaxSquaredRadius(const T* U, const T* V, int n, int step);
+
+	// colors of a row sampled every step pixels with the lut, a*u+b is the lut column of u
+	static void MotionToColorRow(uint32_t* pix, const float* U, const float* V, int n, int step, const uint32_t* lut, float a, float b);
+	template <class T>
+	static void MotionToColorRow(uint32_t* pix, const T* U, const T* V, int n, int step, const uint32_t* lut, float a, float b);
 };
 
 template <class T>
@@ -244,6 +272,24 @@ bool OpticFlowIO::unknown_flow(T *f)
 	return unknown_flow(f[0], f[1]);
 }
 
+template <class T>
+void OpticFlowIO::Deinterleave(T* U, T* V, const float* uv, int n)
+{
+	for (int i = 0; i < n; i++){
+		U[i] = uv[2 * i];
+		V[i] = uv[2 * i + 1];
+	}
+}
+
+template <class T>
+void OpticFlowIO::Interleave(float* uv, const T* U, const T* V, int n)
+{
+	for (int i = 0; i < n; i++){
+		uv[2 * i] = U[i];
+		uv[2 * i + 1] = V[i];
+	}
+}
+
 template <class T>
 int OpticFlowIO::ReadFlowFile(T* U, T* V, int* w, int* h, const char* filename)
 {
@@ -253,71 +299,27 @@ int OpticFlowIO::ReadFlowFile(T* U, T* V, int* w, int* h, const char* filename)
 	}
 
 	const char *dot = strrchr(filename, '.');
-	if (strcmp(dot, ".flo") != 0){
-		printf("ReadFlowFile (%s): extension .flo expected\n", filename);
+	if (dot == NULL || (strcmp(dot, ".flo") != 0 && strcmp(dot, ".cflo") != 0)){
+		printf("ReadFlowFile (%s): extension .flo or .cflo expected\n", filename);
 		return -1;
 	}
 
-	FILE *stream = fopen(filename, "rb");
-	if (stream == 0){
-		printf("ReadFlowFile: could not open %s\n", filename);
-		return -1;
-	}
-
-	int width, height;
-	float tag;
-
-	if ((int)fread(&tag,    sizeof(float), 1, stream) != 1 
-		||(int)fread(&width,  sizeof(int),   1, stream) != 1 
-		||(int)fread(&height, sizeof(int),   1, stream) != 1)
-	{
+	flow_map_t map;
+	if (flow_map_open(&map, filename) != 0){
 		printf("ReadFlowFile: problem reading file %s\n", filename);
 		return -1;
 	}
 
-	if (tag != TAG_FLOAT) // simple test for correct endian-ness
-	{
-		printf("ReadFlowFile(%s): wrong tag (possibly due to big-endian machine?)\n", filename);
-		return -1;
-	}
-
-	// another sanity check to see that integers were read correctly (99999 should do the trick...)
-	if (width < 1 || width > 99999){
-		printf("ReadFlowFile(%s): illegal width %d\n", filename, width);
-		return -1;
-	}
+	Deinterleave(U, V, map.data, map.width * map.height);
+	*w = map.width;
+	*h = map.height;
 
-	if (height < 1 || height > 99999){
-		printf("ReadFlowFile(%s): illegal height %d\n", filename, height);
-		return -1;
-	}
-
-	for(int i=0; i<height; i++){
-		for(int j=0; j<width; j++){
-			float tmp[NUM_BANDS];
-			if ((int)fread(tmp, sizeof(float), NUM_BANDS, stream) != NUM_BANDS){
-				printf("ReadFlowFile(%s): file is too short\n", filename);
-				return -1;
-			}
-			U[i*width+j] = tmp[0];
-			V[i*width+j] = tmp[1];
-		}
-	}
-
-	if (fgetc(stream) != EOF){
-		printf("ReadFlowFile(%s): file is too long\n", filename);
-		return -1;
-	}
-
-	*w = width;
-	*h = height;
-
-	fclose(stream);
+	flow_map_close(&map);
 	return 0;
 }
 
 template <class T>
-int OpticFlowIO::WriteFlowFile(T* U, T* V, int w, int h, const char* filename)
+int OpticFlowIO::WriteFlowFile(T* U, T* V, int w, int h, const char* filename, int codec /*= FLOW_CODEC_FLOAT32*/)
 {
 	if (filename == NULL){
 		printf("WriteFlowFile: empty filename\n");
@@ -330,98 +332,181 @@ int OpticFlowIO::WriteFlowFile(T* U, T* V, int w, int h, const char* filename)
 		return -1;
 	}
 
-	if (strcmp(dot, ".flo") != 0){
-		printf("WriteFlowFile: filename '%s' should have extension '.flo'\n", filename);
+	bool packed = strcmp(dot, ".cflo") == 0;
+	if (strcmp(dot, ".flo") != 0 && !packed){
+		printf("WriteFlowFile: filename '%s' should have extension '.flo' or '.cflo'\n", filename);
 		return -1;
 	}
 
-	int width = w, height = h;
-
-	FILE *stream = fopen(filename, "wb");
-	if (stream == 0){
-		printf("WriteFlowFile: could not open %s\n", filename);
+	std::vector<float> uv(2 * w * h);
+	Interleave(&uv[0], U, V, w * h);
+	int err = packed ? flow_pack_write(filename, &uv[0], w, h, 2 * w, codec) : flow_write(filename, &uv[0], w, h, 2 * w);
+	if (err != 0){
+		printf("WriteFlowFile(%s): problem writing file\n", filename);
 		return -1;
 	}
-
-	// write the header
-	fprintf(stream, TAG_STRING);
-	if ((int)fwrite(&width,  sizeof(int),   1, stream) != 1 
-		||(int)fwrite(&height, sizeof(int),   1, stream) != 1)
-	{
-		printf("WriteFlowFile(%s): problem writing header\n", filename);
-		return -1;
-	}
-
-	// write the rows
-	for(int i=0; i<height; i++){
-		for(int j=0; j<width; j++){
-			float tmp[NUM_BANDS];
-			tmp[0] = U[i*width+j];
-			tmp[1] = V[i*width+j];
-			if ((int)fwrite(tmp, sizeof(float), NUM_BANDS, stream) != NUM_BANDS){
-				printf("WriteFlowFile(%s): problem writing data\n", filename);
-				return -1;
-			}
-		}
-	}
-
-	fclose(stream);
 	return 0;
 }
 
 template <class T>
-double OpticFlowIO::MotionToColor(unsigned char* fillPix, T* U, T* V, int w, int h, float range /*= -1*/)
+double OpticFlowIO::MotionToColor(unsigned char* fillPix, T* U, T* V, int w, int h, float range /*= -1*/, int scale /*= 1*/)
 {
+	if (scale < 1)
+		scale = 1;
+	int sw = (w + scale - 1) / scale, sh = (h + scale - 1) / scale;
+
 	// determine motion range:
 	double maxrad;
 
 	if (range > 0) {
 		maxrad = range;
-	}else{	// obtain the motion range according to the max flow
-		double maxu = -999, maxv = -999;
-		double minu = 999, minv = 999;
-		maxrad = -1;
-		for (int i = 0; i < h; i++){
-			for (int j = 0; j < w; j++){
-				double u = U[i*w + j];
-				double v = V[i*w + j];
-				if (unknown_flow(u, v))
-					continue;
-				maxu = __max(maxu, u);
-				maxv = __max(maxv, v);
-				minu = __min(minu, u);
-				minv = __min(minv, v);
-				double rad = sqrt(u * u + v * v);
-				maxrad = __max(maxrad, rad);
-			}
-		}
+	}else{	// obtain the motion range according to the max flow of the pixels shown
+		float maxrad2 = 0;
+		for (int i = 0; i < sh; i++)
+			maxrad2 = __max(maxrad2, MaxSquaredRadius(U + i*scale*w, V + i*scale*w, sw, scale));
+		maxrad = sqrt((double)maxrad2);
 		if (maxrad == 0) // if flow == 0 everywhere
 			maxrad = 1;
 	}
 
-	//printf("max motion: %.2f  motion range: u = [%.2f,%.2f];  v = [%.2f,%.2f]\n",
-	//	maxrad, minu, maxu, minv, maxv);
+	// lut index of the normalized flow u/maxrad clamped to [-1,1], rounded to nearest
+	const uint32_t* lut = ColorLut();
+	float a = (float)(0.5 * (COLORLUT_SIZE - 1) / maxrad);
+	float b = 0.5f * (COLORLUT_SIZE - 1) + 0.5f;
 
-	int colorwheel[MAXWHEELCOLS*3];
-	int ncols = makecolorwheel(colorwheel);
+	for (int i = 0; i < sh; i++)
+		MotionToColorRow((uint32_t*)fillPix + i*sw, U + i*scale*w, V + i*scale*w, sw, scale, lut, a, b);
 
-	for(int i=0; i<h; i++){
-		for(int j=0; j<w; j++){
-			int idx = i*w+j;
-			double u = U[idx];
-			double v = V[idx];
-			if (unknown_flow(u, v)){
-				memset(fillPix+idx*4, 0, 4);
-				fillPix[idx*4 + 3] = 0xff; // alpha channel, only for alignment
-			}else{
-				double dx = __min(__max(u / maxrad, -1), 1);
-				double dy = __min(__max(v / maxrad, -1), 1);
-				computeColor(dx, dy, (unsigned char*)(fillPix + idx * 4), colorwheel, ncols);
+	return maxrad;
+}
+
+inline const uint32_t* OpticFlowIO::ColorLut()
+{
+	struct Lut
+	{
+		uint32_t colors[COLORLUT_SIZE * COLORLUT_SIZE];
+		Lut()
+		{
+			int colorwheel[MAXWHEELCOLS*3];
+			int ncols = makecolorwheel(colorwheel);
+			for (int y = 0; y < COLORLUT_SIZE; y++){
+				double dy = 2.0 * y / (COLORLUT_SIZE - 1) - 1;
+				for (int x = 0; x < COLORLUT_SIZE; x++){
+					double dx = 2.0 * x / (COLORLUT_SIZE - 1) - 1;
+					// the max flow falls within a cell of the unit circle, keep it in range
+					double rad = sqrt(dx * dx + dy * dy), snap = 1 + sqrt(2.0) / (COLORLUT_SIZE - 1);
+					double f = rad > 1 && rad < snap ? 1 / rad : 1;
+					unsigned char pix[4];
+					computeColor(dx * f, dy * f, pix, colorwheel, ncols);
+					memcpy(colors + y*COLORLUT_SIZE + x, pix, 4);
+				}
 			}
 		}
+	};
+	static const Lut lut; // thread safe initialization in C++11
+	return lut.colors;
+}
+
+inline float OpticFlowIO::MaxSquaredRadius(const float* U, const float* V, int n, int step)
+{
+	float maxrad2 = 0;
+	int j = 0;
+#ifdef WITH_SSE
+	if (step == 1){
+		// the comparisons are false for NaN, which is unknown as well
+		const __m128 thresh = _mm_set1_ps((float)UNKNOWN_FLOW_THRESH);
+		const __m128 sign = _mm_set1_ps(-0.f);
+		__m128 max4 = _mm_setzero_ps();
+		for (; j + 4 <= n; j += 4){
+			__m128 u = _mm_loadu_ps(U + j);
+			__m128 v = _mm_loadu_ps(V + j);
+			__m128 known = _mm_and_ps(_mm_cmple_ps(_mm_andnot_ps(sign, u), thresh), _mm_cmple_ps(_mm_andnot_ps(sign, v), thresh));
+			__m128 rad2 = _mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(v, v));
+			max4 = _mm_max_ps(max4, _mm_and_ps(known, rad2));
+		}
+		float m[4];
+		_mm_storeu_ps(m, max4);
+		maxrad2 = __max(__max(m[0], m[1]), __max(m[2], m[3]));
 	}
+#endif
+	for (; j < n; j++){
+		float u = U[j*step], v = V[j*step];
+		if (!unknown_flow(u, v))
+			maxrad2 = __max(maxrad2, u * u + v * v);
+	}
+	return maxrad2;
+}
 
-	return maxrad;
+template <class T>
+float OpticFlowIO::MaxSquaredRadius(const T* U, const T* V, int n, int step)
+{
+	float maxrad2 = 0;
+	for (int j = 0; j < n; j++){
+		double u = U[j*step], v = V[j*step];
+		if (!unknown_flow(u, v))
+			maxrad2 = __max(maxrad2, (float)(u * u + v * v));
+	}
+	return maxrad2;
+}
+
+inline void OpticFlowIO::MotionToColorRow(uint32_t* pix, const float* U, const float* V, int n, int step,
+	const uint32_t* lut, float a, float b)
+{
+	uint32_t unknown;
+	const unsigned char unknown_pix[4] = { 0, 0, 0, 0xff }; // alpha channel, only for alignment
+	memcpy(&unknown, unknown_pix, 4);
+	int j = 0;
+#ifdef WITH_SSE
+	if (step == 1){
+		const __m128 thresh = _mm_set1_ps((float)UNKNOWN_FLOW_THRESH);
+		const __m128 sign = _mm_set1_ps(-0.f);
+		const __m128 a4 = _mm_set1_ps(a), b4 = _mm_set1_ps(b);
+		const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps((float)(COLORLUT_SIZE - 1));
+		for (; j + 4 <= n; j += 4){
+			__m128 u = _mm_loadu_ps(U + j);
+			__m128 v = _mm_loadu_ps(V + j);
+			__m128 known = _mm_and_ps(_mm_cmple_ps(_mm_andnot_ps(sign, u), thresh), _mm_cmple_ps(_mm_andnot_ps(sign, v), thresh));
+			// unknown lanes index the lut at 0, their color is replaced below
+			__m128 x = _mm_and_ps(known, _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(u, a4), b4), lo), hi));
+			__m128 y = _mm_and_ps(known, _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(v, a4), b4), lo), hi));
+			int ix[4], iy[4], k[4];
+			_mm_storeu_si128((__m128i*)ix, _mm_cvttps_epi32(x));
+			_mm_storeu_si128((__m128i*)iy, _mm_cvttps_epi32(y));
+			_mm_storeu_si128((__m128i*)k, _mm_castps_si128(known));
+			for (int l = 0; l < 4; l++)
+				pix[j + l] = k[l] ? lut[iy[l]*COLORLUT_SIZE + ix[l]] : unknown;
+		}
+	}
+#endif
+	for (; j < n; j++){
+		float u = U[j*step], v = V[j*step];
+		if (unknown_flow(u, v)){
+			pix[j] = unknown;
+		}else{
+			int x = (int)__min(__max(u * a + b, 0.f), (float)(COLORLUT_SIZE - 1));
+			int y = (int)__min(__max(v * a + b, 0.f), (float)(COLORLUT_SIZE - 1));
+			pix[j] = lut[y*COLORLUT_SIZE + x];
+		}
+	}
+}
+
+template <class T>
+void OpticFlowIO::MotionToColorRow(uint32_t* pix, const T* U, const T* V, int n, int step,
+	const uint32_t* lut, float a, float b)
+{
+	uint32_t unknown;
+	const unsigned char unknown_pix[4] = { 0, 0, 0, 0xff }; // alpha channel, only for alignment
+	memcpy(&unknown, unknown_pix, 4);
+	for (int j = 0; j < n; j++){
+		double u = U[j*step], v = V[j*step];
+		if (unknown_flow(u, v)){
+			pix[j] = unknown;
+		}else{
+			int x = (int)__min(__max(u * a + b, 0.), (double)(COLORLUT_SIZE - 1));
+			int y = (int)__min(__max(v * a + b, 0.), (double)(COLORLUT_SIZE - 1));
+			pix[j] = lut[y*COLORLUT_SIZE + x];
+		}
+	}
 }
 
 template <class T>
@@ -451,10 +536,12 @@ float OpticFlowIO::ShowFlow(const char* winname, T* U, T* V, int w, int h,
 }
 
 template <class T>
-void OpticFlowIO::SaveFlowAsImage(const char* imgName, T* U, T* V, int w, int h, float range /*= -1*/)
+void OpticFlowIO::SaveFlowAsImage(const char* imgName, T* U, T* V, int w, int h, float range /*= -1*/, int scale /*= 1*/)
 {
-	cv::Mat img(h, w, CV_8UC4);
-	float maxFlow = OpticFlowIO::MotionToColor(img.data, U, V, w, h, range);
+	if (scale < 1)
+		scale = 1;
+	cv::Mat img((h + scale - 1) / scale, (w + scale - 1) / scale, CV_8UC4);
+	float maxFlow = OpticFlowIO::MotionToColor(img.data, U, V, w, h, range, scale);
 
 #if 1
 	// get corner color
@@ -470,7 +557,11 @@ void OpticFlowIO::SaveFlowAsImage(const char* imgName, T* U, T* V, int w, int h,
     cv::putText(img, info, cv::Point(x, y), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(color[0], color[1], color[2]));
 #endif
 
-	cv::imwrite(imgName, img);
+	// a preview, the fastest compression level
+	vector<int> params;
+	params.push_back(IMWRITE_PNG_COMPRESSION);
+	params.push_back(1);
+	cv::imwrite(imgName, img, params);
 }
 
 template <class T>
@@ -126,6 +126,7 @@ public:
 	virtual bool loadImage(ifstream& myfile);
 #ifndef _MATLAB
 	virtual bool imread(const char* filename);
+	bool imread(const cv::Mat& image); // from an image already decoded by cv::imread
 	virtual bool imwrite(const char* filename) const;
 	virtual bool imwrite(const char* filename,ImageIO::ImageType) const;
 	virtual void imshow(char* winname, int waittime = 1) const;
@@ -936,6 +937,19 @@ bool Image<T>::imread(const char* filename)
 	return false;
 }
 
+template <class T>
+bool Image<T>::imread(const cv::Mat& image)
+{
+	clear();
+	if(image.data == NULL)
+		return false;
+	pData = (T*)xmalloc(sizeof(T) * image.total() * image.elemSize());
+	ImageIO::CvmatToPixels(image,pData,imWidth,imHeight,nChannels);
+	computeDimension();
+	colorType = BGR;
+	return true;
+}
+
 
 //template <class T>
 //bool Image<T>::imread(const QString &filename)
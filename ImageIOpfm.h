@@ -24,6 +24,6 @@ using namespace cv;
 using namespace std;
 
 int ReadFilePFM(Mat &im, string path);
-int WriteFilePFM(const Mat &im, string path, float scalef);
+int WriteFilePFM(const Mat &im, string path, float scalef = 1/255.0);
 
 #endif
\ No newline at end of file
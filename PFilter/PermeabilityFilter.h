@@ -4,6 +4,11 @@
 #include <opencv2/opencv.hpp>
 #include <cmath>
 #include <assert.h>
+#include <vector>
+
+#ifdef WITH_SSE
+#include <emmintrin.h>
+#endif
 
 #include "globals.h"
 #include "flowIO.h"
@@ -33,140 +38,453 @@ inline Vec2i getAbsoluteFlow(int x, int y, const Vec2f& flow, int h, int w)
         return kPOSITION_INVALID;
 }
 
+// Forward-backward distances of one row into dist, -1 where there is no forward flow, the target
+// position is outside the image or there is no backward flow at the target:
+//     D(X,Y) = ||F(X,Y) + B(X + Fx(X,Y), Y + Fy(X,Y))||
+// Returns the max distance of the row (-1 if there is none).
+inline float getFlowDistanceRow(const Mat2f& forward_flow, const Mat2f& backward_flow, int y, float* dist)
+{
+    const int h = forward_flow.rows;
+    const int w = forward_flow.cols;
+    const float* fwd = forward_flow.ptr<float>(y);
+    float max_distance = -1;
+    int x = 0;
+
+#ifdef WITH_SSE
+    const __m128 unknown = _mm_set1_ps(kMOVEMENT_UNKNOWN);
+    const __m128 fy = _mm_set1_ps((float)y);
+    const __m128i minus_one = _mm_set1_epi32(-1);
+    const __m128i w_i = _mm_set1_epi32(w);
+    const __m128i h_i = _mm_set1_epi32(h);
+    __m128 max4 = _mm_set1_ps(-1.f);
+    for (; x + 4 <= w; x += 4)
+    {
+        // de-interleave 4 forward vectors
+        __m128 a = _mm_loadu_ps(fwd + 2 * x);
+        __m128 b = _mm_loadu_ps(fwd + 2 * x + 4);
+        __m128 u = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 v = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+        // target positions, rounded to nearest like cvRound
+        __m128 fx = _mm_set_ps((float)(x + 3), (float)(x + 2), (float)(x + 1), (float)x);
+        __m128i tx = _mm_cvtps_epi32(_mm_add_ps(fx, u));
+        __m128i ty = _mm_cvtps_epi32(_mm_add_ps(fy, v));
+
+        // 0 <= tx < w and 0 <= ty < h
+        __m128i inside = _mm_and_si128(
+            _mm_and_si128(_mm_cmpgt_epi32(tx, minus_one), _mm_cmpgt_epi32(w_i, tx)),
+            _mm_and_si128(_mm_cmpgt_epi32(ty, minus_one), _mm_cmpgt_epi32(h_i, ty)));
+        __m128 known = _mm_and_ps(_mm_cmpneq_ps(u, unknown), _mm_cmpneq_ps(v, unknown));
+        __m128 valid = _mm_and_ps(known, _mm_castsi128_ps(inside));
+
+        // gather the backward vectors of the valid lanes
+        int mask = _mm_movemask_ps(valid);
+        float bu[4] = {0, 0, 0, 0}, bv[4] = {0, 0, 0, 0};
+        if (mask)
+        {
+            int txs[4], tys[4];
+            _mm_storeu_si128((__m128i*)txs, tx);
+            _mm_storeu_si128((__m128i*)tys, ty);
+            for (int k = 0; k < 4; k++)
+            {
+                if (mask & (1 << k))
+                {
+                    const Vec2f& backward = backward_flow(tys[k], txs[k]);
+                    bu[k] = backward[0];
+                    bv[k] = backward[1];
+                }
+            }
+        }
+        __m128 bu4 = _mm_loadu_ps(bu);
+        __m128 bv4 = _mm_loadu_ps(bv);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpneq_ps(bu4, unknown), _mm_cmpneq_ps(bv4, unknown)));
+
+        __m128 du = _mm_add_ps(u, bu4);
+        __m128 dv = _mm_add_ps(v, bv4);
+        __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(du, du), _mm_mul_ps(dv, dv)));
+        d = _mm_or_ps(_mm_and_ps(valid, d), _mm_andnot_ps(valid, _mm_set1_ps(-1.f)));
+        max4 = _mm_max_ps(max4, d);
+        _mm_storeu_ps(dist + x, d);
+    }
+    float max_lanes[4];
+    _mm_storeu_ps(max_lanes, max4);
+    for (int k = 0; k < 4; k++)
+        max_distance = std::max(max_distance, max_lanes[k]);
+#endif
+
+    for (; x < w; x++)
+    {
+        float distance = -1;
+        Vec2f foward(fwd[2 * x], fwd[2 * x + 1]);
+        // If there is forward flow for the position F(x,y)
+        if (foward[0] != kFLOW_UNKNOWN[0] && foward[1] != kFLOW_UNKNOWN[1])
+        {
+            Vec2i next_position = getAbsoluteFlow(x, y, foward, h, w);
+            if (next_position != kPOSITION_INVALID)
+            {
+                // If there is backward flow for the refered position B(x + F(x,y).x,y + F(x,y).y)
+                const Vec2f& backward = backward_flow(next_position[0], next_position[1]);
+                if (backward[0] != kFLOW_UNKNOWN[0] && backward[1] != kFLOW_UNKNOWN[1])
+                {
+                    float du = foward[0] + backward[0];
+                    float dv = foward[1] + backward[1];
+                    distance = sqrt(du * du + dv * dv);
+                }
+            }
+        }
+        dist[x] = distance;
+        max_distance = std::max(max_distance, distance);
+    }
+    return max_distance;
+}
+
 // Computes the normalized confidence map C between forward flow F and backward flow B
 // First, the disntance D at every position (X,Y) is computed :
 //     D(X,Y) = ||F(X,Y) - B(X + Fx(X,Y),y + Fy(X,Y))||
 // Then, normalized confidence map C is computed :
 //     C' = 1 - D / max(D)
-inline Mat1f getFlowConfidence(Mat2f forward_flow, Mat2f backward_flow)
+// C is written into confidence, which is only (re)allocated if it does not match the flow size.
+// If confidenced_flow is given, the confidence weighted flow F * C is written into it in the same
+// pass.
+inline void getFlowConfidence(const Mat2f& forward_flow, const Mat2f& backward_flow, Mat1f& confidence, Mat2f* confidenced_flow = 0)
 {
-    Mat1f distances = Mat1f(forward_flow.rows, forward_flow.cols, -1);
+    const int h = forward_flow.rows;
+    const int w = forward_flow.cols;
+    confidence.create(h, w);
+    if (confidenced_flow)
+        confidenced_flow->create(h, w);
 
-    int h = forward_flow.rows;
-    int w = forward_flow.cols;
+    // Computes the distance between forward and backwards flow, each thread keeps its own max
     float max_distance = -1;
+    #pragma omp parallel for reduction(max:max_distance)
+    for (int y = 0; y < h; ++y)
+    {
+        float row_max = getFlowDistanceRow(forward_flow, backward_flow, y, confidence.ptr<float>(y));
+        if (row_max > max_distance)
+            max_distance = row_max;
+    }
 
-    // Computes the distance between forward and backwards flow
+    // If there is no difference between F and B, C = 1, otherwise C = 1 - normalized distance and
+    // C = 0 for unknown flow
+    const bool same = !(max_distance > 0);
     #pragma omp parallel for
-    for(int y = 0; y < h ; ++y)
+    for (int y = 0; y < h; ++y)
+    {
+        float* c_row = confidence.ptr<float>(y);
+        int x = 0;
+        if (same)
+        {
+            for (; x < w; x++)
+                c_row[x] = 1;
+        }
+        else
+        {
+#ifdef WITH_SSE
+            const __m128 max4 = _mm_set1_ps(max_distance);
+            const __m128 zero = _mm_setzero_ps();
+            for (; x + 4 <= w; x += 4)
+            {
+                __m128 d = _mm_loadu_ps(c_row + x);
+                __m128 c = _mm_div_ps(_mm_sub_ps(max4, d), max4);
+                _mm_storeu_ps(c_row + x, _mm_and_ps(_mm_cmpge_ps(d, zero), c));
+            }
+#endif
+            for (; x < w; x++)
+                c_row[x] = c_row[x] < 0 ? 0 : (max_distance - c_row[x]) / max_distance;
+        }
+
+        if (confidenced_flow)
+        {
+            const float* f_row = forward_flow.ptr<float>(y);
+            float* cf_row = confidenced_flow->ptr<float>(y);
+            for (int k = 0; k < w; k++)
+            {
+                cf_row[2 * k] = f_row[2 * k] * c_row[k];
+                cf_row[2 * k + 1] = f_row[2 * k + 1] * c_row[k];
+            }
+        }
+    }
+}
+
+inline Mat1f getFlowConfidence(Mat2f forward_flow, Mat2f backward_flow)
+{
+    Mat1f confidence;
+    getFlowConfidence(forward_flow, backward_flow, confidence);
+    return confidence;
+}
+
+// Sparse CPM matches are kept as they come out of CPM::Matching, one row x1 y1 x2 y2 per match. A match
+// stands for the flow (x2 - x1, y2 - y1) on the 3x3 block around (x1, y1), clamped to the image, and a
+// later match overwrites an earlier one, like Match2Flow splats them into dense images.
+// A match outside the image still covers the clamped border pixels.
+inline void getMatchBlock(const float* match, int h, int w, int& x0, int& x1, int& y0, int& y1)
+{
+    x0 = std::min(std::max((int)(match[0] - 1), 0), w - 1);
+    x1 = std::min(std::max((int)(match[0] + 1), 0), w - 1);
+    y0 = std::min(std::max((int)(match[1] - 1), 0), h - 1);
+    y1 = std::min(std::max((int)(match[1] + 1), 0), h - 1);
+}
+
+// owner(Y,X) = index + 1 of the last match whose block covers (X,Y), 0 where there is none.
+// owner is only (re)allocated if it does not match the size, and zeroed.
+inline void getMatchOwners(const Mat1f& matches, int h, int w, Mat1i& owner)
+{
+    owner.create(h, w);
+    owner.setTo(0);
+    for (int i = 0; i < matches.rows; ++i)
+    {
+        int x0, x1, y0, y1;
+        getMatchBlock(matches.ptr<float>(i), h, w, x0, x1, y0, y1);
+        for (int y = y0; y <= y1; ++y)
+        {
+            int* o_row = owner.ptr<int>(y);
+            for (int x = x0; x <= x1; ++x)
+                o_row[x] = i + 1;
+        }
+    }
+}
+
+// Owner maps of the forward and backward matches, reused across frames
+struct MatchOwners
+{
+    Mat1i forward;
+    Mat1i backward;
+};
+
+// Same confidence map C and confidence weighted flow F * C as above for sparse forward and backward
+// matches, without the dense flow images: confidence and confidenced_flow are zeroed, then only the
+// pixels covered by a forward match are written, each one by the match which owns it. Where no
+// forward-backward distance is defined C = 0, where every distance is 0 C = 1.
+inline void getFlowConfidence(const Mat1f& forward_matches, const Mat1f& backward_matches, int h, int w,
+                              Mat1f& confidence, Mat2f& confidenced_flow, MatchOwners& owners)
+{
+    confidence.create(h, w);
+    confidence.setTo(0);
+    confidenced_flow.create(h, w);
+    confidenced_flow.setTo(Scalar::all(0));
+    getMatchOwners(forward_matches, h, w, owners.forward);
+    getMatchOwners(backward_matches, h, w, owners.backward);
+
+    // Forward-backward distances of the owned pixels, -1 where the target is outside the image or
+    // has no backward flow
+    float max_distance = -1;
+    #pragma omp parallel for schedule(dynamic, 256) reduction(max:max_distance)
+    for (int i = 0; i < forward_matches.rows; ++i)
     {
-        for(int x = 0; x < w ; ++x)
+        const float* m = forward_matches.ptr<float>(i);
+        const float u = m[2] - m[0], v = m[3] - m[1];
+        int x0, x1, y0, y1;
+        getMatchBlock(m, h, w, x0, x1, y0, y1);
+        for (int y = y0; y <= y1; ++y)
         {
-            // If there is forward flow for the position F(x,y)
-            Vec2f foward = forward_flow.at<Vec2f>(y, x);
-            if(foward[0] != kFLOW_UNKNOWN[0] && foward[1] != kFLOW_UNKNOWN[1])
+            const int* o_row = owners.forward.ptr<int>(y);
+            float* c_row = confidence.ptr<float>(y);
+            for (int x = x0; x <= x1; ++x)
             {
-                Vec2i next_position = getAbsoluteFlow(x, y, foward, h, w);
-                if(next_position != kPOSITION_INVALID)
+                if (o_row[x] != i + 1)
+                    continue;
+                float distance = -1;
+                Vec2i next_position = getAbsoluteFlow(x, y, Vec2f(u, v), h, w);
+                if (next_position != kPOSITION_INVALID)
                 {
-                    // If there is backward flow for the refered position B(x + F(x,y).x,y + F(x,y).y)
-                    Vec2f backward = backward_flow.at<Vec2f>(next_position[0], next_position[1]);
-                    if(backward[0] != kFLOW_UNKNOWN[0] && backward[1] != kFLOW_UNKNOWN[1])
+                    const int j = owners.backward(next_position[0], next_position[1]);
+                    if (j > 0)
                     {
-                        // computes the distance
-                        float distance = (float)norm(foward + backward);
-
-                        // Updates the max distance, if required
-                        if(distance > max_distance)
-                        {
-                            #pragma omp critical
-                            {
-                                if(distance > max_distance)
-                                    max_distance = distance;
-                            }
-                        }
-
-                        // Updates the distance map
-                        distances.at<float>(y, x) = distance;
+                        const float* b = backward_matches.ptr<float>(j - 1);
+                        float du = u + (b[2] - b[0]);
+                        float dv = v + (b[3] - b[1]);
+                        distance = sqrt(du * du + dv * dv);
                     }
                 }
+                c_row[x] = distance;
+                if (distance > max_distance)
+                    max_distance = distance;
             }
         }
     }
 
-    // If there is a difference between F and B
-    if(max_distance > 0)
+    // C = 1 - normalized distance, and F * C, on the same pixels
+    const bool same = !(max_distance > 0);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (int i = 0; i < forward_matches.rows; ++i)
     {
-        // Computes the normalized confidence map
-        #pragma omp parallel for
-        for(int y = 0; y < h ; ++y)
+        const float* m = forward_matches.ptr<float>(i);
+        const float u = m[2] - m[0], v = m[3] - m[1];
+        int x0, x1, y0, y1;
+        getMatchBlock(m, h, w, x0, x1, y0, y1);
+        for (int y = y0; y <= y1; ++y)
         {
-            for(int x = 0; x < w ; ++x)
+            const int* o_row = owners.forward.ptr<int>(y);
+            float* c_row = confidence.ptr<float>(y);
+            float* cf_row = confidenced_flow.ptr<float>(y);
+            for (int x = x0; x <= x1; ++x)
             {
-                //printf("\n y is %d \n",y);
-                //printf("\n x is %d \n",x);
-                //printf("this distance is %f!\n", distances.at<float>(y, x));
-                if(distances.at<float>(y, x) < 0)
-                {
-                    // Unknown flow, C = 0
-                    distances.at<float>(y, x) = 0;
-                    //printf("0 max distance!\n\n");
-                }
-                else
-                {
-                    // C = 1 - normalized distance
-                    //printf("max distance is %f\n", max_distance);
-                    distances.at<float>(y, x) = (max_distance - distances.at<float>(y, x)) / max_distance;
-                    //printf("result distance is %f!\n\n", distances.at<float>(y, x));
-                }
-                if (distances.at<float>(y, x) > 1 || distances.at<float>(y, x) < 0) printf("wrong!");
+                if (o_row[x] != i + 1)
+                    continue;
+                float c = c_row[x] < 0 ? 0 : same ? 1 : (max_distance - c_row[x]) / max_distance;
+                c_row[x] = c;
+                cf_row[2 * x] = u * c;
+                cf_row[2 * x + 1] = v * c;
             }
         }
-        //printf("max distance is %d\n", max_distance);
-        return distances;
     }
-    else
+}
+
+// Permeability maps of the spatial filter for one guide image I (Equation 3.2 in Michel's paper)
+//     horizontal(y,x) = (1 + (||I(y,x) - I(y,x+1)|| / (sqrt(3) * delta_XY))^alpha_XY)^-1
+//     vertical(y,x)   = (1 + (||I(y,x) - I(y+1,x)|| / (sqrt(3) * delta_XY))^alpha_XY)^-1
+// The last column of horizontal and the last row of vertical have no neighbour, they are set to 0
+// and never read by the passes of filterXY.
+// The maps only depend on the guide image and on delta_XY / alpha_XY, so one instance is kept per
+// frame and shared by every filterXY call on that frame (confidence, flow, re-runs).
+struct SpatialPermeability
+{
+    Mat1f horizontal;
+    Mat1f vertical;
+    Mat source;     // guide image the maps were computed from, keeps its buffer alive
+    float delta_XY;
+    float alpha_XY;
+
+    SpatialPermeability() : delta_XY(-1), alpha_XY(-1) {}
+
+    bool isValidFor(const Mat& src, float delta, float alpha) const
+    {
+        return !horizontal.empty() && source.data == src.data && source.size() == src.size()
+            && delta_XY == delta && alpha_XY == alpha;
+    }
+};
+
+// dst[k] = (a[k] - b[k])^2, 0 <= k < n
+inline void squaredDifference(const float* a, const float* b, float* dst, int n)
+{
+    int k = 0;
+#ifdef WITH_SSE
+    for (; k + 4 <= n; k += 4)
     {
-        // Forward and backwards flow are the same, C = 1
-        return Mat1f::ones(forward_flow.rows, forward_flow.cols);
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k));
+        _mm_storeu_ps(dst + k, _mm_mul_ps(d, d));
+    }
+#endif
+    for (; k < n; k++)
+    {
+        float d = a[k] - b[k];
+        dst[k] = d * d;
     }
 }
 
+// dst[x] = sum of the cn interleaved channels of src at x, 0 <= x < n
+inline void sumChannels(const float* src, float* dst, int n, int cn)
+{
+    if (cn == 3)
+    {
+        for (int x = 0; x < n; x++)
+            dst[x] = src[3 * x] + src[3 * x + 1] + src[3 * x + 2];
+    }
+    else
+    {
+        for (int x = 0; x < n; x++)
+        {
+            float sum = 0;
+            for (int c = 0; c < cn; c++)
+                sum += src[cn * x + c];
+            dst[x] = sum;
+        }
+    }
+}
 
+// Maps squared distances d2 to permeabilities
+//     perm = (1 + (d2 / (3 * delta^2))^(alpha / 2))^-1
+// which equals (1 + (sqrt(d2) / (sqrt(3) * delta))^alpha)^-1. The default alpha = 2 needs
+// neither sqrt nor pow.
+inline void permeabilityFromSquaredDistance(const float* d2, float* perm, int n, float delta, float alpha)
+{
+    const float scale = 1.f / (3.f * delta * delta);
+    int x = 0;
+    if (alpha == 2.f)
+    {
+#ifdef WITH_SSE
+        const __m128 one = _mm_set1_ps(1.f);
+        const __m128 s = _mm_set1_ps(scale);
+        for (; x + 4 <= n; x += 4)
+        {
+            __m128 d = _mm_loadu_ps(d2 + x);
+            _mm_storeu_ps(perm + x, _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(d, s))));
+        }
+#endif
+        for (; x < n; x++)
+            perm[x] = 1.f / (1.f + d2[x] * scale);
+    }
+    else
+    {
+        const float half_alpha = 0.5f * alpha;
+        for (; x < n; x++)
+            perm[x] = 1.f / (1.f + pow(d2[x] * scale, half_alpha));
+    }
+}
 
+// Computes horizontal and vertical permeability of src in a single pass over its rows, without
+// shifted copies or transposes. Does nothing if perm already holds the maps for src.
 template <class TSrc>
-Mat1f computeSpatialPermeability(Mat_<TSrc> src, float delta_XY, float alpha_XY)
+void computeSpatialPermeability(const Mat_<TSrc>& src, float delta_XY, float alpha_XY, SpatialPermeability& perm)
 {
-    //printf("bp2.0");
-    Mat_<TSrc> I = src;
-    int h = I.rows;
-    int w = I.cols;
-    int num_channels = I.channels();
-
-    // horizontal & vertical difference
-
-    Mat_<TSrc> I_shifted = Mat_<TSrc>::zeros(h,w);
-    Mat warp_mat = (Mat_<double>(2,3) <<1,0,-1, 0,1,0);
-    warpAffine(I, I_shifted, warp_mat, I_shifted.size()); // could also use rect() to translate image
-
-    // Equation 3.2 in Michel's Paper
-    Mat_<TSrc> diff_perm = Mat_<TSrc>::zeros(h,w);
-    diff_perm = I - I_shifted; // Ip - Ip' with 3 channels
-    std::vector<Mat1f> diff_channels(num_channels);
-    split(diff_perm, diff_channels);
-    Mat1f dJdx = Mat1f::zeros(h, w);
-    //printf("bp2.1");
-    for (int c = 0; c < num_channels; c++) // ||Ip - Ip'|| via spliting 3 channels and do pow() and then sum them up and then sqrt()
+    if (perm.isValidFor(src, delta_XY, alpha_XY))
+        return;
+
+    assert(src.depth() == CV_32F);
+    const int h = src.rows;
+    const int w = src.cols;
+    const int cn = src.channels();
+
+    perm.horizontal.create(h, w);
+    perm.vertical.create(h, w);
+
+    #pragma omp parallel
     {
-        Mat1f temp = Mat1f::zeros(h,w);
-        temp = diff_channels[c];
-        pow(temp, 2, temp);
-        dJdx = dJdx + temp;
-    }
-    //printf("bp2.3");
-    sqrt(dJdx, dJdx);
-    //printf("bp2.4");
-    Mat1f result = Mat1f::zeros(h,w); // finish the rest of the equation and return permeability map stored in "result"
-    result = abs(dJdx / (sqrt(3) * delta_XY) );
-    pow(result, alpha_XY, result);
-    pow(1 + result, -1, result);
-    //printf("bp2.5");
-    return result;
+        // per thread row buffers: squared channel differences and their sums
+        std::vector<float> sq(w * cn);
+        std::vector<float> d2(w);
+
+        #pragma omp for
+        for (int y = 0; y < h; y++)
+        {
+            const float* row = src.template ptr<float>(y);
+            float* perm_h = perm.horizontal.template ptr<float>(y);
+            float* perm_v = perm.vertical.template ptr<float>(y);
+
+            // horizontal: I(y,x) - I(y,x+1)
+            if (w > 1)
+            {
+                squaredDifference(row, row + cn, &sq[0], (w - 1) * cn);
+                sumChannels(&sq[0], &d2[0], w - 1, cn);
+                permeabilityFromSquaredDistance(&d2[0], perm_h, w - 1, delta_XY, alpha_XY);
+            }
+            perm_h[w - 1] = 0;
+
+            // vertical: I(y,x) - I(y+1,x)
+            if (y + 1 < h)
+            {
+                squaredDifference(row, src.template ptr<float>(y + 1), &sq[0], w * cn);
+                sumChannels(&sq[0], &d2[0], w, cn);
+                permeabilityFromSquaredDistance(&d2[0], perm_v, w, delta_XY, alpha_XY);
+            }
+            else
+            {
+                for (int x = 0; x < w; x++)
+                    perm_v[x] = 0;
+            }
+        }
+    }
+
+    perm.source = src;
+    perm.delta_XY = delta_XY;
+    perm.alpha_XY = alpha_XY;
 }
 
+// Spatial filtering of J guided by src. perm caches the permeability maps of src, pass the same
+// instance to every call on the same frame to compute them only once.
 template <class TSrc, class TValue>
 //Mat_<TValue> filterXY(Mat_<TSrc> src, Mat_<TValue> J, float iterations_para = 5, int lambda_XY_para = 0, float delta_XY_para = 0.017, float alpha_XY_para = 2)
-Mat_<TValue> filterXY(Mat_<TSrc> src, Mat_<TValue> J, cpm_pf_params_t &cpm_pf_params)
+Mat_<TValue> filterXY(Mat_<TSrc> src, Mat_<TValue> J, cpm_pf_params_t &cpm_pf_params, SpatialPermeability &perm)
 {
     //printf("bp1");
     // Input image
@@ -217,17 +535,10 @@ Mat_<TValue> filterXY(Mat_<TSrc> src, Mat_<TValue> J, cpm_pf_params_t &cpm_pf_pa
     }
     */
 
-    //compute spatial permeability
-    //compute horizontal filtered image
-    Mat1f perm_horizontal;
-    Mat1f perm_vertical;
-    perm_horizontal = computeSpatialPermeability<TSrc>(I, delta_XY, alpha_XY);
-    //perm_horizontal = perm_horizontal * 255;
-    //compute vertial filtered image
-    Mat_<TSrc> I_t = I.t();
-    perm_vertical = computeSpatialPermeability<TSrc>(I_t, delta_XY, alpha_XY);
-    perm_vertical = perm_vertical.t();
-    //perm_vertical = perm_vertical * 255;
+    //compute spatial permeability (horizontal and vertical), reused if already cached for src
+    computeSpatialPermeability<TSrc>(I, delta_XY, alpha_XY, perm);
+    const Mat1f& perm_horizontal = perm.horizontal;
+    const Mat1f& perm_vertical = perm.vertical;
 /*
     for (int x=0, y=0; y < 1 && x < 500; x++) {
         printf("\n y is %d \n",y);
@@ -551,283 +862,438 @@ Mat_<TValue> filterXY(Mat_<TSrc> src, Mat_<TValue> J, cpm_pf_params_t &cpm_pf_pa
     return J_XY;
 }
 
-template <class TSrc>
-Mat1f computeTemporalPermeability(Mat_<TSrc> I, Mat_<TSrc> I_prev, Mat2f flow_XY, Mat2f flow_prev_XYT, float delta_photo, float delta_grad, float alpha_photo, float alpha_grad)
+template <class TSrc, class TValue>
+Mat_<TValue> filterXY(Mat_<TSrc> src, Mat_<TValue> J, cpm_pf_params_t &cpm_pf_params)
 {
-    int h = I.rows;
-    int w = I.cols;
-    int num_channels = I.channels();
-    int num_channels_flow = flow_XY.channels();
-
-    Mat1f perm_temporal = Mat1f::zeros(h,w);
-    Mat1f perm_gradient = Mat1f::zeros(h,w);
-    Mat1f perm_photo = Mat1f::zeros(h,w);
-
-    printf("bpt1.1\n");
-
+    SpatialPermeability perm;
+    return filterXY<TSrc, TValue>(src, J, cpm_pf_params, perm);
+}
 
-    //printf("h is %d\n",h);
-    //printf("w is %d\n",w);
-    //int hh = flow_prev_maps[0].rows;
-    //int ww = flow_prev_maps[0].cols;
-    //printf("hh is %d\n",hh);
-    //printf("ww is %d\n",ww);
+// Backward warp map of the previous frame along its XYT flow, in the layout remap expects
+//     map_x(y,x) = x - Fx(y,x) , map_y(y,x) = y - Fy(y,x)
+inline void getTemporalWarpMap(const Mat2f& flow_prev_XYT, Mat1f& map_x, Mat1f& map_y)
+{
+    const int h = flow_prev_XYT.rows;
+    const int w = flow_prev_XYT.cols;
+    map_x.create(h, w);
+    map_y.create(h, w);
 
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++)
+    {
+        const float* flow = flow_prev_XYT.ptr<float>(y);
+        float* mx = map_x.ptr<float>(y);
+        float* my = map_y.ptr<float>(y);
+        for (int x = 0; x < w; x++)
+        {
+            mx[x] = x - flow[2 * x];
+            my[x] = y - flow[2 * x + 1];
+        }
+    }
+}
 
-    printf("bpt1.2\n");
-    Mat_<TSrc> I_prev_warped = Mat_<TSrc>::zeros(h,w);
+// Bilinear sampling positions of a warp, shared by every image warped along the same map.
+// origin(y,x) is the top-left tap (x0, y0) and frac(y,x) the fractional offsets (ax, ay).
+// Taps outside the source contribute 0, like remap with BORDER_CONSTANT.
+struct BilinearWarpMap
+{
+    Mat_<Vec2i> origin;
+    Mat2f frac;
+    int src_rows;
+    int src_cols;
+};
+
+// Backward warp map of the previous frame for warpBilinear, see getTemporalWarpMap above
+inline void getTemporalWarpMap(const Mat2f& flow_prev_XYT, BilinearWarpMap& map)
+{
+    const int h = flow_prev_XYT.rows;
+    const int w = flow_prev_XYT.cols;
+    map.origin.create(h, w);
+    map.frac.create(h, w);
+    map.src_rows = h;
+    map.src_cols = w;
 
-    Mat2f prev_map = Mat2f::zeros(h,w);
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++){
-            prev_map(y,x)[0] = x - flow_prev_XYT(y,x)[0];
-            prev_map(y,x)[1] = y - flow_prev_XYT(y,x)[1];
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++)
+    {
+        const float* flow = flow_prev_XYT.ptr<float>(y);
+        Vec2i* origin = map.origin[y];
+        Vec2f* frac = map.frac[y];
+        for (int x = 0; x < w; x++)
+        {
+            float mx = x - flow[2 * x];
+            float my = y - flow[2 * x + 1];
+            if (mx > -1 && mx < w && my > -1 && my < h)
+            {
+                int x0 = cvFloor(mx);
+                int y0 = cvFloor(my);
+                origin[x] = Vec2i(x0, y0);
+                frac[x] = Vec2f(mx - x0, my - y0);
+            }
+            else
+            {
+                // every tap outside (also catches unknown / NaN flow)
+                origin[x] = Vec2i(-2, -2);
+                frac[x] = Vec2f(0, 0);
+            }
         }
     }
-    std::vector<Mat1f> prev_maps(num_channels_flow);
-    split(prev_map, prev_maps);
-    remap(I_prev, I_prev_warped, prev_maps[0], prev_maps[1], cv::INTER_CUBIC);
-    /*
-    imwrite("I_prev_warped_negative.jpg", I_prev_warped * 255.);
-    namedWindow( "img_window", WINDOW_AUTOSIZE );
-    imshow( "img_window", I_prev );
-    namedWindow( "remap_window", WINDOW_AUTOSIZE );
-    imshow( "remap_window", I_prev_warped );
-    waitKey(0);
-    */
-    // Equation 11
-    printf("bpt1.3\n");
-    Mat_<TSrc> diff_I = I - I_prev_warped;
-    std::vector<Mat1f> diff_I_channels(num_channels);
-    split(diff_I, diff_I_channels);
-    Mat1f sum_diff_I = Mat1f::zeros(h, w);
-    for (int c = 0; c < num_channels; c++)
+}
+
+// One bilinear sample of a cn-channel float image, p0 / p1 point to tap (x0, y0) / (x0, y0 + 1),
+// all four taps are inside. CN = 2 and CN = 3 have SSE paths, CN = 0 handles any cn.
+template <int CN>
+inline void sampleBilinear(const float* p0, const float* p1, float ax, float ay, int cn, bool can_overread, float* out)
+{
+    const float w00 = (1 - ax) * (1 - ay), w01 = ax * (1 - ay);
+    const float w10 = (1 - ax) * ay, w11 = ax * ay;
+#ifdef WITH_SSE
+    if (CN == 2)
     {
-        Mat1f temp = Mat1f::zeros(h,w);
-        temp = diff_I_channels[c];
-        pow(temp, 2, temp);
-        sum_diff_I = sum_diff_I + temp;
+        // [c0 c1] of both horizontal taps in one register per row
+        __m128 top = _mm_mul_ps(_mm_loadu_ps(p0), _mm_setr_ps(w00, w00, w01, w01));
+        __m128 bottom = _mm_mul_ps(_mm_loadu_ps(p1), _mm_setr_ps(w10, w10, w11, w11));
+        __m128 sum = _mm_add_ps(top, bottom);
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        _mm_storel_pi((__m64*)out, sum);
+        return;
     }
-    sqrt(sum_diff_I, sum_diff_I);
-    pow(abs(sum_diff_I / (sqrt(3) * delta_photo)), alpha_photo, perm_photo);
-    pow(1 + perm_photo, -1, perm_photo);
-
-/*
-    namedWindow( "perm_photo_window", WINDOW_AUTOSIZE );
-    imshow( "perm_photo_window", perm_photo );
-    waitKey(0);
-    //imwrite("perm_photo.jpg", perm_photo * 255.);
-*/
-
-
-    Mat2f flow_prev_XYT_warped  = Mat2f::zeros(h,w);;
-    remap(flow_prev_XYT, flow_prev_XYT_warped, prev_maps[0], prev_maps[1], cv::INTER_CUBIC);
-    // Equation 12
-    printf("bpt1.5\n");
-    Mat2f diff_flow = flow_XY - flow_prev_XYT_warped;
-    std::vector<Mat1f> diff_flow_channels(num_channels_flow);
-    split(diff_flow, diff_flow_channels);
-    Mat1f sum_diff_flow = Mat1f::zeros(h, w);
-    for (int c = 0; c < num_channels_flow; c++)
+    if (CN == 3 && can_overread)
     {
-        Mat1f temp = Mat1f::zeros(h,w);
-        temp = diff_flow_channels[c];
-        pow(temp, 2, temp);
-        sum_diff_flow = sum_diff_flow + temp;
-    }
-    sqrt(sum_diff_flow, sum_diff_flow);
-    pow(abs(sum_diff_flow / (sqrt(2) * delta_grad)), alpha_grad, perm_gradient);
-    pow(1 + perm_gradient, -1, perm_gradient);
-/*
-    namedWindow( "perm_gradient_window", WINDOW_AUTOSIZE );
-    imshow( "perm_gradient_window", perm_gradient );
-    waitKey(0);
-    //imwrite("perm_gradient.jpg", perm_gradient * 255.);
-*/
-
-
-    printf("bpt1.6\n");
-
-    Mat perm_temporalMat = perm_photo.mul(perm_gradient);
-    printf("bpt1.7\n");
-    perm_temporalMat.convertTo(perm_temporal, CV_32FC1);
-    printf("bpt1.8\n");
-    //namedWindow( "perm_temporal_window", WINDOW_AUTOSIZE );
-    //imshow( "perm_temporal_window", perm_temporal );
-    //waitKey(0);
-    return perm_temporal;
+        // loads 4 floats per tap, the 4th lane belongs to the next pixel and is dropped
+        __m128 sum = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p0), _mm_set1_ps(w00)), _mm_mul_ps(_mm_loadu_ps(p0 + 3), _mm_set1_ps(w01))),
+            _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p1), _mm_set1_ps(w10)), _mm_mul_ps(_mm_loadu_ps(p1 + 3), _mm_set1_ps(w11))));
+        float lanes[4];
+        _mm_storeu_ps(lanes, sum);
+        out[0] = lanes[0];
+        out[1] = lanes[1];
+        out[2] = lanes[2];
+        return;
+    }
+#endif
+    const int n = CN ? CN : cn;
+    for (int c = 0; c < n; c++)
+        out[c] = w00 * p0[c] + w01 * p0[n + c] + w10 * p1[c] + w11 * p1[n + c];
 }
 
-template <class TSrc, class TValue>
-//Mat_<TValue> filterT(Mat_<TSrc> src, Mat_<TSrc> src_prev, Mat_<TValue> J_XY, Mat_<TValue> J_prev_XY, Mat2f flow_XY, Mat2f flow_prev_XYT, Mat_<TValue> l_t_prev, Mat_<TValue> l_t_normal_prev)
-vector<Mat_<TValue> > filterT(Mat_<TSrc> src, Mat_<TSrc> src_prev, Mat_<TValue> J_XY, Mat_<TValue> J_prev_XY, Mat2f flow_XY, Mat2f flow_prev_XYT, Mat_<TValue> l_t_prev, Mat_<TValue> l_t_normal_prev)
+template <int CN>
+void warpBilinearRows(const Mat& src, const BilinearWarpMap& map, float* dst, size_t dst_row_step, int dst_pixel_step)
 {
-    //store result variable
-    vector<Mat_<TValue> > result;
+    const int h = map.origin.rows;
+    const int w = map.origin.cols;
+    const int sh = src.rows;
+    const int sw = src.cols;
+    const int cn = CN ? CN : src.channels();
 
-    // Input image
-    Mat_<TSrc> I = src;
-    Mat_<TSrc> I_prev = src_prev;
-    int h = I.rows;
-    int w = I.cols;
-    int num_channels = I.channels();
-    int num_channels_flow = J_XY.channels();
-/*
-    // Joint image (optional).
-    Mat_<TRef> A = I;
-    if (!joint_image.empty())
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++)
     {
-        // Input and joint images must have equal width and height.
-        assert(src.size() == joint_image.size());
-        A = joint_image;
+        const Vec2i* origin = map.origin[y];
+        const Vec2f* frac = map.frac[y];
+        float* out = dst + y * dst_row_step;
+        for (int x = 0; x < w; x++, out += dst_pixel_step)
+        {
+            const int x0 = origin[x][0];
+            const int y0 = origin[x][1];
+            const float ax = frac[x][0];
+            const float ay = frac[x][1];
+            if (x0 >= 0 && y0 >= 0 && x0 + 1 < sw && y0 + 1 < sh)
+            {
+                sampleBilinear<CN>(src.ptr<float>(y0) + cn * x0, src.ptr<float>(y0 + 1) + cn * x0,
+                                   ax, ay, cn, x0 + 2 < sw, out);
+            }
+            else
+            {
+                // border, taps outside the source are 0
+                for (int c = 0; c < cn; c++)
+                    out[c] = 0;
+                for (int ty = 0; ty < 2; ty++)
+                {
+                    int yy = y0 + ty;
+                    if (yy < 0 || yy >= sh)
+                        continue;
+                    float wy = ty ? ay : 1 - ay;
+                    for (int tx = 0; tx < 2; tx++)
+                    {
+                        int xx = x0 + tx;
+                        if (xx < 0 || xx >= sw)
+                            continue;
+                        float wxy = wy * (tx ? ax : 1 - ax);
+                        const float* p = src.ptr<float>(yy) + cn * xx;
+                        for (int c = 0; c < cn; c++)
+                            out[c] += wxy * p[c];
+                    }
+                }
+            }
+        }
     }
-*/
-
-
-    Mat_<TValue> J_XYT = J_XY;
-
-    // Initialization parameters
-    float lambda_T = 0;
-    float delta_photo = 0.3;
-    float delta_grad = 1.0;
-    float alpha_photo = 2.0;
-    float alpha_grad = 2.0;
-
-    // temporal filtering
-    int iterations = 1;
+}
 
+// Bilinear warp of the float image src along map. The result is written to dst, which points to
+// destination pixel (0,0); pixels are dst_pixel_step floats apart and rows dst_row_step floats
+// apart, so it can go straight into a channel range of a wider packed image.
+inline void warpBilinear(const Mat& src, const BilinearWarpMap& map, float* dst, size_t dst_row_step, int dst_pixel_step)
+{
+    assert(src.depth() == CV_32F && src.rows == map.src_rows && src.cols == map.src_cols);
+    switch (src.channels())
+    {
+    case 2:
+        warpBilinearRows<2>(src, map, dst, dst_row_step, dst_pixel_step);
+        break;
+    case 3:
+        warpBilinearRows<3>(src, map, dst, dst_row_step, dst_pixel_step);
+        break;
+    default:
+        warpBilinearRows<0>(src, map, dst, dst_row_step, dst_pixel_step);
+        break;
+    }
+}
 
-    //compute temporal permeability in this iteration
-    Mat1f perm_temporal;
-    perm_temporal = computeTemporalPermeability<TSrc>(I, I_prev, flow_XY, flow_prev_XYT, delta_photo, delta_grad, alpha_photo, alpha_grad);
+inline void warpBilinear(const Mat& src, const BilinearWarpMap& map, Mat& dst)
+{
+    dst.create(map.origin.rows, map.origin.cols, src.type());
+    warpBilinear(src, map, dst.ptr<float>(0), dst.step / sizeof(float), src.channels());
+}
 
+// Warps [I_prev | flow_prev_XYT | extra...] backwards along flow_prev_XYT into one packed image with
+// interpolation cv::INTER_CUBIC (single remap) or cv::INTER_LINEAR (warpBilinear per input, sharing
+// one precomputed map). All inputs are float images of the flow size.
+inline void warpTemporalInputs(const vector<Mat>& inputs, const Mat2f& flow_prev_XYT, int interpolation, Mat& warped)
+{
+    const int h = flow_prev_XYT.rows;
+    const int w = flow_prev_XYT.cols;
+    int cp = 0;
+    for (size_t k = 0; k < inputs.size(); k++)
+        cp += inputs[k].channels();
 
-    for (int i = 0; i < iterations; ++i)
-    //for (int i = 0; i < 1; ++i)
+    if (interpolation == cv::INTER_LINEAR)
     {
-        printf("bpt1\n");
-        printf("bpt2\n");
-
-        //split flow
-        //change flow file format to remap function required format
-        Mat2f prev_map = Mat2f::zeros(h,w);
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++){
-                prev_map(y,x)[0] = x - flow_prev_XYT(y,x)[0];
-                prev_map(y,x)[1] = y - flow_prev_XYT(y,x)[1];
-            }
+        BilinearWarpMap map;
+        getTemporalWarpMap(flow_prev_XYT, map);
+        warped.create(h, w, CV_32FC(cp));
+        int offset = 0;
+        for (size_t k = 0; k < inputs.size(); k++)
+        {
+            warpBilinear(inputs[k], map, warped.ptr<float>(0) + offset, warped.step / sizeof(float), cp);
+            offset += inputs[k].channels();
         }
-        std::vector<Mat1f> flow_XYT_prev_maps(num_channels_flow);
-        split(prev_map, flow_XYT_prev_maps);
+    }
+    else
+    {
+        Mat1f map_x, map_y;
+        getTemporalWarpMap(flow_prev_XYT, map_x, map_y);
+        Mat packed;
+        if (inputs.size() == 1)
+            packed = inputs[0];
+        else
+            merge(inputs, packed);
+        remap(packed, warped, map_x, map_y, interpolation);
+    }
+}
 
-        // temporal filtering
-        // Equation 3.7~3.9 in Michel's thesis (lambda is 0 for flow map)
+// Temporal permeability parameters in the form temporalPermeability evaluates them
+//     scale_photo = 1 / (3 * delta_photo^2), scale_grad = 1 / (2 * delta_grad^2)
+//     alpha_two   = alpha_photo == alpha_grad == 2, selects the pow free kernel
+struct TemporalPermeabilityParams
+{
+    float scale_photo;
+    float scale_grad;
+    float half_alpha_photo;
+    float half_alpha_grad;
+    bool alpha_two;
+
+    TemporalPermeabilityParams(float delta_photo, float delta_grad, float alpha_photo, float alpha_grad)
+    : scale_photo(1.f / (3.f * delta_photo * delta_photo))
+    , scale_grad(1.f / (2.f * delta_grad * delta_grad))
+    , half_alpha_photo(0.5f * alpha_photo)
+    , half_alpha_grad(0.5f * alpha_grad)
+    , alpha_two(alpha_photo == 2.f && alpha_grad == 2.f)
+    {
+    }
+};
+
+// Temporal permeability of one pixel (Equations 11 and 12)
+//     perm_photo = (1 + (||I - I_prev_warped|| / (sqrt(3) * delta_photo))^alpha_photo)^-1
+//     perm_grad  = (1 + (||F_XY - F_prev_warped|| / (sqrt(2) * delta_grad))^alpha_grad)^-1
+//     perm       = perm_photo * perm_grad
+// evaluated on squared norms. kAlphaTwo is the specialization for alpha_photo = alpha_grad = 2,
+// where the powers reduce to the squared norms themselves.
+template <bool kAlphaTwo>
+inline float temporalPermeability(const float* I, const float* I_prev_warped, int cn,
+                                  const float* flow, const float* flow_prev_warped,
+                                  const TemporalPermeabilityParams& params)
+{
+    float d2_photo = 0;
+    for (int c = 0; c < cn; c++)
+    {
+        float d = I[c] - I_prev_warped[c];
+        d2_photo += d * d;
+    }
+    float du = flow[0] - flow_prev_warped[0];
+    float dv = flow[1] - flow_prev_warped[1];
+    float d2_grad = du * du + dv * dv;
 
-        printf("bpt3\n");
-        // horizontal
-        Mat_<TValue> l_t = Mat_<TValue>::zeros(h, w);
-        Mat_<TValue> l_t_normal = Mat_<TValue>::zeros(h, w);
-        //Mat1f r = Mat::zeros(h,w);
-        //Mat1f r_normal = Mat::zeros(h,w);
-
-        printf("bpt4\n");
-        // no need to do pixel-wise operation (via J(y,x)) since all operation is based on same location pixels
-        // (left pass) forward pass & combining
-        Mat_<TValue> temp_l_t_prev = Mat_<TValue>::zeros(h, w);
-        Mat_<TValue> temp_l_t_prev_warped = Mat_<TValue>::zeros(h, w);
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                for (int c = 0; c < num_channels_flow; c++) {
-                    temp_l_t_prev(y,x)[c] = l_t_prev(y,x)[c] + J_prev_XY(y,x)[c];
-                }
-            }
-        }
-        //temp_l_t_prev = l_t_prev + J_prev_XY;
-        printf("bpt5\n");
-        remap(temp_l_t_prev, temp_l_t_prev_warped, flow_XYT_prev_maps[0], flow_XYT_prev_maps[1], cv::INTER_CUBIC);
-        //WriteFlowFile(temp_l_t_prev, "temp_l_t_prev.flo");
-        //WriteFlowFile(temp_l_t_prev_warped, "temp_l_t_prev_warped.flo");
-        //std::vector<Mat1f> temp_l_t_prev_chs(num_channels_flow);
-        //split(temp_l_t_prev, temp_l_t_prev_chs);
-        printf("bpt6\n");
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                for (int c = 0; c < num_channels_flow; c++) {
-                    l_t(y,x)[c] = perm_temporal(y,x) * temp_l_t_prev_warped(y,x)[c];
-                }
-            }
-        }
-        printf("bpt7\n");
+    if (kAlphaTwo)
+        return 1.f / ((1.f + d2_photo * params.scale_photo) * (1.f + d2_grad * params.scale_grad));
 
-        Mat_<TValue> temp_l_t_normal_prev = Mat_<TValue>::zeros(h, w);
-        Mat_<TValue> temp_l_t_normal_prev_warped = Mat_<TValue>::zeros(h, w);
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                for (int c = 0; c < num_channels_flow; c++) {
-                    temp_l_t_normal_prev(y,x)[c] = l_t_normal_prev(y,x)[c] + 1.0;
-                }
-            }
-        }
-        printf("bpt8\n");
-        remap(temp_l_t_normal_prev, temp_l_t_normal_prev_warped, flow_XYT_prev_maps[0], flow_XYT_prev_maps[1], cv::INTER_CUBIC);
-        //WriteFlowFile(temp_l_t_normal_prev, "temp_l_t_normal_prev.flo");
-        //WriteFlowFile(temp_l_t_normal_prev_warped, "temp_l_t_normal_prev_warped.flo");
-        printf("bpt9\n");
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                for (int c = 0; c < num_channels_flow; c++) {
-                    l_t_normal(y,x)[c] = perm_temporal(y,x) * temp_l_t_normal_prev_warped(y,x)[c];
-                    J_XYT(y,x)[c] = (l_t(y,x)[c] + (1 - lambda_T) * J_XY(y,x)[c]) / (l_t_normal(y,x)[c]+ 1.0);
-                }
-            }
-        }
-        printf("bpt10\n");
+    float perm_photo = 1.f / (1.f + pow(d2_photo * params.scale_photo, params.half_alpha_photo));
+    float perm_grad = 1.f / (1.f + pow(d2_grad * params.scale_grad, params.half_alpha_grad));
+    return perm_photo * perm_grad;
+}
 
-        // (right pass) backward pass & combining
-        //for (int x = w-1; x >= 0; x--) {
-        //    r(y,x) = perm_horizontal(y,x) * ( r(y,x+1) + J_XY(y,x+1) );
-        //    r_normal(y,x) = perm_horizontal(y,x) * ( r(y,x+1) + 1.0 );
+// perm = temporal permeability of every pixel, warped holds [I_prev | flow_prev_XYT] warped
+template <bool kAlphaTwo>
+void computeTemporalPermeabilityRows(const Mat& I, const Mat& flow_XY, const Mat& warped,
+                                     const TemporalPermeabilityParams& params, Mat1f& perm_temporal)
+{
+    const int h = I.rows;
+    const int w = I.cols;
+    const int cs = I.channels();
+    const int cp = warped.channels();
 
-        //    J_XY = (l + (1-lambda_XY) * J_XY + lambda_XY * I + r) / (l_normal + 1.0 +r_normal);
-        //}
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++)
+    {
+        const float* cur = I.ptr<float>(y);
+        const float* flow = flow_XY.ptr<float>(y);
+        const float* prev = warped.ptr<float>(y);
+        float* perm = perm_temporal.ptr<float>(y);
+        for (int x = 0; x < w; x++, prev += cp)
+            perm[x] = temporalPermeability<kAlphaTwo>(cur + cs * x, prev, cs, flow + 2 * x, prev + cs, params);
+    }
+}
 
-        //J_XYT = (l_t + (1 - lambda_T) * J_XY) / (l_t_normal + 1.0);
+template <class TSrc>
+Mat1f computeTemporalPermeability(Mat_<TSrc> I, Mat_<TSrc> I_prev, Mat2f flow_XY, Mat2f flow_prev_XYT, float delta_photo, float delta_grad, float alpha_photo, float alpha_grad, int interpolation = cv::INTER_CUBIC)
+{
+    assert(I.depth() == CV_32F);
+
+    // warp [I_prev, flow_prev_XYT] along one shared map
+    vector<Mat> inputs;
+    inputs.push_back(I_prev);
+    inputs.push_back(flow_prev_XYT);
+    Mat warped;
+    warpTemporalInputs(inputs, flow_prev_XYT, interpolation, warped);
+
+    TemporalPermeabilityParams params(delta_photo, delta_grad, alpha_photo, alpha_grad);
+    Mat1f perm_temporal(I.rows, I.cols);
+    if (params.alpha_two)
+        computeTemporalPermeabilityRows<true>(I, flow_XY, warped, params, perm_temporal);
+    else
+        computeTemporalPermeabilityRows<false>(I, flow_XY, warped, params, perm_temporal);
+    return perm_temporal;
+}
 
+// Fused permeability and recursive update of filterT, warped holds
+// [I_prev | flow_prev_XYT | l_t_prev + J_prev_XY | l_t_normal_prev + 1] warped.
+// Each iteration feeds the J_XYT of the previous one back in as J_XY; permeability and the
+// accumulators do not depend on J_XY, so the iterations run per pixel in registers.
+template <bool kAlphaTwo>
+void filterTRows(const Mat& I, const Mat& flow_XY, const Mat& J_XY, const Mat& warped,
+                 const TemporalPermeabilityParams& params, float lambda_T, int iterations,
+                 Mat& l_t, Mat& l_t_normal, Mat& J_XYT)
+{
+    const int h = I.rows;
+    const int w = I.cols;
+    const int cs = I.channels();
+    const int cj = J_XY.channels();
+    const int cp = warped.channels();
+    const int off_flow = cs;
+    const int off_l = cs + 2;
+    const int off_l_normal = cs + 2 + cj;
 
-        printf("bpt11\n");
-        //l_t_prev = l_t;
-        //l_t_normal_prev = l_t_normal;
-        result.push_back(l_t);
-        result.push_back(l_t_normal);
-/*
-        for(int y = 0; y < J_XYT.rows; y++) {
-            for(int x = 0; x < J_XYT.cols; x++) {
-                for(int c = 0; c < J_XYT.channels(); c++) {
-                      printf("y is %d\n", y);
-                      printf("x is %d\n", x);
-                      printf("c is %d\n", c);
-                      //printf("l_t is %f\n", l_t(y,x));
-                      printf("l_t is %f\n", l_t(y,x)[c]);
-                }
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++)
+    {
+        const float* cur = I.ptr<float>(y);
+        const float* flow = flow_XY.ptr<float>(y);
+        const float* j = J_XY.ptr<float>(y);
+        const float* prev = warped.ptr<float>(y);
+        float* l = l_t.ptr<float>(y);
+        float* l_normal = l_t_normal.ptr<float>(y);
+        float* j_xyt = J_XYT.ptr<float>(y);
+        for (int x = 0; x < w; x++, prev += cp)
+        {
+            float perm = temporalPermeability<kAlphaTwo>(cur + cs * x, prev, cs, flow + 2 * x, prev + off_flow, params);
+            for (int c = 0; c < cj; c++)
+            {
+                int k = cj * x + c;
+                l[k] = perm * prev[off_l + c];
+                l_normal[k] = perm * prev[off_l_normal + c];
+                float inv_normal = 1.f / (l_normal[k] + 1.0f);
+                float value = j[k];
+                for (int i = 0; i < iterations; i++)
+                    value = (l[k] + (1 - lambda_T) * value) * inv_normal;
+                j_xyt[k] = value;
             }
         }
-*/
     }
+}
 
+// Temporal filtering of J_XY along the XYT flow of the previous frame (Equations 3.7~3.9 in
+// Michel's thesis, forward pass only)
+//     l_t        = perm * warp(l_t_prev + J_prev_XY)
+//     l_t_normal = perm * warp(l_t_normal_prev + 1)
+//     J_XYT      = (l_t + (1 - lambda_T) * J_XY) / (l_t_normal + 1)
+// The warp map is built once and I_prev, flow_prev_XYT and both accumulators are warped together
+// (one multi-channel cubic remap, or bilinear warps sharing one map if
+// cpm_pf_params.interpolation_T_input_int is cv::INTER_LINEAR); permeability and update are then
+// computed in one pass. lambda_T, delta_photo, delta_grad, alpha_photo, alpha_grad and the number
+// of iterations come from cpm_pf_params.
+// Returns {l_t, l_t_normal, J_XYT}, all newly allocated.
+template <class TSrc, class TValue>
+vector<Mat_<TValue> > filterT(Mat_<TSrc> src, Mat_<TSrc> src_prev, Mat_<TValue> J_XY, Mat_<TValue> J_prev_XY, Mat2f flow_XY, Mat2f flow_prev_XYT, Mat_<TValue> l_t_prev, Mat_<TValue> l_t_normal_prev, cpm_pf_params_t &cpm_pf_params)
+{
+    // Input image
+    Mat_<TSrc> I = src;
+    Mat_<TSrc> I_prev = src_prev;
+    assert(I.depth() == CV_32F && J_XY.depth() == CV_32F);
+    const int h = I.rows;
+    const int w = I.cols;
+    const int cj = J_XY.channels();
+
+    float lambda_T = cpm_pf_params.lambda_T_input_float;
+    int iterations = cpm_pf_params.iterations_T_input_int;
+    TemporalPermeabilityParams perm_params(cpm_pf_params.delta_photo_input_float, cpm_pf_params.delta_grad_input_float,
+                                           cpm_pf_params.alpha_photo_input_float, cpm_pf_params.alpha_grad_input_float);
+
+    Mat_<TValue> l_sum(h, w);
+    Mat_<TValue> l_normal_sum(h, w);
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++)
+    {
+        const float* l_prev = l_t_prev.template ptr<float>(y);
+        const float* l_normal_prev = l_t_normal_prev.template ptr<float>(y);
+        const float* j_prev = J_prev_XY.template ptr<float>(y);
+        float* l = l_sum.template ptr<float>(y);
+        float* l_normal = l_normal_sum.template ptr<float>(y);
+        for (int k = 0; k < w * cj; k++)
+        {
+            l[k] = l_prev[k] + j_prev[k];
+            l_normal[k] = l_normal_prev[k] + 1.0f;
+        }
+    }
 
+    vector<Mat> inputs;
+    inputs.push_back(I_prev);
+    inputs.push_back(flow_prev_XYT);
+    inputs.push_back(l_sum);
+    inputs.push_back(l_normal_sum);
+    Mat warped;
+    warpTemporalInputs(inputs, flow_prev_XYT, cpm_pf_params.interpolation_T_input_int, warped);
+
+    Mat_<TValue> l_t(h, w);
+    Mat_<TValue> l_t_normal(h, w);
+    Mat_<TValue> J_XYT(h, w);
+    if (perm_params.alpha_two)
+        filterTRows<true>(I, flow_XY, J_XY, warped, perm_params, lambda_T, iterations, l_t, l_t_normal, J_XYT);
+    else
+        filterTRows<false>(I, flow_XY, J_XY, warped, perm_params, lambda_T, iterations, l_t, l_t_normal, J_XYT);
 
-    //namedWindow( "img_window", WINDOW_AUTOSIZE );
-    //imshow( "img_window", J_XYT );
-    //waitKey(0);
-    //imwrite("003_XYT.jpg", J_XYT * 255.);
-    //WriteFlowFile(J_XYT, "003_XYT.flo");
-
-
-
-    //return J_XYT;
+    vector<Mat_<TValue> > result;
+    result.push_back(l_t);
+    result.push_back(l_t_normal);
     result.push_back(J_XYT);
     return result;
 }
-
-
-
@@ -0,0 +1,512 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#define FLOW_ARCHIVE_POSIX
+#endif
+
+#include "flow_archive.h"
+
+/* .fseq archive: a FLOW_ARCHIVE_HEADER_SIZE bytes header (FLOW_ARCHIVE_MAGIC, version, then zeros), then the
+   records, each one a RECORD_HEADER_SIZE bytes header (RECORD_MAGIC, frame, direction, stage as int32, size
+   and checksum of the payload as uint64) followed by its payload, padded to RECORD_ALIGN bytes so that the
+   mapped floats are aligned. On close the index of the records (frame, direction, stage, 0 as int32,
+   offset, size and checksum as uint64) and a FOOTER_SIZE bytes footer (FOOTER_MAGIC, count as int32, offset
+   and checksum of the index as uint64, FOOTER_END, version as int32) are appended after the last record,
+   they are cut again when the archive is reopened for appending.
+
+   A record is committed once its payload is written: its header is written last, with the checksum of the
+   payload as read back from the file, so a record torn by a crash fails the check of the scan. */
+
+#define FLOW_ARCHIVE_VERSION 1
+#define RECORD_MAGIC "FREC"
+#define RECORD_HEADER_SIZE 32
+#define RECORD_ALIGN 16
+#define INDEX_ENTRY_SIZE 40
+#define FOOTER_MAGIC "FIDX"
+#define FOOTER_END "FEND"
+#define FOOTER_SIZE 32
+
+#define SUM_BLOCK (1 << 16)
+
+#ifdef FLOW_ARCHIVE_POSIX
+#define archive_seek(stream, offset) fseeko(stream, (off_t) (offset), SEEK_SET)
+#define archive_tell(stream) ((long long) ftello(stream))
+#else
+#define archive_seek(stream, offset) fseek(stream, (long) (offset), SEEK_SET)
+#define archive_tell(stream) ((long long) ftell(stream))
+#endif
+
+/********************* CHECKSUM ***********************/
+
+/* Fletcher-64 on little-endian 32 bit words, all the parts but the last must be a multiple of 4 bytes */
+typedef struct
+{
+    unsigned long long a, b;
+} archive_sum_t;
+
+static void sum_update(archive_sum_t *sum, const unsigned char *data, size_t n){
+    unsigned long long a = sum->a, b = sum->b;
+    while(n > 0){
+        // the sums cannot overflow within a block
+        size_t block = n < 4 * 4096 ? n : 4 * 4096, i;
+        for(i = 0 ; i + 4 <= block ; i += 4){
+            unsigned int word;
+            memcpy(&word, data + i, 4);
+            a += word;
+            b += a;
+        }
+        if(i < block){
+            unsigned int word = 0;
+            memcpy(&word, data + i, block - i);
+            a += word;
+            b += a;
+        }
+        a %= 0xFFFFFFFFULL;
+        b %= 0xFFFFFFFFULL;
+        data += block;
+        n -= block;
+    }
+    sum->a = a;
+    sum->b = b;
+}
+
+static unsigned long long sum_final(const archive_sum_t *sum){
+    return (sum->b << 32) | sum->a;
+}
+
+static unsigned long long sum_buffer(const void *data, const size_t n){
+    archive_sum_t sum = {0, 0};
+    sum_update(&sum, (const unsigned char*) data, n);
+    return sum_final(&sum);
+}
+
+/* checksum of n bytes of the file from offset, -1 when they cannot be read */
+static int sum_file(FILE *stream, const size_t offset, size_t n, unsigned long long *result){
+    unsigned char *buffer = (unsigned char*) malloc(SUM_BLOCK);
+    archive_sum_t sum = {0, 0};
+    int err = buffer == NULL || archive_seek(stream, offset) != 0;
+    while(!err && n > 0){
+        const size_t block = n < SUM_BLOCK ? n : SUM_BLOCK;
+        err = fread(buffer, 1, block, stream) != block;
+        if(!err)
+            sum_update(&sum, buffer, block);
+        n -= block;
+    }
+    free(buffer);
+    *result = sum_final(&sum);
+    return err ? -1 : 0;
+}
+
+/********************* INDEX ***********************/
+
+static int key_slot(const flow_archive_t *archive, const int frame, const int direction, const int stage){
+    unsigned int hash = (unsigned int) frame * 2654435761u ^ (unsigned int) (direction * 8 + stage) * 40503u;
+    int slot = (int) (hash & (unsigned int) (archive->nslots - 1));
+    for(;;){
+        const int i = archive->slots[slot];
+        if(i < 0)
+            return slot;
+        const flow_archive_entry_t *entry = archive->entries + i;
+        if(entry->frame == frame && entry->direction == direction && entry->stage == stage)
+            return slot;
+        slot = (slot + 1) & (archive->nslots - 1);
+    }
+}
+
+/* add a record to the index, the last record of a key hides the previous ones */
+static int index_add(flow_archive_t *archive, const flow_archive_entry_t *entry){
+    int i;
+    if(archive->count == archive->capacity){
+        const int capacity = archive->capacity ? 2 * archive->capacity : 256;
+        flow_archive_entry_t *entries = (flow_archive_entry_t*) realloc(archive->entries, capacity * sizeof(flow_archive_entry_t));
+        if(entries == NULL)
+            return -1;
+        archive->entries = entries;
+        archive->capacity = capacity;
+    }
+    if(2 * (archive->count + 1) > archive->nslots){
+        const int nslots = archive->nslots ? 2 * archive->nslots : 512;
+        int *slots = (int*) malloc(nslots * sizeof(int));
+        if(slots == NULL)
+            return -1;
+        free(archive->slots);
+        archive->slots = slots;
+        archive->nslots = nslots;
+        for(i = 0 ; i < nslots ; i++)
+            slots[i] = -1;
+        for(i = 0 ; i < archive->count ; i++){
+            const flow_archive_entry_t *e = archive->entries + i;
+            archive->slots[key_slot(archive, e->frame, e->direction, e->stage)] = i;
+        }
+    }
+    archive->entries[archive->count] = *entry;
+    archive->slots[key_slot(archive, entry->frame, entry->direction, entry->stage)] = archive->count;
+    archive->count++;
+    return 0;
+}
+
+static void index_clear(flow_archive_t *archive){
+    int i;
+    for(i = 0 ; i < archive->nslots ; i++)
+        archive->slots[i] = -1;
+    archive->count = 0;
+}
+
+/* last record of a key, NULL when there is none */
+const flow_archive_entry_t *flow_archive_find(const flow_archive_t *archive, const int frame, const int direction, const int stage){
+    if(archive->count == 0)
+        return NULL;
+    const int i = archive->slots[key_slot(archive, frame, direction, stage)];
+    return i < 0 ? NULL : archive->entries + i;
+}
+
+/********************* OPEN ***********************/
+
+static size_t record_end(const flow_archive_entry_t *entry){
+    return entry->offset + (entry->size + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+}
+
+/* load the index of the footer, -1 when there is no valid footer */
+static int read_footer(flow_archive_t *archive, const size_t size){
+    unsigned char footer[FOOTER_SIZE];
+    int count;
+    unsigned long long index_offset, index_sum;
+    if(size < FLOW_ARCHIVE_HEADER_SIZE + FOOTER_SIZE || archive_seek(archive->stream, size - FOOTER_SIZE) != 0
+       || fread(footer, 1, FOOTER_SIZE, archive->stream) != FOOTER_SIZE)
+        return -1;
+    memcpy(&count, footer + 4, 4);
+    memcpy(&index_offset, footer + 8, 8);
+    memcpy(&index_sum, footer + 16, 8);
+    if(memcmp(footer, FOOTER_MAGIC, 4) != 0 || memcmp(footer + 24, FOOTER_END, 4) != 0 || count < 0
+       || index_offset < FLOW_ARCHIVE_HEADER_SIZE || index_offset + (size_t) count * INDEX_ENTRY_SIZE + FOOTER_SIZE != size)
+        return -1;
+
+    const size_t index_size = (size_t) count * INDEX_ENTRY_SIZE;
+    unsigned char *index = (unsigned char*) malloc(index_size + 1);
+    int err = index == NULL || archive_seek(archive->stream, index_offset) != 0
+           || fread(index, 1, index_size, archive->stream) != index_size || sum_buffer(index, index_size) != index_sum;
+    int i;
+    size_t end = FLOW_ARCHIVE_HEADER_SIZE;
+    for(i = 0 ; i < count && !err ; i++){
+        const unsigned char *p = index + (size_t) i * INDEX_ENTRY_SIZE;
+        flow_archive_entry_t entry;
+        unsigned long long offset, payload_size;
+        memcpy(&entry.frame, p, 4);
+        memcpy(&entry.direction, p + 4, 4);
+        memcpy(&entry.stage, p + 8, 4);
+        memcpy(&offset, p + 16, 8);
+        memcpy(&payload_size, p + 24, 8);
+        memcpy(&entry.sum, p + 32, 8);
+        entry.offset = (size_t) offset;
+        entry.size = (size_t) payload_size;
+        err = offset < end + RECORD_HEADER_SIZE || offset + payload_size > index_offset || index_add(archive, &entry) != 0;
+        if(!err)
+            end = record_end(&entry);
+    }
+    free(index);
+    if(err){
+        index_clear(archive);
+        return -1;
+    }
+    archive->end = (size_t) index_offset;
+    return 0;
+}
+
+/* find the committed records back from the start of the file, for an archive left without footer */
+static void scan_records(flow_archive_t *archive, const size_t size){
+    size_t pos = FLOW_ARCHIVE_HEADER_SIZE;
+    while(pos + RECORD_HEADER_SIZE <= size){
+        unsigned char header[RECORD_HEADER_SIZE];
+        flow_archive_entry_t entry;
+        unsigned long long payload_size, sum;
+        if(archive_seek(archive->stream, pos) != 0 || fread(header, 1, RECORD_HEADER_SIZE, archive->stream) != RECORD_HEADER_SIZE
+           || memcmp(header, RECORD_MAGIC, 4) != 0)
+            break;
+        memcpy(&entry.frame, header + 4, 4);
+        memcpy(&entry.direction, header + 8, 4);
+        memcpy(&entry.stage, header + 12, 4);
+        memcpy(&payload_size, header + 16, 8);
+        memcpy(&entry.sum, header + 24, 8);
+        if(payload_size > size - pos - RECORD_HEADER_SIZE)
+            break;
+        entry.offset = pos + RECORD_HEADER_SIZE;
+        entry.size = (size_t) payload_size;
+        if(sum_file(archive->stream, entry.offset, entry.size, &sum) != 0 || sum != entry.sum || index_add(archive, &entry) != 0)
+            break;
+        pos = record_end(&entry);
+    }
+    archive->end = pos < size ? pos : size;
+    fprintf(stderr, "flow_archive_open(%s): no index, %d records recovered, %lu bytes %s\n", archive->filename, archive->count,
+            (unsigned long) (size - archive->end), archive->writable ? "cut" : "ignored");
+}
+
+/* cut the file after the last record, or after a write which failed */
+static void archive_truncate(flow_archive_t *archive){
+    fflush(archive->stream);
+#ifdef FLOW_ARCHIVE_POSIX
+    if(ftruncate(fileno(archive->stream), (off_t) archive->end) != 0)
+        fprintf(stderr, "flow_archive(%s): could not truncate\n", archive->filename);
+#endif
+}
+
+static void archive_free(flow_archive_t *archive){
+    if(archive->stream != NULL)
+        fclose(archive->stream);
+    free(archive->filename);
+    free(archive->entries);
+    free(archive->slots);
+    memset(archive, 0, sizeof(flow_archive_t));
+}
+
+/* open an archive, created when writable and missing, appended to when writable; a missing or bad footer
+   means the last run crashed: the committed records are recovered and the rest is cut when writable,
+   return 0 on success and -1 on error with a message on stderr */
+int flow_archive_open(flow_archive_t *archive, const char *filename, const int writable){
+    memset(archive, 0, sizeof(flow_archive_t));
+    if(filename == NULL){
+        fprintf(stderr, "flow_archive_open: empty filename\n");
+        return -1;
+    }
+    archive->filename = (char*) malloc(strlen(filename) + 1);
+    if(archive->filename == NULL){
+        fprintf(stderr, "flow_archive_open(%s): not enough memory\n", filename);
+        return -1;
+    }
+    strcpy(archive->filename, filename);
+    archive->writable = writable;
+    archive->stream = fopen(filename, writable ? "r+b" : "rb");
+
+    if(archive->stream == NULL && writable){
+        unsigned char header[FLOW_ARCHIVE_HEADER_SIZE] = {0};
+        const int version = FLOW_ARCHIVE_VERSION;
+        memcpy(header, FLOW_ARCHIVE_MAGIC, 4);
+        memcpy(header + 4, &version, 4);
+        archive->stream = fopen(filename, "w+b");
+        if(archive->stream == NULL || fwrite(header, 1, FLOW_ARCHIVE_HEADER_SIZE, archive->stream) != FLOW_ARCHIVE_HEADER_SIZE
+           || fflush(archive->stream) != 0){
+            fprintf(stderr, "flow_archive_open: could not create %s\n", filename);
+            archive_free(archive);
+            return -1;
+        }
+        archive->end = FLOW_ARCHIVE_HEADER_SIZE;
+        return 0;
+    }
+    if(archive->stream == NULL){
+        fprintf(stderr, "flow_archive_open: could not open %s\n", filename);
+        archive_free(archive);
+        return -1;
+    }
+
+    unsigned char header[FLOW_ARCHIVE_HEADER_SIZE];
+    int version;
+    long long size = -1;
+    if(fread(header, 1, FLOW_ARCHIVE_HEADER_SIZE, archive->stream) == FLOW_ARCHIVE_HEADER_SIZE && fseek(archive->stream, 0, SEEK_END) == 0)
+        size = archive_tell(archive->stream);
+    memcpy(&version, header + 4, 4);
+    if(size < FLOW_ARCHIVE_HEADER_SIZE || memcmp(header, FLOW_ARCHIVE_MAGIC, 4) != 0 || version != FLOW_ARCHIVE_VERSION){
+        fprintf(stderr, "flow_archive_open(%s): not a sequence archive\n", filename);
+        archive_free(archive);
+        return -1;
+    }
+    if(read_footer(archive, (size_t) size) != 0)
+        scan_records(archive, (size_t) size);
+    // the footer is written again on close
+    if(writable && archive->end < (size_t) size)
+        archive_truncate(archive);
+    return 0;
+}
+
+/* write the footer index when writable and close, same return value as flow_archive_open */
+int flow_archive_close(flow_archive_t *archive){
+    int err = 0;
+    if(archive->writable && archive->stream != NULL){
+        const size_t index_size = (size_t) archive->count * INDEX_ENTRY_SIZE;
+        unsigned char *index = (unsigned char*) calloc(index_size + 1, 1);
+        unsigned char footer[FOOTER_SIZE] = {0};
+        err = index == NULL || archive_seek(archive->stream, archive->end) != 0;
+        int i;
+        for(i = 0 ; i < archive->count && !err ; i++){
+            const flow_archive_entry_t *entry = archive->entries + i;
+            unsigned char *p = index + (size_t) i * INDEX_ENTRY_SIZE;
+            const unsigned long long offset = entry->offset, payload_size = entry->size;
+            memcpy(p, &entry->frame, 4);
+            memcpy(p + 4, &entry->direction, 4);
+            memcpy(p + 8, &entry->stage, 4);
+            memcpy(p + 16, &offset, 8);
+            memcpy(p + 24, &payload_size, 8);
+            memcpy(p + 32, &entry->sum, 8);
+        }
+        const unsigned long long index_offset = archive->end, index_sum = err ? 0 : sum_buffer(index, index_size);
+        const int version = FLOW_ARCHIVE_VERSION;
+        memcpy(footer, FOOTER_MAGIC, 4);
+        memcpy(footer + 4, &archive->count, 4);
+        memcpy(footer + 8, &index_offset, 8);
+        memcpy(footer + 16, &index_sum, 8);
+        memcpy(footer + 24, FOOTER_END, 4);
+        memcpy(footer + 28, &version, 4);
+        err = err || fwrite(index, 1, index_size, archive->stream) != index_size
+                  || fwrite(footer, 1, FOOTER_SIZE, archive->stream) != FOOTER_SIZE || fflush(archive->stream) != 0;
+#ifdef FLOW_ARCHIVE_POSIX
+        err = err || fsync(fileno(archive->stream)) != 0;
+#endif
+        free(index);
+        if(err)
+            fprintf(stderr, "flow_archive_close(%s): problem writing the index, it is rebuilt on the next open\n", archive->filename);
+    }
+    if(archive->stream != NULL && fclose(archive->stream) != 0)
+        err = 1;
+    archive->stream = NULL;
+    archive_free(archive);
+    return err ? -1 : 0;
+}
+
+/********************* APPEND ***********************/
+
+/* start a record at the end of the archive, its payload is written at the current position of the stream returned */
+static FILE *archive_begin(flow_archive_t *archive){
+    static const unsigned char placeholder[RECORD_HEADER_SIZE] = {0};
+    if(!archive->writable){
+        fprintf(stderr, "flow_archive(%s): not opened for writing\n", archive->filename);
+        return NULL;
+    }
+    if(archive_seek(archive->stream, archive->end) != 0
+       || fwrite(placeholder, 1, RECORD_HEADER_SIZE, archive->stream) != RECORD_HEADER_SIZE){
+        fprintf(stderr, "flow_archive(%s): problem writing record\n", archive->filename);
+        return NULL;
+    }
+    return archive->stream;
+}
+
+/* commit the record started by archive_begin once its payload is written, or drop it when err */
+static int archive_commit(flow_archive_t *archive, const int frame, const int direction, const int stage, int err){
+    static const unsigned char padding[RECORD_ALIGN] = {0};
+    flow_archive_entry_t entry;
+    entry.frame = frame;
+    entry.direction = direction;
+    entry.stage = stage;
+    entry.offset = archive->end + RECORD_HEADER_SIZE;
+    const long long pos = err ? -1 : archive_tell(archive->stream);
+    err = pos < (long long) entry.offset;
+    if(!err){
+        entry.size = (size_t) pos - entry.offset;
+        const size_t pad = record_end(&entry) - (size_t) pos;
+        err = fwrite(padding, 1, pad, archive->stream) != pad || fflush(archive->stream) != 0
+           || sum_file(archive->stream, entry.offset, entry.size, &entry.sum) != 0;
+    }
+    if(!err){
+        unsigned char header[RECORD_HEADER_SIZE];
+        const unsigned long long payload_size = entry.size;
+        memcpy(header, RECORD_MAGIC, 4);
+        memcpy(header + 4, &frame, 4);
+        memcpy(header + 8, &direction, 4);
+        memcpy(header + 12, &stage, 4);
+        memcpy(header + 16, &payload_size, 8);
+        memcpy(header + 24, &entry.sum, 8);
+        err = archive_seek(archive->stream, archive->end) != 0 || fwrite(header, 1, RECORD_HEADER_SIZE, archive->stream) != RECORD_HEADER_SIZE
+           || fflush(archive->stream) != 0 || index_add(archive, &entry) != 0;
+    }
+    if(err){
+        fprintf(stderr, "flow_archive(%s): problem writing record %d/%d/%d\n", archive->filename, frame, direction, stage);
+        archive_truncate(archive);
+        return -1;
+    }
+    archive->end = record_end(&entry);
+    return 0;
+}
+
+/* append an interleaved flow as a .flo payload, or as a .cflo one when codec is one of the FLOW_CODEC_*,
+   a record with the same key hides the previous one, same return value as flow_archive_open */
+int flow_archive_put_flow(flow_archive_t *archive, const int frame, const int direction, const int stage,
+                          const float *uv, const int width, const int height, const int uv_stride, const int codec){
+    FILE *stream = archive_begin(archive);
+    if(stream == NULL)
+        return -1;
+    const int err = codec < 0 ? flow_write_stream(stream, archive->filename, uv, width, height, uv_stride)
+                              : flow_pack_write_stream(stream, archive->filename, uv, width, height, uv_stride, codec);
+    return archive_commit(archive, frame, direction, stage, err);
+}
+
+/* same as flow_archive_put_flow for a flow given as two planes whose lines are stride floats apart */
+int flow_archive_put_flow_planar(flow_archive_t *archive, const int frame, const int direction, const int stage,
+                                 const float *u, const float *v, const int width, const int height, const int stride, const int codec){
+    FILE *stream = archive_begin(archive);
+    if(stream == NULL)
+        return -1;
+    const int err = codec < 0 ? flow_write_planar_stream(stream, archive->filename, u, v, width, height, stride)
+                              : flow_pack_write_planar_stream(stream, archive->filename, u, v, width, height, stride, codec);
+    return archive_commit(archive, frame, direction, stage, err);
+}
+
+/* append matches as a .match payload, with the FLOW_STAGE_MATCHES stage */
+int flow_archive_put_matches(flow_archive_t *archive, const int frame, const int direction, const float *xy, const int count,
+                             const float *costs, const int width, const int height){
+    FILE *stream = archive_begin(archive);
+    if(stream == NULL)
+        return -1;
+    const int err = match_write_stream(stream, archive->filename, xy, count, costs, width, height);
+    return archive_commit(archive, frame, direction, FLOW_STAGE_MATCHES, err);
+}
+
+/********************* READ ***********************/
+
+/* map the payload of a record, or read it when it cannot be mapped, the payload starts at offset in base */
+static int archive_map_record(flow_archive_t *archive, const flow_archive_entry_t *entry, void **base, size_t *size, int *mapped, size_t *offset){
+    *base = NULL;
+    *mapped = 0;
+    *offset = 0;
+    *size = entry->size;
+#ifdef FLOW_ARCHIVE_POSIX
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t start = entry->offset / page * page;
+    if(fflush(archive->stream) == 0 && entry->size > 0){
+        void *map = mmap(NULL, entry->offset - start + entry->size, PROT_READ, MAP_PRIVATE, fileno(archive->stream), (off_t) start);
+        if(map != MAP_FAILED){
+            *base = map;
+            *size = entry->offset - start + entry->size;
+            *mapped = 1;
+            *offset = entry->offset - start;
+            madvise(map, *size, MADV_SEQUENTIAL);
+            return 0;
+        }
+    }
+#endif
+    *base = malloc(entry->size + 1);
+    if(*base == NULL || archive_seek(archive->stream, entry->offset) != 0 || fread(*base, 1, entry->size, archive->stream) != entry->size){
+        fprintf(stderr, "flow_archive(%s): problem reading record %d/%d/%d\n", archive->filename, entry->frame, entry->direction, entry->stage);
+        free(*base);
+        *base = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* map the flow of a record like flow_map_open, release it with flow_map_close */
+int flow_archive_map_flow(flow_archive_t *archive, const flow_archive_entry_t *entry, flow_map_t *flow){
+    void *base;
+    size_t size, offset;
+    int mapped;
+    memset(flow, 0, sizeof(flow_map_t));
+    if(archive_map_record(archive, entry, &base, &size, &mapped, &offset) != 0)
+        return -1;
+    return flow_map_buffer(flow, base, size, mapped, offset, archive->filename);
+}
+
+/* map the matches of a record like match_map_open, release them with match_map_close */
+int flow_archive_map_matches(flow_archive_t *archive, const flow_archive_entry_t *entry, match_map_t *matches){
+    void *base;
+    size_t size, offset;
+    int mapped;
+    memset(matches, 0, sizeof(match_map_t));
+    if(archive_map_record(archive, entry, &base, &size, &mapped, &offset) != 0)
+        return -1;
+    return match_map_buffer(matches, base, size, mapped, offset, archive->filename);
+}
@@ -0,0 +1,91 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __FLOW_ARCHIVE_H_
+#define __FLOW_ARCHIVE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "flow_io.h"
+
+/* sequence archive: all the flows and matches of a sequence appended to a single file, each one a record
+   holding a .flo, .cflo or .match payload keyed by (frame, direction, stage), with an index in a footer
+   written on close. A crashed run leaves no footer, the records are then found back by a scan and the
+   truncated tail is dropped (see flow_archive.c) */
+#define FLOW_ARCHIVE_MAGIC "FSEQ"
+#define FLOW_ARCHIVE_HEADER_SIZE 32
+
+/* direction of a flow from image frame: to frame + 1 or to frame - 1 */
+#define FLOW_FORWARD 0
+#define FLOW_BACKWARD 1
+
+/* stage of the pipeline which wrote the record */
+#define FLOW_STAGE_CPM 0            /* matches of the CPM part as a flow */
+#define FLOW_STAGE_MATCHES 1        /* matches of the CPM part, .match payload */
+#define FLOW_STAGE_XY 2             /* spatial permeability filter */
+#define FLOW_STAGE_XYT 3            /* temporal permeability filter */
+#define FLOW_STAGE_REFINED_XY 4     /* variational refinement of the XY flow */
+#define FLOW_STAGE_REFINED_XYT 5    /* variational refinement of the XYT flow */
+
+/* a record of the archive */
+typedef struct flow_archive_entry_s
+{
+    int frame;
+    int direction;
+    int stage;
+    size_t offset;              /* Offset of the payload in the file */
+    size_t size;                /* Size of the payload */
+    unsigned long long sum;     /* Checksum of the payload */
+} flow_archive_entry_t;
+
+/* an open archive, it is not thread safe: the appends and the reads must not overlap */
+typedef struct flow_archive_s
+{
+    char *filename;
+    FILE *stream;
+    int writable;
+    size_t end;                     /* End of the last record */
+    flow_archive_entry_t *entries;  /* Records in the order of the file */
+    int count;
+    int capacity;
+    int *slots;                     /* Hash table of the last record of each key, -1 when free */
+    int nslots;
+} flow_archive_t;
+
+/* open an archive, created when writable and missing, appended to when writable; a missing or bad footer
+   means the last run crashed: the committed records are recovered and the rest is cut when writable,
+   return 0 on success and -1 on error with a message on stderr */
+int flow_archive_open(flow_archive_t *archive, const char *filename, const int writable);
+
+/* write the footer index when writable and close, same return value as flow_archive_open */
+int flow_archive_close(flow_archive_t *archive);
+
+/* last record of a key, NULL when there is none */
+const flow_archive_entry_t *flow_archive_find(const flow_archive_t *archive, const int frame, const int direction, const int stage);
+
+/* map the flow of a record like flow_map_open, release it with flow_map_close */
+int flow_archive_map_flow(flow_archive_t *archive, const flow_archive_entry_t *entry, flow_map_t *flow);
+
+/* map the matches of a record like match_map_open, release them with match_map_close */
+int flow_archive_map_matches(flow_archive_t *archive, const flow_archive_entry_t *entry, match_map_t *matches);
+
+/* append an interleaved flow as a .flo payload, or as a .cflo one when codec is one of the FLOW_CODEC_*,
+   a record with the same key hides the previous one, same return value as flow_archive_open */
+int flow_archive_put_flow(flow_archive_t *archive, const int frame, const int direction, const int stage,
+                          const float *uv, const int width, const int height, const int uv_stride, const int codec);
+
+/* same as flow_archive_put_flow for a flow given as two planes whose lines are stride floats apart */
+int flow_archive_put_flow_planar(flow_archive_t *archive, const int frame, const int direction, const int stage,
+                                 const float *u, const float *v, const int width, const int height, const int stride, const int codec);
+
+/* append matches as a .match payload, with the FLOW_STAGE_MATCHES stage */
+int flow_archive_put_matches(flow_archive_t *archive, const int frame, const int direction, const float *xy, const int count,
+                             const float *costs, const int width, const int height);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define FLOW_IO_MMAP
+#endif
+
+#include "flow_io.h"
+#include "simd.h"
+
+/********************* MAPPING ***********************/
+
+static void file_unmap(void *base, const size_t size, const int mapped){
+    if(base == NULL)
+        return;
+#ifdef FLOW_IO_MMAP
+    if(mapped){
+        munmap(base, size);
+        return;
+    }
+#endif
+    free(base);
+}
+
+/* read the whole file into an allocated buffer, for the systems or files that cannot be mapped */
+static int file_read_all(void **base, size_t *size, FILE *stream, const char *filename, const char *caller){
+    if(fseek(stream, 0, SEEK_END) != 0){
+        fprintf(stderr, "%s(%s): cannot seek\n", caller, filename);
+        return -1;
+    }
+    long length = ftell(stream);
+    rewind(stream);
+    if(length < 0){
+        fprintf(stderr, "%s(%s): cannot get the size\n", caller, filename);
+        return -1;
+    }
+    *base = malloc(length > 0 ? (size_t) length : 1);
+    if(*base == NULL){
+        fprintf(stderr, "%s(%s): not enough memory\n", caller, filename);
+        return -1;
+    }
+    *size = (size_t) length;
+    if(fread(*base, 1, *size, stream) != *size){
+        fprintf(stderr, "%s(%s): problem reading file\n", caller, filename);
+        free(*base);
+        *base = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* map a whole file, or read it when it cannot be mapped, min_size is the size of the header */
+static int file_map(void **base, size_t *size, int *mapped, const char *filename, const size_t min_size, const char *caller){
+    *base = NULL;
+    *size = 0;
+    *mapped = 0;
+    if(filename == NULL){
+        fprintf(stderr, "%s: empty filename\n", caller);
+        return -1;
+    }
+#ifdef FLOW_IO_MMAP
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "%s: could not open %s\n", caller, filename);
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t) st.st_size >= min_size && st.st_size > 0){
+        void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED){
+            madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+            *base = map;
+            *size = (size_t) st.st_size;
+            *mapped = 1;
+        }
+    }
+    close(fd);
+#endif
+    if(*base == NULL){
+        FILE *stream = fopen(filename, "rb");
+        if(stream == NULL){
+            fprintf(stderr, "%s: could not open %s\n", caller, filename);
+            return -1;
+        }
+        int err = file_read_all(base, size, stream, filename, caller);
+        fclose(stream);
+        if(err)
+            return -1;
+    }
+    if(*size < min_size){
+        fprintf(stderr, "%s: problem reading file %s\n", caller, filename);
+        file_unmap(*base, *size, *mapped);
+        *base = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/********************* READ ***********************/
+
+/* open a flow file and check its header and size, return 0 on success and -1 on error with a message on stderr */
+int flow_map_open(flow_map_t *flow, const char *filename){
+    void *base;
+    size_t size;
+    int mapped;
+    memset(flow, 0, sizeof(flow_map_t));
+    if(file_map(&base, &size, &mapped, filename, FLOW_HEADER_SIZE, "flow_map_open") != 0)
+        return -1;
+    return flow_map_buffer(flow, base, size, mapped, 0, filename);
+}
+
+/* take over a buffer holding a flow file from offset to its end, same return value as flow_map_open */
+int flow_map_buffer(flow_map_t *flow, void *base, const size_t size, const int mapped, const size_t offset, const char *filename){
+    memset(flow, 0, sizeof(flow_map_t));
+    flow->base = base;
+    flow->size = size;
+    flow->mapped = mapped;
+    const char *payload = (const char*) base + offset;
+    const size_t payload_size = size - offset;
+    if(offset > size || payload_size < FLOW_HEADER_SIZE){
+        fprintf(stderr, "flow_map_open(%s): problem reading file\n", filename);
+        flow_map_close(flow);
+        return -1;
+    }
+
+    if(!memcmp(payload, FLOW_PACK_MAGIC, 4)){
+        float *uv;
+        int width, height;
+        const int err = flow_pack_decode(payload, payload_size, &uv, &width, &height, filename);
+        flow_map_close(flow);
+        if(err)
+            return -1;
+        flow->width = width;
+        flow->height = height;
+        flow->data = uv;
+        flow->base = uv;
+        flow->size = (size_t) 2 * width * height * sizeof(float);
+        return 0;
+    }
+
+    float tag;
+    int width, height;
+    memcpy(&tag, payload, sizeof(float));
+    memcpy(&width, payload + 4, sizeof(int));
+    memcpy(&height, payload + 8, sizeof(int));
+    if(tag != FLOW_TAG_FLOAT){ // simple test for correct endian-ness
+        fprintf(stderr, "flow_map_open(%s): wrong tag (possibly due to big-endian machine?)\n", filename);
+        flow_map_close(flow);
+        return -1;
+    }
+    // another sanity check to see that integers were read correctly (99999 should do the trick...)
+    if(width < 1 || width > 99999 || height < 1 || height > 99999){
+        fprintf(stderr, "flow_map_open(%s): illegal size %dx%d\n", filename, width, height);
+        flow_map_close(flow);
+        return -1;
+    }
+    const size_t expected = FLOW_HEADER_SIZE + (size_t) width * height * 2 * sizeof(float);
+    if(payload_size != expected){
+        fprintf(stderr, "flow_map_open(%s): file is too %s\n", filename, payload_size < expected ? "short" : "long");
+        flow_map_close(flow);
+        return -1;
+    }
+    flow->width = width;
+    flow->height = height;
+    flow->data = (const float*) (payload + FLOW_HEADER_SIZE);
+    return 0;
+}
+
+/* release the payload of a flow file */
+void flow_map_close(flow_map_t *flow){
+    file_unmap(flow->base, flow->size, flow->mapped);
+    memset(flow, 0, sizeof(flow_map_t));
+}
+
+/********************* (DE)INTERLEAVE ***********************/
+
+/* split n interleaved u v pairs into u and v */
+void flow_deinterleave(float *u, float *v, const float *uv, const int n){
+    int i = 0;
+    for( ; i + 4 <= n ; i += 4){
+        const v4sf a = _mm_loadu_ps(uv + 2*i), b = _mm_loadu_ps(uv + 2*i + 4);
+        _mm_storeu_ps(u + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)));
+        _mm_storeu_ps(v + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)));
+    }
+    for( ; i < n ; i++){
+        u[i] = uv[2*i];
+        v[i] = uv[2*i + 1];
+    }
+}
+
+/* interleave n values of u and v into uv */
+void flow_interleave(float *uv, const float *u, const float *v, const int n){
+    int i = 0;
+    for( ; i + 4 <= n ; i += 4){
+        const v4sf a = _mm_loadu_ps(u + i), b = _mm_loadu_ps(v + i);
+        _mm_storeu_ps(uv + 2*i, _mm_unpacklo_ps(a, b));
+        _mm_storeu_ps(uv + 2*i + 4, _mm_unpackhi_ps(a, b));
+    }
+    for( ; i < n ; i++){
+        uv[2*i] = u[i];
+        uv[2*i + 1] = v[i];
+    }
+}
+
+/********************* WRITE ***********************/
+
+static FILE *flow_write_open(const char *filename){
+    if(filename == NULL){
+        fprintf(stderr, "flow_write: empty filename\n");
+        return NULL;
+    }
+    FILE *stream = fopen(filename, "wb");
+    if(stream == NULL)
+        fprintf(stderr, "flow_write: could not open %s\n", filename);
+    return stream;
+}
+
+static int flow_write_close(FILE *stream, const char *filename, int err){
+    if(fclose(stream) != 0 && !err){
+        fprintf(stderr, "flow_write(%s): problem writing data\n", filename);
+        err = -1;
+    }
+    return err ? -1 : 0;
+}
+
+static int flow_write_header(FILE *stream, const char *filename, const int width, const int height){
+    const float tag = FLOW_TAG_FLOAT;
+    if(fwrite(&tag, sizeof(float), 1, stream) != 1 ||
+       fwrite(&width, sizeof(int), 1, stream) != 1 ||
+       fwrite(&height, sizeof(int), 1, stream) != 1){
+        fprintf(stderr, "flow_write(%s): problem writing header\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* write an interleaved flow whose lines are uv_stride floats apart, return 0 on success and -1 on error with a message on stderr */
+int flow_write(const char *filename, const float *uv, const int width, const int height, const int uv_stride){
+    FILE *stream = flow_write_open(filename);
+    if(stream == NULL)
+        return -1;
+    return flow_write_close(stream, filename, flow_write_stream(stream, filename, uv, width, height, uv_stride));
+}
+
+/* same as flow_write at the current position of an open stream, filename is only used in the messages */
+int flow_write_stream(FILE *stream, const char *filename, const float *uv, const int width, const int height, const int uv_stride){
+    if(flow_write_header(stream, filename, width, height) != 0)
+        return -1;
+    int err = 0;
+    if(uv_stride == 2*width){
+        const size_t n = (size_t) width * height * 2;
+        err = fwrite(uv, sizeof(float), n, stream) != n;
+    }else{
+        int y;
+        for(y = 0 ; y < height && !err ; y++)
+            err = fwrite(uv + (size_t) y*uv_stride, sizeof(float), 2*width, stream) != (size_t) (2*width);
+    }
+    if(err){
+        fprintf(stderr, "flow_write(%s): problem writing data\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* write a flow given as two planes whose lines are stride floats apart, same return value as flow_write */
+int flow_write_planar(const char *filename, const float *u, const float *v, const int width, const int height, const int stride){
+    FILE *stream = flow_write_open(filename);
+    if(stream == NULL)
+        return -1;
+    return flow_write_close(stream, filename, flow_write_planar_stream(stream, filename, u, v, width, height, stride));
+}
+
+/* same as flow_write_planar at the current position of an open stream */
+int flow_write_planar_stream(FILE *stream, const char *filename, const float *u, const float *v, const int width, const int height, const int stride){
+    if(flow_write_header(stream, filename, width, height) != 0)
+        return -1;
+    float *line = (float*) malloc(2 * width * sizeof(float));
+    if(line == NULL){
+        fprintf(stderr, "flow_write(%s): not enough memory\n", filename);
+        return -1;
+    }
+    int err = 0, y;
+    for(y = 0 ; y < height && !err ; y++){
+        flow_interleave(line, u + (size_t) y*stride, v + (size_t) y*stride, width);
+        err = fwrite(line, sizeof(float), 2*width, stream) != (size_t) (2*width);
+    }
+    free(line);
+    if(err){
+        fprintf(stderr, "flow_write(%s): problem writing data\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/********************* MATCHES ***********************/
+
+/* open a match file and check its header and size, return 0 on success and -1 on error with a message on stderr */
+int match_map_open(match_map_t *matches, const char *filename){
+    void *base;
+    size_t size;
+    int mapped;
+    memset(matches, 0, sizeof(match_map_t));
+    if(file_map(&base, &size, &mapped, filename, MATCH_HEADER_SIZE, "match_map_open") != 0)
+        return -1;
+    return match_map_buffer(matches, base, size, mapped, 0, filename);
+}
+
+/* take over a buffer holding a match file from offset to its end, same return value as match_map_open */
+int match_map_buffer(match_map_t *matches, void *buffer, const size_t size, const int mapped, const size_t offset, const char *filename){
+    memset(matches, 0, sizeof(match_map_t));
+    matches->base = buffer;
+    matches->size = size;
+    matches->mapped = mapped;
+    if(offset > size || size - offset < MATCH_HEADER_SIZE){
+        fprintf(stderr, "match_map_open(%s): problem reading file\n", filename);
+        match_map_close(matches);
+        return -1;
+    }
+
+    const char *base = (const char*) buffer + offset;
+    int header[4];
+    memcpy(header, base + 4, sizeof(header));
+    if(memcmp(base, MATCH_MAGIC, 4) != 0 || header[0] < 0 || (header[1] & ~(MATCH_INT16 | MATCH_COSTS)) != 0){
+        fprintf(stderr, "match_map_open(%s): not a match file\n", filename);
+        match_map_close(matches);
+        return -1;
+    }
+    const int count = header[0], flags = header[1];
+    const size_t coords_size = (size_t) count * 4 * (flags & MATCH_INT16 ? sizeof(short) : sizeof(float));
+    const size_t costs_size = flags & MATCH_COSTS ? (size_t) count * sizeof(float) : 0;
+    const size_t expected = MATCH_HEADER_SIZE + coords_size + costs_size;
+    if(size - offset != expected){
+        fprintf(stderr, "match_map_open(%s): file is too %s\n", filename, size - offset < expected ? "short" : "long");
+        match_map_close(matches);
+        return -1;
+    }
+    matches->count = count;
+    matches->flags = flags;
+    matches->width = header[2];
+    matches->height = header[3];
+    base += MATCH_HEADER_SIZE;
+    if(flags & MATCH_INT16)
+        matches->coords16 = (const short*) base;
+    else
+        matches->coords = (const float*) base;
+    base += coords_size;
+    if(costs_size)
+        matches->costs = (const float*) base;
+    return 0;
+}
+
+/* release the payload of a match file */
+void match_map_close(match_map_t *matches){
+    file_unmap(matches->base, matches->size, matches->mapped);
+    memset(matches, 0, sizeof(match_map_t));
+}
+
+/* x1 y1 x2 y2 of the matches first to first+n-1 */
+void match_get_coords(const match_map_t *matches, float *xy, const int first, const int n){
+    if(matches->coords16 == NULL){
+        memcpy(xy, matches->coords + 4 * (size_t) first, 4 * n * sizeof(float));
+        return;
+    }
+    const short *src = matches->coords16 + 4 * (size_t) first;
+    int i;
+    for(i = 0 ; i < 4*n ; i++)
+        xy[i] = src[i];
+}
+
+/* write count matches x1 y1 x2 y2, with their costs when not NULL,
+   the coordinates are stored as int16 when they all are, return 0 on success and -1 on error with a message on stderr */
+int match_write(const char *filename, const float *xy, const int count, const float *costs, const int width, const int height){
+    if(filename == NULL){
+        fprintf(stderr, "match_write: empty filename\n");
+        return -1;
+    }
+    FILE *stream = fopen(filename, "wb");
+    if(stream == NULL){
+        fprintf(stderr, "match_write: could not open %s\n", filename);
+        return -1;
+    }
+    int err = match_write_stream(stream, filename, xy, count, costs, width, height);
+    if(fclose(stream) != 0 && !err){
+        fprintf(stderr, "match_write(%s): problem writing data\n", filename);
+        err = -1;
+    }
+    return err ? -1 : 0;
+}
+
+/* same as match_write at the current position of an open stream, filename is only used in the messages */
+int match_write_stream(FILE *stream, const char *filename, const float *xy, const int count, const float *costs, const int width, const int height){
+    int flags = (costs ? MATCH_COSTS : 0) | MATCH_INT16;
+    int i;
+    for(i = 0 ; i < 4*count ; i++){
+        if(xy[i] != rintf(xy[i]) || xy[i] < -32768.0f || xy[i] > 32767.0f){
+            flags &= ~MATCH_INT16;
+            break;
+        }
+    }
+    const int header[4] = {count, flags, width, height};
+    int err = fwrite(MATCH_MAGIC, 1, 4, stream) != 4 || fwrite(header, sizeof(int), 4, stream) != 4;
+    if(!err && (flags & MATCH_INT16)){
+        short *packed = (short*) malloc((4 * (size_t) count + 1) * sizeof(short));
+        if(packed == NULL){
+            fprintf(stderr, "match_write(%s): not enough memory\n", filename);
+            return -1;
+        }
+        for(i = 0 ; i < 4*count ; i++)
+            packed[i] = (short) xy[i];
+        err = fwrite(packed, sizeof(short), 4 * (size_t) count, stream) != 4 * (size_t) count;
+        free(packed);
+    }else if(!err)
+        err = fwrite(xy, sizeof(float), 4 * (size_t) count, stream) != 4 * (size_t) count;
+    if(!err && costs)
+        err = fwrite(costs, sizeof(float), count, stream) != (size_t) count;
+    if(err){
+        fprintf(stderr, "match_write(%s): problem writing data\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/********************* PFM ***********************/
+
+static int host_little_endian(void){
+    const int one = 1;
+    return *(const unsigned char*) &one == 1;
+}
+
+/* open a pfm file and check its header and size, return 0 on success and -1 on error with a message on stderr */
+int pfm_map_open(pfm_map_t *pfm, const char *filename){
+    memset(pfm, 0, sizeof(pfm_map_t));
+    if(file_map(&pfm->base, &pfm->size, &pfm->mapped, filename, 3, "pfm_map_open") != 0)
+        return -1;
+    /* the header is parsed on a terminated copy of its first bytes */
+    char header[PFM_MAX_HEADER_SIZE + 1];
+    const size_t n = pfm->size < PFM_MAX_HEADER_SIZE ? pfm->size : PFM_MAX_HEADER_SIZE;
+    memcpy(header, pfm->base, n);
+    header[n] = '\0';
+    int offset = 0;
+    char band;
+    double scale;
+    if(header[0] != 'P' || (header[1] != 'f' && header[1] != 'F') ||
+       sscanf(header, "P%c %d %d %lf%n", &band, &pfm->width, &pfm->height, &scale, &offset) != 4 ||
+       pfm->width <= 0 || pfm->height <= 0 || scale == 0.0 || !isspace((unsigned char) header[offset])){
+        fprintf(stderr, "pfm_map_open(%s): wrong header\n", filename);
+        pfm_map_close(pfm);
+        return -1;
+    }
+    /* a single whitespace after the scale, <cr><lf> in some files */
+    if(header[offset] == '\r' && header[offset + 1] == '\n')
+        offset++;
+    offset++;
+    pfm->channels = band == 'F' ? 3 : 1;
+    pfm->scale = (float) fabs(scale);
+    pfm->swap = (scale < 0) != host_little_endian();
+    pfm->data = (const unsigned char*) pfm->base + offset;
+    if(pfm->size - offset < (size_t) pfm->width * pfm->height * pfm->channels * sizeof(float)){
+        fprintf(stderr, "pfm_map_open(%s): file is too short\n", filename);
+        pfm_map_close(pfm);
+        return -1;
+    }
+    return 0;
+}
+
+/* release the payload of a pfm file */
+void pfm_map_close(pfm_map_t *pfm){
+    file_unmap(pfm->base, pfm->size, pfm->mapped);
+    memset(pfm, 0, sizeof(pfm_map_t));
+}
+
+/* copy the image top down into im whose lines are stride floats apart, in the byte order of the machine */
+void pfm_get_image(const pfm_map_t *pfm, float *im, const int stride){
+    const int n = pfm->width * pfm->channels;
+    int y, x;
+    for(y = 0 ; y < pfm->height ; y++){
+        float *line = im + (size_t) y*stride;
+        memcpy(line, pfm->data + (size_t) (pfm->height - 1 - y) * n * sizeof(float), n * sizeof(float));
+        if(pfm->swap){
+            unsigned int *w = (unsigned int*) line;
+            for(x = 0 ; x < n ; x++)
+                w[x] = (w[x] >> 24) | ((w[x] >> 8) & 0xff00) | ((w[x] << 8) & 0xff0000) | (w[x] << 24);
+        }
+    }
+}
+
+/* write an image of channels floats per pixel whose lines are stride floats apart, return 0 on success and -1 on error with a message on stderr */
+int pfm_write(const char *filename, const float *im, const int width, const int height, const int channels, const int stride, const float scale){
+    if(filename == NULL){
+        fprintf(stderr, "pfm_write: empty filename\n");
+        return -1;
+    }
+    if(channels != 1 && channels != 3){
+        fprintf(stderr, "pfm_write(%s): %d channels, 1 or 3 expected\n", filename, channels);
+        return -1;
+    }
+    if(scale == 0.0f || !isfinite(scale)){
+        fprintf(stderr, "pfm_write(%s): scale %g, a finite non-zero scale expected\n", filename, scale);
+        return -1;
+    }
+    /* the scale with all the digits of a float, so that it reads back exactly and a small one is not written as 0 */
+    char header[PFM_MAX_HEADER_SIZE];
+    const int header_size = snprintf(header, sizeof(header), "P%c\n%d %d\n%.9g\n", channels == 3 ? 'F' : 'f', width, height,
+                                     host_little_endian() ? -fabs(scale) : fabs(scale));
+    const size_t line_size = (size_t) width * channels * sizeof(float);
+    const size_t size = header_size + line_size * height;
+    int y;
+#ifdef FLOW_IO_MMAP
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0){
+        fprintf(stderr, "pfm_write: could not open %s\n", filename);
+        return -1;
+    }
+    /* the blocks are allocated up front, a full disk would otherwise only show as a fault on the mapping */
+    int err = 0;
+#ifdef __linux__
+    err = posix_fallocate(fd, 0, (off_t) size);
+    if(err != 0 && err != EINVAL && err != EOPNOTSUPP){
+        fprintf(stderr, "pfm_write(%s): cannot allocate %lu bytes\n", filename, (unsigned long) size);
+        close(fd);
+        return -1;
+    }
+#endif
+    if(err != 0 || size == 0)
+        err = ftruncate(fd, (off_t) size);
+    unsigned char *map = err ? MAP_FAILED : (unsigned char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map != MAP_FAILED){
+        memcpy(map, header, header_size);
+        for(y = 0 ; y < height ; y++)
+            memcpy(map + header_size + (size_t) (height - 1 - y) * line_size, im + (size_t) y*stride, line_size);
+        err = munmap(map, size);
+        if(close(fd) != 0)
+            err = -1;
+        if(err)
+            fprintf(stderr, "pfm_write(%s): problem writing data\n", filename);
+        return err ? -1 : 0;
+    }
+    close(fd);
+#endif
+    FILE *stream = fopen(filename, "wb");
+    if(stream == NULL){
+        fprintf(stderr, "pfm_write: could not open %s\n", filename);
+        return -1;
+    }
+    int failed = fwrite(header, 1, header_size, stream) != (size_t) header_size;
+    for(y = height - 1 ; y >= 0 && !failed ; y--)
+        failed = fwrite(im + (size_t) y*stride, 1, line_size, stream) != line_size;
+    if(fclose(stream) != 0)
+        failed = 1;
+    if(failed){
+        fprintf(stderr, "pfm_write(%s): problem writing data\n", filename);
+        return -1;
+    }
+    return 0;
+}
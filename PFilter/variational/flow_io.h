@@ -0,0 +1,154 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __FLOW_IO_H_
+#define __FLOW_IO_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* .flo files: the float tag 202021.25 ("PIEH"), the width and the height as int32,
+   then width*height pairs of floats u v, interleaved, in row order */
+#define FLOW_TAG_FLOAT 202021.25f
+#define FLOW_HEADER_SIZE 12
+
+/* payload of a flow file, memory mapped when possible, read with a single fread otherwise, decoded for the .cflo containers */
+typedef struct flow_map_s
+{
+    int width;          /* Width of the flow */
+    int height;         /* Height of the flow */
+    const float *data;  /* Interleaved u v values, 2*width floats per line */
+    void *base;         /* Start of the mapping, or of the buffer read */
+    size_t size;        /* Size of the mapping */
+    int mapped;         /* 1 if base is a mapping, 0 if it was allocated */
+} flow_map_t;
+
+/* open a flow file and check its header and size, return 0 on success and -1 on error with a message on stderr */
+int flow_map_open(flow_map_t *flow, const char *filename);
+
+/* take over a buffer holding a flow file from offset to its end (a record of an archive), mapped or allocated,
+   it is released on error, same return value as flow_map_open */
+int flow_map_buffer(flow_map_t *flow, void *base, const size_t size, const int mapped, const size_t offset, const char *filename);
+
+/* release the payload of a flow file */
+void flow_map_close(flow_map_t *flow);
+
+/* split n interleaved u v pairs into u and v */
+void flow_deinterleave(float *u, float *v, const float *uv, const int n);
+
+/* interleave n values of u and v into uv */
+void flow_interleave(float *uv, const float *u, const float *v, const int n);
+
+/* write an interleaved flow whose lines are uv_stride floats apart, return 0 on success and -1 on error with a message on stderr */
+int flow_write(const char *filename, const float *uv, const int width, const int height, const int uv_stride);
+
+/* write a flow given as two planes whose lines are stride floats apart, same return value as flow_write */
+int flow_write_planar(const char *filename, const float *u, const float *v, const int width, const int height, const int stride);
+
+/* the writers above at the current position of an open stream, filename is only used in the messages */
+int flow_write_stream(FILE *stream, const char *filename, const float *uv, const int width, const int height, const int uv_stride);
+int flow_write_planar_stream(FILE *stream, const char *filename, const float *u, const float *v, const int width, const int height, const int stride);
+
+/* value of the unknown flow vectors */
+#define FLOW_UNKNOWN 1e10f
+
+/* .cflo containers: the flow in tiles of lines, coded with one of the FLOW_CODEC_*, sparse where most of the
+   flow is unknown and compressed; flow_map_open reads them like the .flo files (see flow_pack.c) */
+#define FLOW_PACK_MAGIC "CFLO"
+#define FLOW_PACK_HEADER_SIZE 32
+#define FLOW_CODEC_FLOAT32 0    /* lossless */
+#define FLOW_CODEC_FLOAT16 1    /* IEEE half floats, 11 significant bits */
+#define FLOW_CODEC_FIXED16 2    /* fixed point with 1/16 px steps, saturated at +-2047 px */
+
+/* write an interleaved flow whose lines are uv_stride floats apart in a .cflo container, return 0 on success and -1 on error with a message on stderr */
+int flow_pack_write(const char *filename, const float *uv, const int width, const int height, const int uv_stride, const int codec);
+
+/* same as flow_pack_write for a flow given as two planes whose lines are stride floats apart */
+int flow_pack_write_planar(const char *filename, const float *u, const float *v, const int width, const int height, const int stride, const int codec);
+
+/* the container writers at the current position of an open stream */
+int flow_pack_write_stream(FILE *stream, const char *filename, const float *uv, const int width, const int height, const int uv_stride, const int codec);
+int flow_pack_write_planar_stream(FILE *stream, const char *filename, const float *u, const float *v, const int width, const int height, const int stride, const int codec);
+
+/* decode a .cflo container of size bytes into an allocated interleaved flow, return 0 on success and -1 on error with a message on stderr */
+int flow_pack_decode(const void *data, const size_t size, float **uv, int *width, int *height, const char *filename);
+
+/* .match files: MATCH_MAGIC, then the number of matches, the flags and the size of the images as int32,
+   the x1 y1 x2 y2 of every match as int16 (MATCH_INT16) or float32, then optionally the cost of every
+   match as float32 (MATCH_COSTS). The matches are the ones kept by the forward-backward check */
+#define MATCH_MAGIC "CPMM"
+#define MATCH_HEADER_SIZE 20
+#define MATCH_INT16 1
+#define MATCH_COSTS 2
+
+/* payload of a match file, mapped like the flow files */
+typedef struct match_map_s
+{
+    int count;                  /* Number of matches */
+    int flags;                  /* MATCH_INT16 and MATCH_COSTS */
+    int width;                  /* Size of the matched images */
+    int height;
+    const short *coords16;      /* x1 y1 x2 y2 of each match if MATCH_INT16, NULL otherwise */
+    const float *coords;        /* x1 y1 x2 y2 of each match otherwise */
+    const float *costs;         /* Matching cost of each match, NULL without MATCH_COSTS */
+    void *base;
+    size_t size;
+    int mapped;
+} match_map_t;
+
+/* open a match file and check its header and size, return 0 on success and -1 on error with a message on stderr */
+int match_map_open(match_map_t *matches, const char *filename);
+
+/* take over a buffer holding a match file from offset to its end, like flow_map_buffer */
+int match_map_buffer(match_map_t *matches, void *base, const size_t size, const int mapped, const size_t offset, const char *filename);
+
+/* release the payload of a match file */
+void match_map_close(match_map_t *matches);
+
+/* x1 y1 x2 y2 of the matches first to first+n-1, as floats whatever the stored type */
+void match_get_coords(const match_map_t *matches, float *xy, const int first, const int n);
+
+/* write count matches x1 y1 x2 y2, with their costs when not NULL,
+   the coordinates are stored as int16 when they all are, return 0 on success and -1 on error with a message on stderr */
+int match_write(const char *filename, const float *xy, const int count, const float *costs, const int width, const int height);
+
+/* match_write at the current position of an open stream */
+int match_write_stream(FILE *stream, const char *filename, const float *xy, const int count, const float *costs, const int width, const int height);
+
+/* .pfm files: "Pf" (1 band) or "PF" (3 bands), the width, the height and the scale as text, a negative scale
+   meaning little endian floats, then the rows from the bottom to the top */
+#define PFM_MAX_HEADER_SIZE 256
+
+/* payload of a pfm file, mapped like the flow files */
+typedef struct pfm_map_s
+{
+    int width;
+    int height;
+    int channels;               /* 1 for Pf, 3 for PF */
+    float scale;                /* Absolute value of the scale */
+    int swap;                   /* 1 if the floats are not in the byte order of the machine */
+    const unsigned char *data;  /* Rows of width*channels floats from the bottom up, not aligned */
+    void *base;
+    size_t size;
+    int mapped;
+} pfm_map_t;
+
+/* open a pfm file and check its header and size, return 0 on success and -1 on error with a message on stderr */
+int pfm_map_open(pfm_map_t *pfm, const char *filename);
+
+/* release the payload of a pfm file */
+void pfm_map_close(pfm_map_t *pfm);
+
+/* copy the image top down into im whose lines are stride floats apart, in the byte order of the machine */
+void pfm_get_image(const pfm_map_t *pfm, float *im, const int stride);
+
+/* write an image of channels (1 or 3) floats per pixel whose lines are stride floats apart, in the byte order
+   of the machine, through a mapping of the file when possible, return 0 on success and -1 on error with a message on stderr */
+int pfm_write(const char *filename, const float *im, const int width, const int height, const int channels, const int stride, const float scale);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "flow_io.h"
+
+/* .cflo container: a FLOW_PACK_HEADER_SIZE bytes header (FLOW_PACK_MAGIC, version, width, height, codec,
+   tile_rows, ntiles, 0 as int32), an index with the stored size, the raw size and the mode of each tile
+   (3 uint32), then the tiles. A tile is a band of tile_rows lines, its values are coded with the codec,
+   split in an u plane and a v plane, byte shuffled and compressed with a small LZ77 coder when it helps.
+   A tile where less than half of the pixels are known (CPM matches) only stores a bitmap of the known
+   pixels and their values. */
+
+#define FLOW_PACK_VERSION 1
+#define FLOW_PACK_TILE_ROWS 16
+#define FLOW_PACK_INDEX_ENTRY 12
+
+#define TILE_SPARSE 1   /* bitmap of the known pixels, then their values only */
+#define TILE_LZ 2       /* compressed, stored raw otherwise */
+
+#define FIXED16_UNKNOWN (-32768)
+#define FLOAT16_UNKNOWN 0x7C00  /* +inf */
+
+/********************* VALUES ***********************/
+
+static int flow_known(const float u, const float v){
+    return fabsf(u) < 1e9f && fabsf(v) < 1e9f; // false for NaN too
+}
+
+static int codec_size(const int codec){
+    return codec == FLOW_CODEC_FLOAT32 ? 4 : 2;
+}
+
+/* float to IEEE half, rounded to nearest even, out of range values are saturated */
+static uint16_t float_to_half(const float f){
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    const uint16_t sign = (x >> 16) & 0x8000;
+    const float a = fabsf(f);
+    if(a >= 65520.0f)
+        return sign | 0x7BFF;   // largest finite half
+    if(a < 6.103515625e-05f){    // subnormal half, a multiple of 2^-24
+        return sign | (uint16_t) lrintf(a * 16777216.0f);
+    }
+    uint32_t m = x & 0x7FFFFFFF;
+    // round the 13 dropped bits of the mantissa to nearest even
+    m += 0x00000FFF + ((m >> 13) & 1);
+    return sign | (uint16_t) ((m >> 13) - (112 << 10));
+}
+
+static float half_to_float(const uint16_t h){
+    const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    const uint32_t e = (h >> 10) & 0x1F, m = h & 0x3FF;
+    float f;
+    if(e == 0){
+        f = (float) m * 5.9604644775390625e-08f;    // subnormal, m * 2^-24
+        uint32_t x;
+        memcpy(&x, &f, 4);
+        x |= sign;
+        memcpy(&f, &x, 4);
+        return f;
+    }
+    uint32_t x = sign | ((e + 112) << 23) | (m << 13);
+    memcpy(&f, &x, 4);
+    return f;
+}
+
+/* code one value, unknown values only reach here in dense tiles */
+static void encode_value(uint8_t *dst, const float f, const int known, const int codec){
+    if(codec == FLOW_CODEC_FLOAT32){
+        memcpy(dst, &f, 4);
+        return;
+    }
+    uint16_t c;
+    if(codec == FLOW_CODEC_FLOAT16){
+        c = known ? float_to_half(f) : FLOAT16_UNKNOWN;
+    }else{
+        long q = known ? lrintf(f * 16.0f) : FIXED16_UNKNOWN;
+        if(known && q < -32767) q = -32767;
+        if(known && q > 32767) q = 32767;
+        c = (uint16_t) (int16_t) q;
+    }
+    memcpy(dst, &c, 2);
+}
+
+static float decode_value(const uint8_t *src, const int codec){
+    if(codec == FLOW_CODEC_FLOAT32){
+        float f;
+        memcpy(&f, src, 4);
+        return f;
+    }
+    uint16_t c;
+    memcpy(&c, src, 2);
+    if(codec == FLOW_CODEC_FLOAT16)
+        return c == FLOAT16_UNKNOWN ? FLOW_UNKNOWN : half_to_float(c);
+    return (int16_t) c == FIXED16_UNKNOWN ? FLOW_UNKNOWN : (int16_t) c / 16.0f;
+}
+
+/* the fixed point codes are stored as differences to the previous one of their plane, smooth flows give small values */
+static void delta_encode(uint8_t *plane, const int n){
+    uint16_t prev = 0;
+    int i;
+    for(i = 0 ; i < n ; i++){
+        uint16_t c;
+        memcpy(&c, plane + 2*i, 2);
+        const uint16_t d = c - prev;
+        prev = c;
+        memcpy(plane + 2*i, &d, 2);
+    }
+}
+
+static void delta_decode(uint8_t *plane, const int n){
+    uint16_t prev = 0;
+    int i;
+    for(i = 0 ; i < n ; i++){
+        uint16_t d;
+        memcpy(&d, plane + 2*i, 2);
+        prev += d;
+        memcpy(plane + 2*i, &prev, 2);
+    }
+}
+
+/* gather the k-th bytes of the n values of size vsize together */
+static void byte_shuffle(uint8_t *dst, const uint8_t *src, const int n, const int vsize){
+    int i, k;
+    for(k = 0 ; k < vsize ; k++)
+        for(i = 0 ; i < n ; i++)
+            dst[k*n + i] = src[i*vsize + k];
+}
+
+static void byte_unshuffle(uint8_t *dst, const uint8_t *src, const int n, const int vsize){
+    int i, k;
+    for(k = 0 ; k < vsize ; k++)
+        for(i = 0 ; i < n ; i++)
+            dst[i*vsize + k] = src[k*n + i];
+}
+
+/********************* LZ77 ***********************/
+
+/* LZ4 like sequences: a token with the number of literals and the match length - 4 (4 bits each, 15 continues
+   on the next bytes), the literals, the offset of the match on 2 bytes; the last sequence has no match */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+
+static uint32_t read32(const uint8_t *p){
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static int lz_put_length(uint8_t **op, const uint8_t *oend, size_t len){
+    while(len >= 255){
+        if(*op >= oend) return -1;
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if(*op >= oend) return -1;
+    *(*op)++ = (uint8_t) len;
+    return 0;
+}
+
+static int lz_put_sequence(uint8_t **op, const uint8_t *oend, const uint8_t *lit, const size_t nlit, const size_t offset, const size_t mlen){
+    if(*op >= oend) return -1;
+    const size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    uint8_t *token = (*op)++;
+    *token = (uint8_t) (((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15));
+    if(nlit >= 15 && lz_put_length(op, oend, nlit - 15)) return -1;
+    if((size_t) (oend - *op) < nlit) return -1;
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+    if(!mlen)
+        return 0;
+    if(oend - *op < 2) return -1;
+    *(*op)++ = (uint8_t) (offset & 0xFF);
+    *(*op)++ = (uint8_t) (offset >> 8);
+    if(ml >= 15 && lz_put_length(op, oend, ml - 15)) return -1;
+    return 0;
+}
+
+/* compress n bytes, return the compressed size or 0 if it does not fit in cap bytes */
+static size_t lz_compress(uint8_t *dst, const size_t cap, const uint8_t *src, const size_t n, int32_t *table){
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+    size_t ip = 0, anchor = 0;
+    int i;
+    for(i = 0 ; i < (1 << LZ_HASH_BITS) ; i++)
+        table[i] = -1;
+    while(ip + LZ_MIN_MATCH <= n){
+        const uint32_t seq = read32(src + ip);
+        const uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        const int32_t ref = table[h];
+        table[h] = (int32_t) ip;
+        if(ref >= 0 && ip - ref <= 65535 && read32(src + ref) == seq){
+            size_t len = LZ_MIN_MATCH;
+            while(ip + len < n && src[ref + len] == src[ip + len])
+                len++;
+            if(lz_put_sequence(&op, oend, src + anchor, ip - anchor, ip - ref, len))
+                return 0;
+            ip += len;
+            anchor = ip;
+        }else{
+            ip += 1 + ((ip - anchor) >> 6);    // skip faster through data that does not compress
+        }
+    }
+    if(lz_put_sequence(&op, oend, src + anchor, n - anchor, 0, 0))
+        return 0;
+    return op - dst;
+}
+
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len){
+    uint8_t b;
+    do{
+        if(*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    }while(b == 255);
+    return 0;
+}
+
+/* decompress into exactly raw bytes, return 0 on success and -1 on corrupted data */
+static int lz_decompress(uint8_t *dst, const size_t raw, const uint8_t *src, const size_t n){
+    const uint8_t *ip = src, *iend = src + n;
+    size_t op = 0;
+    while(ip < iend){
+        const uint8_t token = *ip++;
+        size_t nlit = token >> 4, mlen = token & 15;
+        if(nlit == 15 && lz_get_length(&ip, iend, &nlit)) return -1;
+        if((size_t) (iend - ip) < nlit || raw - op < nlit) return -1;
+        memcpy(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if(ip == iend)
+            break;  // last sequence
+        if(iend - ip < 2) return -1;
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(mlen == 15 && lz_get_length(&ip, iend, &mlen)) return -1;
+        mlen += LZ_MIN_MATCH;
+        if(offset == 0 || offset > op || raw - op < mlen) return -1;
+        size_t k;
+        for(k = 0 ; k < mlen ; k++, op++)   // the match can overlap what it writes
+            dst[op] = dst[op - offset];
+    }
+    return op == raw ? 0 : -1;
+}
+
+/********************* TILES ***********************/
+
+static size_t tile_max_raw(const size_t npix, const int vsize){
+    return 4 + (npix + 7) / 8 + npix * 2 * vsize;
+}
+
+/* code the pixels of a tile in raw, return its size and set the sparse flag */
+static size_t tile_encode(uint8_t *raw, uint8_t *tmp, const float *uv, const int width, const int rows, const int uv_stride, const int codec, int *sparse){
+    const int vsize = codec_size(codec), npix = width * rows;
+    int x, y, nknown = 0;
+    for(y = 0 ; y < rows ; y++)
+        for(x = 0 ; x < width ; x++)
+            nknown += flow_known(uv[(size_t) y*uv_stride + 2*x], uv[(size_t) y*uv_stride + 2*x + 1]);
+    *sparse = nknown < npix / 2;
+
+    uint8_t *p = raw;
+    int n = npix;
+    if(*sparse){
+        memcpy(p, &nknown, 4);
+        p += 4;
+        memset(p, 0, (npix + 7) / 8);
+        for(y = 0 ; y < rows ; y++)
+            for(x = 0 ; x < width ; x++)
+                if(flow_known(uv[(size_t) y*uv_stride + 2*x], uv[(size_t) y*uv_stride + 2*x + 1]))
+                    p[(y*width + x) >> 3] |= 1 << ((y*width + x) & 7);
+        p += (npix + 7) / 8;
+        n = nknown;
+    }
+    // u plane then v plane in tmp, only the known pixels when sparse
+    int i = 0;
+    for(y = 0 ; y < rows ; y++){
+        for(x = 0 ; x < width ; x++){
+            const float u = uv[(size_t) y*uv_stride + 2*x], v = uv[(size_t) y*uv_stride + 2*x + 1];
+            const int known = flow_known(u, v);
+            if(*sparse && !known)
+                continue;
+            encode_value(tmp + (size_t) i*vsize, u, known, codec);
+            encode_value(tmp + (size_t) (n + i)*vsize, v, known, codec);
+            i++;
+        }
+    }
+    if(codec == FLOW_CODEC_FIXED16){
+        delta_encode(tmp, n);
+        delta_encode(tmp + (size_t) n*vsize, n);
+    }
+    byte_shuffle(p, tmp, n, vsize);
+    byte_shuffle(p + (size_t) n*vsize, tmp + (size_t) n*vsize, n, vsize);
+    p += (size_t) 2*n*vsize;
+    return p - raw;
+}
+
+/* decode a tile into its lines of the interleaved flow, return 0 on success and -1 on corrupted data */
+static int tile_decode(float *uv, uint8_t *tmp, const uint8_t *raw, const size_t raw_size, const int width, const int rows, const int codec, const int sparse){
+    const int vsize = codec_size(codec), npix = width * rows;
+    const uint8_t *p = raw, *bitmap = NULL;
+    int n = npix, x, y;
+    if(sparse){
+        if(raw_size < 4 + (size_t) (npix + 7) / 8) return -1;
+        memcpy(&n, p, 4);
+        if(n < 0 || n > npix) return -1;
+        bitmap = p + 4;
+        p += 4 + (npix + 7) / 8;
+    }
+    if((size_t) (raw + raw_size - p) != (size_t) 2*n*vsize)
+        return -1;
+    byte_unshuffle(tmp, p, n, vsize);
+    byte_unshuffle(tmp + (size_t) n*vsize, p + (size_t) n*vsize, n, vsize);
+    if(codec == FLOW_CODEC_FIXED16){
+        delta_decode(tmp, n);
+        delta_decode(tmp + (size_t) n*vsize, n);
+    }
+    int i = 0;
+    for(y = 0 ; y < rows ; y++){
+        for(x = 0 ; x < width ; x++){
+            float *dst = uv + (size_t) 2*(y*width + x);
+            const int k = y*width + x;
+            if(sparse && !(bitmap[k >> 3] & (1 << (k & 7)))){
+                dst[0] = dst[1] = FLOW_UNKNOWN;
+                continue;
+            }
+            if(i >= n) return -1;
+            dst[0] = decode_value(tmp + (size_t) i*vsize, codec);
+            dst[1] = decode_value(tmp + (size_t) (n + i)*vsize, codec);
+            i++;
+        }
+    }
+    return i == n ? 0 : -1;
+}
+
+/********************* CONTAINER ***********************/
+
+/* write an interleaved flow whose lines are uv_stride floats apart in a .cflo container, return 0 on success and -1 on error with a message on stderr */
+int flow_pack_write(const char *filename, const float *uv, const int width, const int height, const int uv_stride, const int codec){
+    if(filename == NULL){
+        fprintf(stderr, "flow_pack_write: empty filename\n");
+        return -1;
+    }
+    FILE *stream = fopen(filename, "wb");
+    if(stream == NULL){
+        fprintf(stderr, "flow_pack_write: could not open %s\n", filename);
+        return -1;
+    }
+    int err = flow_pack_write_stream(stream, filename, uv, width, height, uv_stride, codec);
+    if(fclose(stream) != 0 && !err){
+        fprintf(stderr, "flow_pack_write(%s): problem writing data\n", filename);
+        err = -1;
+    }
+    return err ? -1 : 0;
+}
+
+/* same as flow_pack_write at the current position of an open stream, filename is only used in the messages */
+int flow_pack_write_stream(FILE *stream, const char *filename, const float *uv, const int width, const int height, const int uv_stride, const int codec){
+    if(codec != FLOW_CODEC_FLOAT32 && codec != FLOW_CODEC_FLOAT16 && codec != FLOW_CODEC_FIXED16){
+        fprintf(stderr, "flow_pack_write(%s): unknown codec %d\n", filename, codec);
+        return -1;
+    }
+    /* a flow shorter than a tile is a single band of its height */
+    const int tile_rows = height > 0 && height < FLOW_PACK_TILE_ROWS ? height : FLOW_PACK_TILE_ROWS;
+    const int ntiles = (height + tile_rows - 1) / tile_rows;
+    const size_t max_raw = tile_max_raw((size_t) width * tile_rows, codec_size(codec));
+    uint8_t **tiles = (uint8_t**) calloc(ntiles, sizeof(uint8_t*));
+    uint32_t *index = (uint32_t*) calloc(3 * (size_t) ntiles, sizeof(uint32_t));
+    int err = tiles == NULL || index == NULL, t;
+
+    #pragma omp parallel for schedule(dynamic) if(ntiles > 1)
+    for(t = 0 ; t < ntiles ; t++){
+        if(err)
+            continue;
+        const int rows = height - t*tile_rows < tile_rows ? height - t*tile_rows : tile_rows;
+        uint8_t *raw = (uint8_t*) malloc(max_raw), *tmp = (uint8_t*) malloc(max_raw);
+        uint8_t *packed = (uint8_t*) malloc(max_raw);
+        int32_t *table = (int32_t*) malloc(sizeof(int32_t) << LZ_HASH_BITS);
+        if(raw == NULL || tmp == NULL || packed == NULL || table == NULL){
+            err = 1;
+        }else{
+            int sparse;
+            const size_t raw_size = tile_encode(raw, tmp, uv + (size_t) t*tile_rows*uv_stride, width, rows, uv_stride, codec, &sparse);
+            const size_t size = lz_compress(packed, raw_size, raw, raw_size, table);
+            index[3*t + 1] = (uint32_t) raw_size;
+            index[3*t + 2] = sparse ? TILE_SPARSE : 0;
+            if(size > 0 && size < raw_size){
+                index[3*t] = (uint32_t) size;
+                index[3*t + 2] |= TILE_LZ;
+                tiles[t] = packed;
+                packed = NULL;
+            }else{
+                index[3*t] = (uint32_t) raw_size;
+                tiles[t] = raw;
+                raw = NULL;
+            }
+        }
+        free(raw);
+        free(tmp);
+        free(packed);
+        free(table);
+    }
+
+    if(err){
+        fprintf(stderr, "flow_pack_write(%s): not enough memory\n", filename);
+    }else{
+        const int header[7] = {FLOW_PACK_VERSION, width, height, codec, tile_rows, ntiles, 0};
+        err = fwrite(FLOW_PACK_MAGIC, 1, 4, stream) != 4 || fwrite(header, sizeof(int), 7, stream) != 7
+           || fwrite(index, sizeof(uint32_t), 3 * (size_t) ntiles, stream) != 3 * (size_t) ntiles;
+        for(t = 0 ; t < ntiles && !err ; t++)
+            err = fwrite(tiles[t], 1, index[3*t], stream) != index[3*t];
+        if(err)
+            fprintf(stderr, "flow_pack_write(%s): problem writing data\n", filename);
+    }
+    if(tiles != NULL)
+        for(t = 0 ; t < ntiles ; t++)
+            free(tiles[t]);
+    free(tiles);
+    free(index);
+    return err ? -1 : 0;
+}
+
+static float *flow_pack_interleave(const char *filename, const float *u, const float *v, const int width, const int height, const int stride){
+    float *uv = (float*) malloc((size_t) 2 * width * height * sizeof(float));
+    if(uv == NULL){
+        fprintf(stderr, "flow_pack_write(%s): not enough memory\n", filename);
+        return NULL;
+    }
+    int y;
+    for(y = 0 ; y < height ; y++)
+        flow_interleave(uv + (size_t) 2*y*width, u + (size_t) y*stride, v + (size_t) y*stride, width);
+    return uv;
+}
+
+/* same as flow_pack_write for a flow given as two planes whose lines are stride floats apart */
+int flow_pack_write_planar(const char *filename, const float *u, const float *v, const int width, const int height, const int stride, const int codec){
+    float *uv = flow_pack_interleave(filename, u, v, width, height, stride);
+    if(uv == NULL)
+        return -1;
+    const int err = flow_pack_write(filename, uv, width, height, 2*width, codec);
+    free(uv);
+    return err;
+}
+
+/* same as flow_pack_write_planar at the current position of an open stream */
+int flow_pack_write_planar_stream(FILE *stream, const char *filename, const float *u, const float *v, const int width, const int height, const int stride, const int codec){
+    float *uv = flow_pack_interleave(filename, u, v, width, height, stride);
+    if(uv == NULL)
+        return -1;
+    const int err = flow_pack_write_stream(stream, filename, uv, width, height, 2*width, codec);
+    free(uv);
+    return err;
+}
+
+/* decode a .cflo container of size bytes into an allocated interleaved flow, return 0 on success and -1 on error with a message on stderr */
+int flow_pack_decode(const void *data, const size_t size, float **uv, int *width, int *height, const char *filename){
+    const uint8_t *base = (const uint8_t*) data;
+    int header[7];
+    *uv = NULL;
+    if(size < FLOW_PACK_HEADER_SIZE || memcmp(base, FLOW_PACK_MAGIC, 4) != 0){
+        fprintf(stderr, "flow_map_open(%s): not a flow container\n", filename);
+        return -1;
+    }
+    memcpy(header, base + 4, sizeof(header));
+    const int w = header[1], h = header[2], codec = header[3], tile_rows = header[4], ntiles = header[5];
+    /* the bands are at most as high as the flow, or FLOW_PACK_TILE_ROWS as the first writers stored for short flows */
+    if(header[0] != FLOW_PACK_VERSION || w < 1 || w > 99999 || h < 1 || h > 99999
+       || (codec != FLOW_CODEC_FLOAT32 && codec != FLOW_CODEC_FLOAT16 && codec != FLOW_CODEC_FIXED16)
+       || tile_rows < 1 || (tile_rows > h && tile_rows > FLOW_PACK_TILE_ROWS) || (size_t) w * tile_rows > INT_MAX / 8 || ntiles != (h + tile_rows - 1) / tile_rows
+       || size < FLOW_PACK_HEADER_SIZE + (size_t) ntiles * FLOW_PACK_INDEX_ENTRY){
+        fprintf(stderr, "flow_map_open(%s): illegal container header\n", filename);
+        return -1;
+    }
+    const uint8_t *index = base + FLOW_PACK_HEADER_SIZE;
+    size_t *offsets = (size_t*) malloc((ntiles + 1) * sizeof(size_t));
+    float *flow = (float*) malloc((size_t) 2 * w * h * sizeof(float));
+    if(offsets == NULL || flow == NULL){
+        fprintf(stderr, "flow_map_open(%s): not enough memory\n", filename);
+        free(offsets);
+        free(flow);
+        return -1;
+    }
+    /* the pixels of a tile fit an int, see the header checks */
+    const size_t max_raw = tile_max_raw((size_t) w * tile_rows, codec_size(codec));
+    int t, err = 0;
+    offsets[0] = FLOW_PACK_HEADER_SIZE + (size_t) ntiles * FLOW_PACK_INDEX_ENTRY;
+    for(t = 0 ; t < ntiles ; t++){
+        uint32_t entry[3];
+        memcpy(entry, index + (size_t) t * FLOW_PACK_INDEX_ENTRY, sizeof(entry));
+        offsets[t+1] = offsets[t] + entry[0];
+        if(entry[1] > max_raw || (!(entry[2] & TILE_LZ) && entry[0] != entry[1]))
+            err = 1;
+    }
+    if(err || offsets[ntiles] != size){
+        fprintf(stderr, "flow_map_open(%s): file is too %s\n", filename, !err && offsets[ntiles] < size ? "long" : "short");
+        free(offsets);
+        free(flow);
+        return -1;
+    }
+
+    #pragma omp parallel for schedule(dynamic) if(ntiles > 1)
+    for(t = 0 ; t < ntiles ; t++){
+        if(err)
+            continue;
+        uint32_t entry[3];
+        memcpy(entry, index + (size_t) t * FLOW_PACK_INDEX_ENTRY, sizeof(entry));
+        const int rows = h - t*tile_rows < tile_rows ? h - t*tile_rows : tile_rows;
+        const uint8_t *tile = base + offsets[t];
+        uint8_t *raw = (uint8_t*) malloc(max_raw), *tmp = (uint8_t*) malloc(max_raw);
+        if(raw == NULL || tmp == NULL
+           || ((entry[2] & TILE_LZ) ? lz_decompress(raw, entry[1], tile, entry[0]) : (memcpy(raw, tile, entry[1]), 0)) != 0
+           || tile_decode(flow + (size_t) 2*t*tile_rows*w, tmp, raw, entry[1], w, rows, codec, entry[2] & TILE_SPARSE) != 0)
+            err = 1;
+        free(raw);
+        free(tmp);
+    }
+    free(offsets);
+    if(err){
+        fprintf(stderr, "flow_map_open(%s): corrupted tile\n", filename);
+        free(flow);
+        return -1;
+    }
+    *uv = flow;
+    *width = w;
+    *height = h;
+    return 0;
+}
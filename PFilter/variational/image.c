@@ -5,9 +5,7 @@
 #include <math.h>
 
 #include "image.h"
-
-#include <xmmintrin.h>
-typedef __v4sf v4sf;
+#include "simd.h"
 
 /********** Create/Delete **********/
 
@@ -20,8 +18,8 @@ image_t *image_new(const int width, const int height){
     }
     image->width = width;
     image->height = height;  
-    image->stride = ( (width+3) / 4 ) * 4;
-    image->data = (float*) memalign(16, image->stride*height*sizeof(float));
+    image->stride = ( (width+SIMD_MAX_WIDTH-1) / SIMD_MAX_WIDTH ) * SIMD_MAX_WIDTH;
+    image->data = (float*) memalign(SIMD_ALIGN, image->stride*height*sizeof(float));
     if(image->data == NULL){
         fprintf(stderr, "Error: image_new() - not enough memory !\n");
         exit(1);
@@ -58,8 +56,8 @@ void image_delete(image_t *image){
     if(image == NULL){
         //fprintf(stderr, "Warning: Delete image --> Ignore action (image not allocated)\n");
     }else{
-    //free(image->data);
-    //free(image);
+    free(image->data);
+    free(image);
     }
 }
 
@@ -73,8 +71,8 @@ color_image_t *color_image_new(const int width, const int height){
     }
     image->width = width;
     image->height = height;  
-    image->stride = ( (width+3) / 4 ) * 4;
-    image->c1 = (float*) memalign(16, 3*image->stride*height*sizeof(float));
+    image->stride = ( (width+SIMD_MAX_WIDTH-1) / SIMD_MAX_WIDTH ) * SIMD_MAX_WIDTH;
+    image->c1 = (float*) memalign(SIMD_ALIGN, 3*image->stride*height*sizeof(float));
     if(image->c1 == NULL){
         fprintf(stderr, "Error: color_image_new() - not enough memory !\n");
         exit(1);
@@ -99,8 +97,8 @@ void color_image_erase(color_image_t *image){
 /* free memory of a color image */
 void color_image_delete(color_image_t *image){
     if(image){
-        //free(image->c1); // c2 and c3 was allocated at the same moment
-        //free(image);
+        free(image->c1); // c2 and c3 was allocated at the same moment
+        free(image);
     }
 }
 
@@ -149,7 +147,7 @@ float *gaussian_filter(const float sigma, int *filter_order){
         exit(1);
     }
     memcpy(data2, &data[*filter_order], sizeof(float)*(*filter_order)+sizeof(float));
-    //free(data);
+    free(data);
     return data2;
 }
 
@@ -189,14 +187,14 @@ convolution_t *convolution_new(const int order, const float *half_coeffs, const
     conv->coeffs = (float *) malloc((2 * order + 1) * sizeof(float));
     if(conv->coeffs == NULL){
         fprintf(stderr, "Error: convolution_new() - not enough memory !\n");
-        //free(conv);
+        free(conv);
         exit(1);
     }
     conv->coeffs_accu = (float *) malloc((2 * order + 1) * sizeof(float));
     if(conv->coeffs_accu == NULL){
         fprintf(stderr, "Error: convolution_new() - not enough memory !\n");
-        //free(conv->coeffs);
-        //free(conv);
+        free(conv->coeffs);
+        free(conv);
         exit(1);
     }
     convolve_extract_coeffs(order, half_coeffs, conv->coeffs,conv->coeffs_accu, even);
@@ -267,30 +265,32 @@ static void convolve_horiz_fast_3(image_t *dst, const image_t *src, const convol
     const int stride_minus_1 = src->stride-1;
     const int iterline = (src->stride>>2);
     const float *coeff = conv->coeffs;
-    v4sf *srcp = (v4sf*) src->data, *dstp = (v4sf*) dst->data;
-    // create shifted version of src
-    float *src_p1 = (float*) malloc(sizeof(float)*src->stride),
-        *src_m1 = (float*) malloc(sizeof(float)*src->stride);
+    v4sf *dstp = (v4sf*) dst->data;
+    // create shifted version of src, the line itself is copied too so that its padding is
+    // filled in the copy: src may be read by other threads at the same time
+    float *src_0 = (float*) malloc(sizeof(float)*src->stride*3);
+    float *src_p1 = src_0+src->stride;
+    float *src_m1 = src_p1+src->stride;
     int j;
     for(j=0;j<src->height;j++){
         int i;
-        float *srcptr = (float*) srcp;
+        const float *srcptr = src->data+j*src->stride;
         const float right_coef = srcptr[src->width-1];
+        memcpy(src_0, srcptr, sizeof(float)*src->width);
         for(i=src->width;i<src->stride;i++)
-            srcptr[i] = right_coef;
-        src_m1[0] = srcptr[0];
-        memcpy(src_m1+1, srcptr , sizeof(float)*stride_minus_1);
+            src_0[i] = right_coef;
+        src_m1[0] = src_0[0];
+        memcpy(src_m1+1, src_0 , sizeof(float)*stride_minus_1);
         src_p1[stride_minus_1] = right_coef;
-        memcpy(src_p1, srcptr+1, sizeof(float)*stride_minus_1);
-        v4sf *srcp_p1 = (v4sf*) src_p1, *srcp_m1 = (v4sf*) src_m1;
+        memcpy(src_p1, src_0+1, sizeof(float)*stride_minus_1);
+        v4sf *srcp = (v4sf*) src_0, *srcp_p1 = (v4sf*) src_p1, *srcp_m1 = (v4sf*) src_m1;
         
         for(i=0;i<iterline;i++){
             *dstp = coeff[0]*(*srcp_m1) + coeff[1]*(*srcp) + coeff[2]*(*srcp_p1);
             dstp+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1;
         }
     }
-    //free(src_p1);
-    //free(src_m1);
+    free(src_0);
 }
 
 static void convolve_horiz_fast_5(image_t *dst, const image_t *src, const convolution_t *conv){
@@ -298,37 +298,40 @@ static void convolve_horiz_fast_5(image_t *dst, const image_t *src, const convol
     const int stride_minus_2 = src->stride-2;
     const int iterline = (src->stride>>2);
     const float *coeff = conv->coeffs;
-    v4sf *srcp = (v4sf*) src->data, *dstp = (v4sf*) dst->data;
-    float *src_p1 = (float*) malloc(sizeof(float)*src->stride*4);
+    v4sf *dstp = (v4sf*) dst->data;
+    // the line is copied with its padding filled, as in convolve_horiz_fast_3
+    float *src_0 = (float*) malloc(sizeof(float)*src->stride*5);
+    float *src_p1 = src_0+src->stride;
     float *src_p2 = src_p1+src->stride;
     float *src_m1 = src_p2+src->stride;
     float *src_m2 = src_m1+src->stride;
     int j;
     for(j=0;j<src->height;j++){
         int i;
-        float *srcptr = (float*) srcp;
+        const float *srcptr = src->data+j*src->stride;
         const float right_coef = srcptr[src->width-1];
+        memcpy(src_0, srcptr, sizeof(float)*src->width);
         for(i=src->width;i<src->stride;i++)
-            srcptr[i] = right_coef;
-        src_m1[0] = srcptr[0];
-        memcpy(src_m1+1, srcptr , sizeof(float)*stride_minus_1);
-        src_m2[0] = srcptr[0];
-        src_m2[1] = srcptr[0];
-        memcpy(src_m2+2, srcptr , sizeof(float)*stride_minus_2);
+            src_0[i] = right_coef;
+        src_m1[0] = src_0[0];
+        memcpy(src_m1+1, src_0 , sizeof(float)*stride_minus_1);
+        src_m2[0] = src_0[0];
+        src_m2[1] = src_0[0];
+        memcpy(src_m2+2, src_0 , sizeof(float)*stride_minus_2);
         src_p1[stride_minus_1] = right_coef;
-        memcpy(src_p1, srcptr+1, sizeof(float)*stride_minus_1);
+        memcpy(src_p1, src_0+1, sizeof(float)*stride_minus_1);
         src_p2[stride_minus_1] = right_coef;
         src_p2[stride_minus_2] = right_coef;
-        memcpy(src_p2, srcptr+2, sizeof(float)*stride_minus_2);
+        memcpy(src_p2, src_0+2, sizeof(float)*stride_minus_2);
                 
-        v4sf *srcp_p1 = (v4sf*) src_p1, *srcp_p2 = (v4sf*) src_p2, *srcp_m1 = (v4sf*) src_m1, *srcp_m2 = (v4sf*) src_m2;
+        v4sf *srcp = (v4sf*) src_0, *srcp_p1 = (v4sf*) src_p1, *srcp_p2 = (v4sf*) src_p2, *srcp_m1 = (v4sf*) src_m1, *srcp_m2 = (v4sf*) src_m2;
         
         for(i=0;i<iterline;i++){
             *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + coeff[2]*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
             dstp+=1; srcp_m2 +=1; srcp_m1+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
         }
     }
-    //free(src_p1);
+    free(src_0);
 }
 
 /* perform an horizontal convolution of an image */
@@ -451,9 +454,9 @@ void convolve_vert(image_t *dest, const image_t *src, const convolution_t *conv)
 void convolution_delete(convolution_t *conv){
     if(conv)
     {
-        //free(conv->coeffs);
-        //free(conv->coeffs_accu);
-        //free(conv);
+        free(conv->coeffs);
+        free(conv->coeffs_accu);
+        free(conv);
     }
 }
 
@@ -478,7 +481,7 @@ void color_image_convolve_hv(color_image_t *dst, const color_image_t *src, const
         convolve_vert(&dst_green,&tmp,vert_conv); 
         convolve_horiz(&tmp,&src_blue,horiz_conv); 
         convolve_vert(&dst_blue,&tmp,vert_conv);
-        //free(tmp_data);
+        free(tmp_data);
     }else if(horiz_conv != NULL && vert_conv == NULL){ // only horizontal
         convolve_horiz(&dst_red,&src_red,horiz_conv);
         convolve_horiz(&dst_green,&src_green,horiz_conv);
@@ -538,7 +541,7 @@ image_t* saliency(const color_image_t *im, float sigma_image, float sigma_matrix
     convolution_t *presmoothing = convolution_new(filter_size, presmooth_filter, 1);
     color_image_convolve_hv(sim, im, presmoothing, presmoothing);
     convolution_delete(presmoothing);
-    //free(presmooth_filter);
+    free(presmooth_filter);
   
     // compute derivatives
     float deriv_filter[2] = {0.0f, -0.5f};
@@ -573,7 +576,7 @@ image_t* saliency(const color_image_t *im, float sigma_image, float sigma_matrix
     convolve_horiz(tmp, imyy, smoothing);
     convolve_vert(imyy, tmp, smoothing);    
     convolution_delete(smoothing);
-    //free(smooth_filter);
+    free(smooth_filter);
     
     // compute smallest eigenvalue
     v4sf vzeros = {0.0f,0.0f,0.0f,0.0f};
@@ -592,3 +595,58 @@ image_t* saliency(const color_image_t *im, float sigma_image, float sigma_matrix
     
     return tmp;
 }
+
+/* halve one plane by averaging blocks of 2x2 pixels, the last column and row are repeated for odd sizes */
+static void downscale_half_plane(float *dst, const int dst_width, const int dst_height, const int dst_stride, const float *src, const int src_width, const int src_height, const int src_stride){
+    int i,j;
+    for(j=0 ; j<dst_height ; j++){
+        const float *src0 = src+2*j*src_stride;
+        const float *src1 = (2*j+1<src_height) ? src0+src_stride : src0;
+        float *dstp = dst+j*dst_stride;
+        for(i=0 ; i<dst_width ; i++){
+            const int i1 = (2*i+1<src_width) ? 2*i+1 : 2*i;
+            dstp[i] = 0.25f*(src0[2*i]+src0[i1]+src1[2*i]+src1[i1]);
+        }
+        memset(dstp+dst_width, 0, (dst_stride-dst_width)*sizeof(float));
+    }
+}
+
+/* halve an image by averaging blocks of 2x2 pixels, dst must be of size (width+1)/2 x (height+1)/2 */
+void image_downscale_half(image_t *dst, const image_t *src){
+    downscale_half_plane(dst->data, dst->width, dst->height, dst->stride, src->data, src->width, src->height, src->stride);
+}
+
+/* halve a color image by averaging blocks of 2x2 pixels, dst must be of size (width+1)/2 x (height+1)/2 */
+void color_image_downscale_half(color_image_t *dst, const color_image_t *src){
+    downscale_half_plane(dst->c1, dst->width, dst->height, dst->stride, src->c1, src->width, src->height, src->stride);
+    downscale_half_plane(dst->c2, dst->width, dst->height, dst->stride, src->c2, src->width, src->height, src->stride);
+    downscale_half_plane(dst->c3, dst->width, dst->height, dst->stride, src->c3, src->width, src->height, src->stride);
+}
+
+/* add coef times the bilinear upsampling of src to dst, src being a downscaled version of dst */
+void image_add_upsampled(image_t *dst, const image_t *src, const float coef){
+    int i,j;
+    const float scalex = (float) src->width/dst->width, scaley = (float) src->height/dst->height;
+    for(j=0 ; j<dst->height ; j++){
+        // pixel centers are aligned, coordinates are clamped to the border of src
+        float y = ((float) j+0.5f)*scaley-0.5f;
+        y = (y<0.0f) ? 0.0f : y;
+        int y0 = (int) y;
+        y0 = (y0>src->height-2) ? src->height-2 : y0;
+        y0 = (y0<0) ? 0 : y0;
+        const int y1 = (y0+1<src->height) ? y0+1 : y0;
+        const float dy = (y-y0>1.0f) ? 1.0f : y-y0;
+        const float *src0 = src->data+y0*src->stride, *src1 = src->data+y1*src->stride;
+        float *dstp = dst->data+j*dst->stride;
+        for(i=0 ; i<dst->width ; i++){
+            float x = ((float) i+0.5f)*scalex-0.5f;
+            x = (x<0.0f) ? 0.0f : x;
+            int x0 = (int) x;
+            x0 = (x0>src->width-2) ? src->width-2 : x0;
+            x0 = (x0<0) ? 0 : x0;
+            const int x1 = (x0+1<src->width) ? x0+1 : x0;
+            const float dx = (x-x0>1.0f) ? 1.0f : x-x0;
+            dstp[i] += coef*( (1.0f-dy)*((1.0f-dx)*src0[x0]+dx*src0[x1]) + dy*((1.0f-dx)*src1[x0]+dx*src1[x1]) );
+        }
+    }
+}
@@ -16,8 +16,8 @@ typedef struct image_s
 {
   int width;		/* Width of the image */
   int height;		/* Height of the image */
-  int stride;		/* Width of the memory (width + paddind such that it is a multiple of 4) */
-  float *data;		/* Image data, aligned */
+  int stride;		/* Width of the memory (width + paddind such that it is a multiple of 16) */
+  float *data;		/* Image data, aligned on 64 bytes */
 } image_t;
 
 /* structure for 3-channels image stored with one layer per color, it assumes that c2 = c1+width*height and c3 = c2+width*height. */
@@ -25,8 +25,8 @@ typedef struct color_image_s
 {
     int width;			/* Width of the image */
     int height;			/* Height of the image */
-    int stride;         /* Width of the memory (width + paddind such that it is a multiple of 4) */
-    float *c1;			/* Color 1, aligned */
+    int stride;         /* Width of the memory (width + paddind such that it is a multiple of 16) */
+    float *c1;			/* Color 1, aligned on 64 bytes */
     float *c2;			/* Color 2, consecutive to c1*/
     float *c3;			/* Color 3, consecutive to c2 */
 } color_image_t;
@@ -97,6 +97,15 @@ color_image_t *rgb_to_lab(const color_image_t *im);
 /* compute the saliency of a given image */
 image_t* saliency(const color_image_t *im, float sigma_image, float sigma_matrix );
 
+/* halve an image by averaging blocks of 2x2 pixels, dst must be of size (width+1)/2 x (height+1)/2 */
+void image_downscale_half(image_t *dst, const image_t *src);
+
+/* halve a color image by averaging blocks of 2x2 pixels, dst must be of size (width+1)/2 x (height+1)/2 */
+void color_image_downscale_half(color_image_t *dst, const color_image_t *src);
+
+/* add coef times the bilinear upsampling of src to dst, src being a downscaled version of dst */
+void image_add_upsampled(image_t *dst, const image_t *src, const float coef);
+
 #endif
 
 #ifdef __cplusplus
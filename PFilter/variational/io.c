@@ -6,6 +6,7 @@
 #include <setjmp.h>
 #include <png.h>
 #include "io.h"
+#include "flow_io.h"
 
 /*********** EDGES and MATCHES ***********/
 
@@ -46,48 +47,27 @@ float_image read_matches(const char *filename){
 
 /* read a flow file and returns a pointer with two images containing the flow along x and y axis */
 image_t** readFlowFile(const char* filename){
-    FILE *fid = fopen(filename, "rb");
-    if (fid == 0){
-        fprintf(stderr,"readFlow() error: could not open file  %s\n",filename);
+    flow_map_t map;
+    if (flow_map_open(&map, filename) != 0){
+        fprintf(stderr,"readFlow() error: could not read file  %s\n",filename);
         exit(1);
     }
-    float help;
-    fread(&help,sizeof(float),1,fid);
-    int aXSize,aYSize;
-    fread(&aXSize,sizeof(int),1,fid);
-    fread(&aYSize,sizeof(int),1,fid);
     image_t** flow = (image_t**) malloc(sizeof(image_t*)*2);
-    flow[0] = image_new(aXSize, aYSize);
-    flow[1] = image_new(aXSize, aYSize);
-    int x,y;
-    for (y = 0; y < aYSize; y++)
-        for (x = 0; x < aXSize ; x++) {
-            fread(&(flow[0]->data[y*flow[0]->stride+x]),sizeof(float),1,fid);
-            fread(&(flow[1]->data[y*flow[0]->stride+x]),sizeof(float),1,fid);
-    }
-    fclose(fid);
+    flow[0] = image_new(map.width, map.height);
+    flow[1] = image_new(map.width, map.height);
+    int y;
+    for (y = 0; y < map.height; y++)
+        flow_deinterleave(flow[0]->data + y*flow[0]->stride, flow[1]->data + y*flow[1]->stride, map.data + 2*y*map.width, map.width);
+    flow_map_close(&map);
     return flow;
 }
 
 /* write a flow to a file */
 void writeFlowFile(const char *filename, const image_t *flowx, const image_t *flowy){
-    FILE *stream = fopen(filename, "wb");
-    if (stream == 0){
-        fprintf(stderr, "Error while opening %s\n",filename);
+    if (flow_write_planar(filename, flowx->data, flowy->data, flowx->width, flowx->height, flowx->stride) != 0){
+        fprintf(stderr, "Error while writing %s\n",filename);
         exit(1);
     }
-    const float help=202021.25;
-    fwrite(&help,sizeof(float),1,stream);
-    const int aXSize = flowx->width, aYSize = flowx->height;
-    fwrite(&aXSize,sizeof(int),1,stream);
-    fwrite(&aYSize,sizeof(int),1,stream);
-    int y,x;
-    for (y = 0; y < aYSize ; y++)
-        for (x = 0; x < aXSize ; x++) {
-	        fwrite(&flowx->data[y*flowx->stride+x],sizeof(float),1,stream);
-	        fwrite(&flowy->data[y*flowy->stride+x],sizeof(float),1,stream);
-        }
-    fclose(stream);
 }
 
 /********************* IMAGE ***********************/
@@ -0,0 +1,37 @@
+#ifndef __SIMD_H_
+#define __SIMD_H_
+
+#include <xmmintrin.h>
+#include <immintrin.h>
+
+/* images are aligned on SIMD_ALIGN bytes and their stride is a multiple of SIMD_MAX_WIDTH floats,
+   so that every line and every plane of an image can be processed with the widest vectors */
+#define SIMD_ALIGN 64
+#define SIMD_MAX_WIDTH 16
+
+/* float vectors of 4, 8 and 16 lanes, the _u versions are for unaligned accesses */
+typedef __v4sf v4sf;
+typedef float v8sf __attribute__((vector_size(32), __may_alias__));
+typedef float v16sf __attribute__((vector_size(64), __may_alias__));
+typedef float v4sf_u __attribute__((vector_size(16), __may_alias__, aligned(4)));
+typedef float v8sf_u __attribute__((vector_size(32), __may_alias__, aligned(4)));
+typedef float v16sf_u __attribute__((vector_size(64), __may_alias__, aligned(4)));
+
+/* the 8 and 16 lanes kernels are compiled for their instruction set only, with
+   #pragma GCC target or __attribute__((target)), and are chosen at run time */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_DISPATCH
+#endif
+
+/* number of float lanes of the widest kernels usable on this cpu: 16 (AVX-512), 8 (AVX2 and FMA) or 4 (SSE) */
+static inline int simd_width(void){
+#ifdef SIMD_DISPATCH
+    if(__builtin_cpu_supports("avx512f"))
+        return 16;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return 8;
+#endif
+    return 4;
+}
+
+#endif
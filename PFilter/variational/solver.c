@@ -6,9 +6,7 @@
 
 #include "image.h"
 #include "solver.h"
-
-#include <xmmintrin.h>
-typedef __v4sf v4sf;
+#include "simd.h"
 
 //THIS IS A SLOW VERSION BUT READABLE
 //Perform n iterations of the sor_coupled algorithm
@@ -60,18 +58,21 @@ void sor_coupled_slow_but_readable(image_t *du, image_t *dv, const image_t *a11,
  // THIS IS A FASTER VERSION BUT UNREADABLE
  // the first iteration is separated from the other to compute the inverse of the 2x2 block diagonal
  // each iteration is split in two first line / middle lines / last line, and the left block is computed separately on each line
-void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, image_t *b1, image_t *b2, image_t *dpsis_horiz, image_t *dpsis_vert, const int iterations, const float omega){
+// each sweep accumulates the squared change of du and dv over the image, the iterations end once its rms is below tol
+int sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, image_t *b1, image_t *b2, image_t *dpsis_horiz, image_t *dpsis_vert, const int iterations, const float omega, const float tol){
     //sor_coupled_slow_but_readable(du,dv,a11,a12,a22,b1,b2,dpsis_horiz,dpsis_vert,iterations,omega); return; printf("test\n");
   
     if(du->width<2 || du->height<2 || iterations < 1){
         sor_coupled_slow_but_readable(du,dv,a11,a12,a22,b1,b2,dpsis_horiz,dpsis_vert,iterations,omega);
-        return;
+        return iterations > 0 ? iterations : 0;
     }
     
     const int stride = du->stride, width = du->width;
     const int iterheight = du->height-1, iterline = (stride)/4, width_minus_1_sizeoffloat = sizeof(float)*(width-1);
+    const float update_max = tol*tol*du->width*du->height;
     int j,iter,i,k;
-    float *floatarray = (float*) memalign(16, stride*sizeof(float)*3); 
+    float update;
+    float *floatarray = (float*) memalign(16, stride*sizeof(float)*4); 
     if(floatarray==NULL){
         fprintf(stderr, "error in sor_coupled(): not enough memory\n");
         exit(1);
@@ -79,12 +80,17 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
     float *f1 = floatarray;
     float *f2 = f1+stride;
     float *f3 = f2+stride;
+    float *f4 = f3+stride; // 1 inside the image and 0 on the padding, where the change is not added to update:
+                           // the diagonal blocks of the padding may be singular and its change NaN, which a 0 weight would not cancel
     f1[0] = 0.0f;
     memset(&f1[width], 0, sizeof(float)*(stride-width));
     memset(&f2[width-1], 0, sizeof(float)*(stride-width+1));
     memset(&f3[width-1], 0, sizeof(float)*(stride-width+1));   	  
+    for(i=0 ; i<stride ; i++)
+        f4[i] = (i<width) ? 1.0f : 0.0f;
 
     { // first iteration
+        update = 0.0f;
         v4sf *a11p = (v4sf*) a11->data, *a12p = (v4sf*) a12->data, *a22p = (v4sf*) a22->data, *b1p = (v4sf*) b1->data, *b2p = (v4sf*) b2->data, *hp = (v4sf*) dpsis_horiz->data, *vp = (v4sf*) dpsis_vert->data;
         float *du_ptr = du->data, *dv_ptr = dv->data;
         v4sf *dub = (v4sf*) (du_ptr+stride), *dvb = (v4sf*) (dv_ptr+stride);
@@ -94,7 +100,7 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
             memcpy(f1+1, ((float*) hp), width_minus_1_sizeoffloat);   
             memcpy(f2, du_ptr+1, width_minus_1_sizeoffloat);
             memcpy(f3, dv_ptr+1, width_minus_1_sizeoffloat);
-            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3;
+            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3, *vl = (v4sf*) f4;
             
             { // left block
                 // reverse 2x2 diagonal block
@@ -107,16 +113,20 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vp)*(*dub) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vp)*(*dvb) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                const float eu0 = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ), ev0 = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );
+                du_ptr[0] += eu0;
+                dv_ptr[0] += ev0;
+                if(vl[0][0] != 0.0f) update += eu0*eu0 + ev0*ev0;             
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dub+=1; dvb +=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;        
             }
@@ -134,11 +144,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dub+=1; dvb +=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;
             }
@@ -152,7 +164,7 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
             memcpy(f1+1, ((float*) hp), width_minus_1_sizeoffloat);   
             memcpy(f2, du_ptr+1, width_minus_1_sizeoffloat);
             memcpy(f3, dv_ptr+1, width_minus_1_sizeoffloat);
-            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3;
+            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3, *vl = (v4sf*) f4;
                  
             { // left block
                 // reverse 2x2 diagonal block
@@ -165,16 +177,20 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vpt)*(*dut) + (*vp)*(*dub) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vpt)*(*dvt) + (*vp)*(*dvb) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                const float eu0 = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ), ev0 = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );
+                du_ptr[0] += eu0;
+                dv_ptr[0] += ev0;
+                if(vl[0][0] != 0.0f) update += eu0*eu0 + ev0*ev0;             
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dut+=1; dvt+=1; dub+=1; dvb +=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;           
             }
@@ -192,11 +208,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dut+=1; dvt+=1; dub+=1; dvb +=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;
             }
@@ -207,7 +225,7 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
             memcpy(f1+1, ((float*) hp), width_minus_1_sizeoffloat);   
             memcpy(f2, du_ptr+1, width_minus_1_sizeoffloat);
             memcpy(f3, dv_ptr+1, width_minus_1_sizeoffloat);
-            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3;
+            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3, *vl = (v4sf*) f4;
 
             { // left block
                 // reverse 2x2 diagonal block
@@ -220,16 +238,20 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vpt)*(*dut) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vpt)*(*dvt) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                const float eu0 = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ), ev0 = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );
+                du_ptr[0] += eu0;
+                dv_ptr[0] += ev0;
+                if(vl[0][0] != 0.0f) update += eu0*eu0 + ev0*ev0;             
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dut+=1; dvt+=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;           
             }
@@ -247,11 +269,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dut+=1; dvt+=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;
             }
@@ -259,7 +283,8 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
         }
     }
 
-   for(iter=iterations;--iter;){ // other iterations
+   for(iter=iterations ; --iter && (tol <= 0.0f || update >= update_max) ;){ // other iterations
+        update = 0.0f;
         v4sf *a11p = (v4sf*) a11->data, *a12p = (v4sf*) a12->data, *a22p = (v4sf*) a22->data, *b1p = (v4sf*) b1->data, *b2p = (v4sf*) b2->data, *hp = (v4sf*) dpsis_horiz->data, *vp = (v4sf*) dpsis_vert->data;
         float *du_ptr = du->data, *dv_ptr = dv->data;
         v4sf *dub = (v4sf*) (du_ptr+stride), *dvb = (v4sf*) (dv_ptr+stride);
@@ -269,22 +294,26 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
             memcpy(f1+1, ((float*) hp), width_minus_1_sizeoffloat);   
             memcpy(f2, du_ptr+1, width_minus_1_sizeoffloat);
             memcpy(f3, dv_ptr+1, width_minus_1_sizeoffloat);
-            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3;
+            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3, *vl = (v4sf*) f4;
             
             { // left block
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vp)*(*dub) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vp)*(*dvb) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                const float eu0 = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ), ev0 = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );
+                du_ptr[0] += eu0;
+                dv_ptr[0] += ev0;
+                if(vl[0][0] != 0.0f) update += eu0*eu0 + ev0*ev0;             
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dub+=1; dvb +=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;        
             }
@@ -295,11 +324,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dub+=1; dvb +=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;
             }
@@ -313,22 +344,26 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
             memcpy(f1+1, ((float*) hp), width_minus_1_sizeoffloat);   
             memcpy(f2, du_ptr+1, width_minus_1_sizeoffloat);
             memcpy(f3, dv_ptr+1, width_minus_1_sizeoffloat);
-            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3;
+            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3, *vl = (v4sf*) f4;
                  
             { // left block
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vpt)*(*dut) + (*vp)*(*dub) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vpt)*(*dvt) + (*vp)*(*dvb) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                const float eu0 = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ), ev0 = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );
+                du_ptr[0] += eu0;
+                dv_ptr[0] += ev0;
+                if(vl[0][0] != 0.0f) update += eu0*eu0 + ev0*ev0;             
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dut+=1; dvt+=1; dub+=1; dvb +=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;           
             }
@@ -339,11 +374,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dut+=1; dvt+=1; dub+=1; dvb +=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;
             }
@@ -354,22 +391,26 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
             memcpy(f1+1, ((float*) hp), width_minus_1_sizeoffloat);   
             memcpy(f2, du_ptr+1, width_minus_1_sizeoffloat);
             memcpy(f3, dv_ptr+1, width_minus_1_sizeoffloat);
-            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3;
+            v4sf* hpl = (v4sf*) f1, *dur = (v4sf*) f2, *dvr = (v4sf*) f3, *vl = (v4sf*) f4;
 
             { // left block
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vpt)*(*dut) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vpt)*(*dvt) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                const float eu0 = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ), ev0 = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );
+                du_ptr[0] += eu0;
+                dv_ptr[0] += ev0;
+                if(vl[0][0] != 0.0f) update += eu0*eu0 + ev0*ev0;             
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dut+=1; dvt+=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;           
             }
@@ -380,11 +421,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    const float eu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ), ev = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    du_ptr[k] += eu;
+                    dv_ptr[k] += ev;
+                    if(vl[0][k] != 0.0f) update += eu*eu + ev*ev;
                 }
                 // increment pointer
-                hpl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
+                hpl+=1; vl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
                 dur+=1; dvr+=1; dut+=1; dvt+=1; b1p+=1; b2p+=1;
                 du_ptr += 4; dv_ptr += 4;
             }
@@ -395,5 +438,230 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
 
 
     free(floatarray);
+    return iterations-iter;
+}
+
+
+/* RED-BLACK VERSION
+   the pixels are coloured as a checkerboard, (i+j)%2, so that the 4 neighbours of a pixel all have the other colour.
+   A sweep updates all the red pixels then all the black ones, each half sweep being independent across pixels,
+   it is thus split across rows between threads and vectorized along the rows.
+   The independence holds for the values used only: the vector loads of the lines above and below also fetch the
+   pixels of the current colour, which the thread of that line may be writing at the same time, and the lanes
+   holding them are discarded. Nothing may be changed to use those lanes, nor to write back whole vectors. */
+
+/* pointers to one line of the system and its neighbouring lines */
+typedef struct sor_row_s {
+    float *du, *dv;                             // current line of the flow increment
+    const float *du_up, *dv_up, *du_down, *dv_down; // lines above and below
+    const float *a11, *a12, *a22;               // inverse of the 2x2 diagonal block
+    const float *b1, *b2;                       // right hand side
+    const float *horiz;                         // weight between pixel i and i+1
+    const float *vert_up, *vert;                // weight to the line above and below
+} sor_row_t;
+
+/* update one pixel of a line, return its squared change */
+static inline float sor_redblack_pixel(const sor_row_t *r, const int i, const int width, const float omega){
+    float B1 = r->b1[i] + r->vert_up[i]*r->du_up[i] + r->vert[i]*r->du_down[i];
+    float B2 = r->b2[i] + r->vert_up[i]*r->dv_up[i] + r->vert[i]*r->dv_down[i];
+    if(i>0){
+        B1 += r->horiz[i-1]*r->du[i-1];
+        B2 += r->horiz[i-1]*r->dv[i-1];
+    }
+    if(i<width-1){
+        B1 += r->horiz[i]*r->du[i+1];
+        B2 += r->horiz[i]*r->dv[i+1];
+    }
+    const float eu = omega*( r->a11[i]*B1 + r->a12[i]*B2 - r->du[i] ), ev = omega*( r->a12[i]*B1 + r->a22[i]*B2 - r->dv[i] );
+    r->du[i] += eu;
+    r->dv[i] += ev;
+    return eu*eu + ev*ev;
+}
+
+/* update the pixels of a line lying in blocks of 4 from i=1 to width-2, the lanes k0 and k0+2 of each block are updated.
+   The squared changes of the updated pixels are added to update. Return the first pixel not processed */
+static int sor_redblack_row_sse(const sor_row_t *r, const int width, const int k0, const float omega, float *update){
+    const v4sf om = {omega, omega, omega, omega};
+    v4sf acc = {0.0f, 0.0f, 0.0f, 0.0f};
+    int i;
+    for(i=1 ; i+4<=width-1 ; i+=4){
+        const v4sf hl = _mm_loadu_ps(r->horiz+i-1), hr = _mm_loadu_ps(r->horiz+i), vu = _mm_loadu_ps(r->vert_up+i), vd = _mm_loadu_ps(r->vert+i);
+        const v4sf s1 = _mm_loadu_ps(r->b1+i) + hl*_mm_loadu_ps(r->du+i-1) + hr*_mm_loadu_ps(r->du+i+1) + vu*_mm_loadu_ps(r->du_up+i) + vd*_mm_loadu_ps(r->du_down+i);
+        const v4sf s2 = _mm_loadu_ps(r->b2+i) + hl*_mm_loadu_ps(r->dv+i-1) + hr*_mm_loadu_ps(r->dv+i+1) + vu*_mm_loadu_ps(r->dv_up+i) + vd*_mm_loadu_ps(r->dv_down+i);
+        const v4sf a11 = _mm_loadu_ps(r->a11+i), a12 = _mm_loadu_ps(r->a12+i), a22 = _mm_loadu_ps(r->a22+i);
+        const v4sf du = _mm_loadu_ps(r->du+i), dv = _mm_loadu_ps(r->dv+i);
+        const v4sf nu = du + om*( a11*s1 + a12*s2 - du );
+        const v4sf nv = dv + om*( a12*s1 + a22*s2 - dv );
+        // only the pixels of the current colour are written, the others may be read by the neighbouring lines
+        r->du[i+k0] = nu[k0]; r->du[i+k0+2] = nu[k0+2];
+        r->dv[i+k0] = nv[k0]; r->dv[i+k0+2] = nv[k0+2];
+        const v4sf eu = nu-du, ev = nv-dv;
+        acc += eu*eu + ev*ev;
+    }
+    *update += acc[k0] + acc[k0+2];
+    return i;
+}
+
+#ifdef SIMD_DISPATCH
+
+/* same as sor_redblack_row_sse with blocks of 8 and masked stores */
+__attribute__((target("avx2,fma")))
+static int sor_redblack_row_avx2(const sor_row_t *r, const int width, const int k0, const float omega, float *update){
+    const __m256 om = _mm256_set1_ps(omega);
+    const __m256i mask = k0 ? _mm256_setr_epi32(0,-1,0,-1,0,-1,0,-1) : _mm256_setr_epi32(-1,0,-1,0,-1,0,-1,0);
+    __m256 acc = _mm256_setzero_ps();
+    int i;
+    for(i=1 ; i+8<=width-1 ; i+=8){
+        const __m256 hl = _mm256_loadu_ps(r->horiz+i-1), hr = _mm256_loadu_ps(r->horiz+i), vu = _mm256_loadu_ps(r->vert_up+i), vd = _mm256_loadu_ps(r->vert+i);
+        __m256 s1 = _mm256_fmadd_ps(hl, _mm256_loadu_ps(r->du+i-1), _mm256_loadu_ps(r->b1+i));
+        __m256 s2 = _mm256_fmadd_ps(hl, _mm256_loadu_ps(r->dv+i-1), _mm256_loadu_ps(r->b2+i));
+        s1 = _mm256_fmadd_ps(hr, _mm256_loadu_ps(r->du+i+1), s1);
+        s2 = _mm256_fmadd_ps(hr, _mm256_loadu_ps(r->dv+i+1), s2);
+        s1 = _mm256_fmadd_ps(vu, _mm256_loadu_ps(r->du_up+i), s1);
+        s2 = _mm256_fmadd_ps(vu, _mm256_loadu_ps(r->dv_up+i), s2);
+        s1 = _mm256_fmadd_ps(vd, _mm256_loadu_ps(r->du_down+i), s1);
+        s2 = _mm256_fmadd_ps(vd, _mm256_loadu_ps(r->dv_down+i), s2);
+        const __m256 a11 = _mm256_loadu_ps(r->a11+i), a12 = _mm256_loadu_ps(r->a12+i), a22 = _mm256_loadu_ps(r->a22+i);
+        const __m256 du = _mm256_loadu_ps(r->du+i), dv = _mm256_loadu_ps(r->dv+i);
+        const __m256 nu = _mm256_fmadd_ps(om, _mm256_fmadd_ps(a11, s1, _mm256_fmsub_ps(a12, s2, du)), du);
+        const __m256 nv = _mm256_fmadd_ps(om, _mm256_fmadd_ps(a22, s2, _mm256_fmsub_ps(a12, s1, dv)), dv);
+        _mm256_maskstore_ps(r->du+i, mask, nu);
+        _mm256_maskstore_ps(r->dv+i, mask, nv);
+        const __m256 eu = _mm256_and_ps(_mm256_sub_ps(nu, du), _mm256_castsi256_ps(mask)), ev = _mm256_and_ps(_mm256_sub_ps(nv, dv), _mm256_castsi256_ps(mask));
+        acc = _mm256_fmadd_ps(eu, eu, _mm256_fmadd_ps(ev, ev, acc));
+    }
+    int k;
+    for(k=0 ; k<8 ; k++)
+        *update += acc[k];
+    return i;
+}
+
+/* same as sor_redblack_row_sse with blocks of 16 and masked stores */
+__attribute__((target("avx512f")))
+static int sor_redblack_row_avx512(const sor_row_t *r, const int width, const int k0, const float omega, float *update){
+    const __m512 om = _mm512_set1_ps(omega);
+    const __mmask16 mask = k0 ? 0xAAAA : 0x5555;
+    __m512 acc = _mm512_setzero_ps();
+    int i;
+    for(i=1 ; i+16<=width-1 ; i+=16){
+        const __m512 hl = _mm512_loadu_ps(r->horiz+i-1), hr = _mm512_loadu_ps(r->horiz+i), vu = _mm512_loadu_ps(r->vert_up+i), vd = _mm512_loadu_ps(r->vert+i);
+        __m512 s1 = _mm512_fmadd_ps(hl, _mm512_loadu_ps(r->du+i-1), _mm512_loadu_ps(r->b1+i));
+        __m512 s2 = _mm512_fmadd_ps(hl, _mm512_loadu_ps(r->dv+i-1), _mm512_loadu_ps(r->b2+i));
+        s1 = _mm512_fmadd_ps(hr, _mm512_loadu_ps(r->du+i+1), s1);
+        s2 = _mm512_fmadd_ps(hr, _mm512_loadu_ps(r->dv+i+1), s2);
+        s1 = _mm512_fmadd_ps(vu, _mm512_loadu_ps(r->du_up+i), s1);
+        s2 = _mm512_fmadd_ps(vu, _mm512_loadu_ps(r->dv_up+i), s2);
+        s1 = _mm512_fmadd_ps(vd, _mm512_loadu_ps(r->du_down+i), s1);
+        s2 = _mm512_fmadd_ps(vd, _mm512_loadu_ps(r->dv_down+i), s2);
+        const __m512 a11 = _mm512_loadu_ps(r->a11+i), a12 = _mm512_loadu_ps(r->a12+i), a22 = _mm512_loadu_ps(r->a22+i);
+        const __m512 du = _mm512_loadu_ps(r->du+i), dv = _mm512_loadu_ps(r->dv+i);
+        const __m512 nu = _mm512_fmadd_ps(om, _mm512_fmadd_ps(a11, s1, _mm512_fmsub_ps(a12, s2, du)), du);
+        const __m512 nv = _mm512_fmadd_ps(om, _mm512_fmadd_ps(a22, s2, _mm512_fmsub_ps(a12, s1, dv)), dv);
+        _mm512_mask_storeu_ps(r->du+i, mask, nu);
+        _mm512_mask_storeu_ps(r->dv+i, mask, nv);
+        const __m512 eu = _mm512_sub_ps(nu, du), ev = _mm512_sub_ps(nv, dv);
+        acc = _mm512_mask3_fmadd_ps(eu, eu, acc, mask);
+        acc = _mm512_mask3_fmadd_ps(ev, ev, acc, mask);
+    }
+    int k;
+    for(k=0 ; k<16 ; k++)
+        *update += acc[k];
+    return i;
+}
+#endif
+
+typedef int (*sor_redblack_row_fn)(const sor_row_t *r, const int width, const int k0, const float omega, float *update);
+
+/* Perform n iterations of a red-black sor for the same system as sor_coupled, a11 a12 and a22 are also replaced by the inverse of the diagonal blocks.
+   The iterations end once the rms change of du and dv over a sweep is below tol, return the number of iterations done */
+int sor_coupled_redblack(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, image_t *b1, image_t *b2, image_t *dpsis_horiz, image_t *dpsis_vert, const int iterations, const float omega, const float tol){
+    if(du->width<2 || du->height<2 || iterations < 1){
+        sor_coupled_slow_but_readable(du,dv,a11,a12,a22,b1,b2,dpsis_horiz,dpsis_vert,iterations,omega);
+        return iterations > 0 ? iterations : 0;
+    }
+
+    const int width = du->width, height = du->height, stride = du->stride;
+    const float update_max = tol*tol*width*height;
+    // sum of the squared changes of a sweep, two of them so that one is reset while the other is compared to update_max
+    float update[2] = {0.0f, 0.0f};
+    int niter = iterations;
+    // the weights outside the image are read from a line of zeros
+    float *zeros = (float*) calloc(stride, sizeof(float));
+    if(zeros==NULL){
+        fprintf(stderr, "error in sor_coupled_redblack(): not enough memory\n");
+        exit(1);
+    }
+
+    sor_redblack_row_fn row_fn = sor_redblack_row_sse;
+#ifdef SIMD_DISPATCH
+    switch(simd_width()){
+    case 16: row_fn = sor_redblack_row_avx512; break;
+    case 8: row_fn = sor_redblack_row_avx2; break;
+    }
+#endif
+
+#pragma omp parallel
+    {
+        int j, iter, colour;
+        // reverse the 2x2 diagonal blocks
+#pragma omp for schedule(static)
+        for(j=0 ; j<height ; j++){
+            const int o = j*stride;
+            int i;
+            for(i=0 ; i<width ; i++){
+                float dpsis = 0.0f;
+                if(i>0) dpsis += dpsis_horiz->data[o+i-1];
+                if(i<width-1) dpsis += dpsis_horiz->data[o+i];
+                if(j>0) dpsis += dpsis_vert->data[o-stride+i];
+                if(j<height-1) dpsis += dpsis_vert->data[o+i];
+                const float A11 = a22->data[o+i]+dpsis, A22 = a11->data[o+i]+dpsis;
+                const float det = A11*A22 - a12->data[o+i]*a12->data[o+i];
+                a11->data[o+i] = A11/det;
+                a22->data[o+i] = A22/det;
+                a12->data[o+i] /= -det;
+            }
+        }
+        for(iter=0 ; iter<iterations ; iter++){
+            float thread_update = 0.0f;
+            for(colour=0 ; colour<2 ; colour++){
+#pragma omp for schedule(static)
+                for(j=0 ; j<height ; j++){
+                    const int o = j*stride;
+                    sor_row_t r;
+                    r.du = du->data+o; r.dv = dv->data+o;
+                    r.du_up = j>0 ? r.du-stride : r.du; r.dv_up = j>0 ? r.dv-stride : r.dv;
+                    r.du_down = j<height-1 ? r.du+stride : r.du; r.dv_down = j<height-1 ? r.dv+stride : r.dv;
+                    r.a11 = a11->data+o; r.a12 = a12->data+o; r.a22 = a22->data+o;
+                    r.b1 = b1->data+o; r.b2 = b2->data+o;
+                    r.horiz = dpsis_horiz->data+o;
+                    r.vert_up = j>0 ? dpsis_vert->data+o-stride : zeros;
+                    r.vert = j<height-1 ? dpsis_vert->data+o : zeros;
+                    // pixel 0, the vectorized middle of the line starting at pixel 1 and the remaining right pixels
+                    int i;
+                    if(((j+colour)&1)==0)
+                        thread_update += sor_redblack_pixel(&r, 0, width, omega);
+                    for(i=row_fn(&r, width, (colour+j+1)&1, omega, &thread_update) ; i<width ; i++)
+                        if(((i+j)&1)==colour)
+                            thread_update += sor_redblack_pixel(&r, i, width, omega);
+                }
+            }
+            if(tol > 0.0f){
+#pragma omp atomic
+                update[iter&1] += thread_update;
+#pragma omp barrier
+                // every thread reads the same complete sum and leaves at the same iteration
+                if(update[iter&1] < update_max){
+#pragma omp single nowait
+                    niter = iter+1;
+                    break;
+                }
+                // the other sum was last read before the barrier and is next written after the barriers of the following sweep
+#pragma omp single nowait
+                update[(iter+1)&1] = 0.0f;
+            }
+        }
+    }
 
+    free(zeros);
+    return niter;
 }
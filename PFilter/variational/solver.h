@@ -7,8 +7,12 @@ extern "C" {
 
 #include "image.h"
 
-// Perform n iterations of the sor_coupled algorithm for a system of the form as described in opticalflow.c
-void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, image_t *b1, image_t *b2, image_t *dpsis_horiz, image_t *dpsis_vert, const int iterations, const float omega);
+// Perform up to n iterations of the sor_coupled algorithm for a system of the form as described in opticalflow.c
+// The iterations end early once the rms change of du and dv over a sweep is below tol (0 runs all of them), return the number of iterations done
+int sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, image_t *b1, image_t *b2, image_t *dpsis_horiz, image_t *dpsis_vert, const int iterations, const float omega, const float tol);
+
+// Same as sor_coupled with a red-black ordering, parallel across the lines and vectorized with the widest available instruction set
+int sor_coupled_redblack(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, image_t *b1, image_t *b2, image_t *dpsis_horiz, image_t *dpsis_vert, const int iterations, const float omega, const float tol);
 
 #ifdef __cplusplus
 }
@@ -7,39 +7,42 @@
 #include "variational_aux.h"
 #include "solver.h"
 
+#define VARIATIONAL_MIN_LEVEL_SIZE 16 // smallest width or height of a coarse level of the pyramid
 
-#include <xmmintrin.h>
-typedef __v4sf v4sf;
-
-convolution_t *deriv, *deriv_flow;
-float half_alpha, half_delta_over3, half_gamma_over3;
+/* subtract coef times src to dst */
+static void image_sub_scaled(image_t *dst, const image_t *src, const float coef){
+    int i;
+    for(i=0 ; i<dst->stride*dst->height ; i++)
+        dst->data[i] -= coef*src->data[i];
+}
 
 
-/* perform flow computation at one level of the pyramid */
-void compute_one_level(image_t *wx, image_t *wy, color_image_t *im1, color_image_t *im2, const variational_params_t *params){ 
-    const int width = wx->width, height = wx->height, stride=wx->stride;
 
-    image_t *du = image_new(width,height), *dv = image_new(width,height), // the flow increment
-        *mask = image_new(width,height), // mask containing 0 if a point goes outside image boundary, 1 otherwise
-        *smooth_horiz = image_new(width,height), *smooth_vert = image_new(width,height), // horiz: (i,j) contains the diffusivity coeff from (i,j) to (i+1,j) 
-        *uu = image_new(width,height), *vv = image_new(width,height), // flow plus flow increment
-        *a11 = image_new(width,height), *a12 = image_new(width,height), *a22 = image_new(width,height), // system matrix A of Ax=b for each pixel
-        *b1 = image_new(width,height), *b2 = image_new(width,height); // system matrix b of Ax=b for each pixel
+/* perform flow computation at one level of the pyramid, ws being allocated for the size of this level */
+static void compute_one_level(variational_ctx_t *ctx, variational_workspace_t *ws, image_t *wx, image_t *wy, color_image_t *im1, color_image_t *im2, const variational_schedule_t *schedule, const variational_params_t *params){ 
 
-    color_image_t *w_im2 = color_image_new(width,height), // warped second image
-        *Ix = color_image_new(width,height), *Iy = color_image_new(width,height), *Iz = color_image_new(width,height), // first order derivatives
-        *Ixx = color_image_new(width,height), *Ixy = color_image_new(width,height), *Iyy = color_image_new(width,height), *Ixz = color_image_new(width,height), *Iyz = color_image_new(width,height); // second order derivatives
+    image_t *du = ws->du, *dv = ws->dv, *mask = ws->mask,
+        *smooth_horiz = ws->smooth_horiz, *smooth_vert = ws->smooth_vert,
+        *uu = ws->uu, *vv = ws->vv,
+        *a11 = ws->a11, *a12 = ws->a12, *a22 = ws->a22,
+        *b1 = ws->b1, *b2 = ws->b2,
+        *dpsis_weight = ws->dpsis_weight;
+    color_image_t *w_im2 = ws->w_im2,
+        *Ix = ws->Ix, *Iy = ws->Iy, *Iz = ws->Iz,
+        *Ixx = ws->Ixx, *Ixy = ws->Ixy, *Iyy = ws->Iyy, *Ixz = ws->Ixz, *Iyz = ws->Iyz;
   
+    compute_dpsis_weight(dpsis_weight, im1, 5.0f, ctx->deriv, ws->tmp[0], ws->tmp[1]);  
   
-    image_t *dpsis_weight = compute_dpsis_weight(im1, 5.0f, deriv);  
-  
+    ctx->stats.niter_solver_max += schedule->niter_outer*schedule->niter_inner*schedule->niter_solver;
+    const float increment_max = params->outer_tol*params->outer_tol*wx->width*wx->height;
     int i_outer_iteration;
-    for(i_outer_iteration = 0 ; i_outer_iteration < params->niter_outer ; i_outer_iteration++){
+    for(i_outer_iteration = 0 ; i_outer_iteration < schedule->niter_outer ; i_outer_iteration++){
+        float increment = 0.0f;
         int i_inner_iteration;
         // warp second image
         image_warp(w_im2, mask, im2, wx, wy);
         // compute derivatives
-        get_derivatives(im1, w_im2, deriv, Ix, Iy, Iz, Ixx, Ixy, Iyy, Ixz, Iyz);
+        get_derivatives(im1, w_im2, ctx->deriv, Ix, Iy, Iz, Ixx, Ixy, Iyy, Ixz, Iyz, ws->mean_im);
         // erase du and dv
         image_erase(du);
         image_erase(dv);
@@ -47,38 +50,93 @@ void compute_one_level(image_t *wx, image_t *wy, color_image_t *im1, color_image
         memcpy(uu->data,wx->data,wx->stride*wx->height*sizeof(float));
         memcpy(vv->data,wy->data,wy->stride*wy->height*sizeof(float));
         // inner fixed point iterations
-        for(i_inner_iteration = 0 ; i_inner_iteration < params->niter_inner ; i_inner_iteration++){
+        for(i_inner_iteration = 0 ; i_inner_iteration < schedule->niter_inner ; i_inner_iteration++){
             //  compute robust function and system
-            compute_smoothness(smooth_horiz, smooth_vert, uu, vv, dpsis_weight, deriv_flow, half_alpha );
-            compute_data_and_match(a11, a12, a22, b1, b2, mask, du, dv, Ix, Iy, Iz, Ixx, Ixy, Iyy, Ixz, Iyz, half_delta_over3, half_gamma_over3);
+            compute_smoothness(smooth_horiz, smooth_vert, uu, vv, dpsis_weight, ctx->deriv_flow, ctx->half_alpha, ws->tmp[0], ws->tmp[1], ws->tmp[2], ws->tmp[3]);
+            compute_data_and_match(a11, a12, a22, b1, b2, mask, du, dv, Ix, Iy, Iz, Ixx, Ixy, Iyy, Ixz, Iyz, ctx->half_delta_over3, ctx->half_gamma_over3);
             sub_laplacian(b1, wx, smooth_horiz, smooth_vert);
             sub_laplacian(b2, wy, smooth_horiz, smooth_vert);
             // solve system
-            sor_coupled(du, dv, a11, a12, a22, b1, b2, smooth_horiz, smooth_vert, params->niter_solver, params->sor_omega);          
+            if(params->sor_redblack)
+                ctx->stats.niter_solver += sor_coupled_redblack(du, dv, a11, a12, a22, b1, b2, smooth_horiz, smooth_vert, schedule->niter_solver, params->sor_omega, params->solver_tol);
+            else
+                ctx->stats.niter_solver += sor_coupled(du, dv, a11, a12, a22, b1, b2, smooth_horiz, smooth_vert, schedule->niter_solver, params->sor_omega, params->solver_tol);
             // update flow plus flow increment
-            int i;
-            v4sf *uup = (v4sf*) uu->data, *vvp = (v4sf*) vv->data, *wxp = (v4sf*) wx->data, *wyp = (v4sf*) wy->data, *dup = (v4sf*) du->data, *dvp = (v4sf*) dv->data;
-            for( i=0 ; i<height*stride/4 ; i++){
-                (*uup) = (*wxp) + (*dup);
-                (*vvp) = (*wyp) + (*dvp);
-                uup+=1; vvp+=1; wxp+=1; wyp+=1;dup+=1;dvp+=1;
-	        }
+            increment = add_flow_increment(uu, vv, wx, wy, du, dv);
         }
         // add flow increment to current flow
         memcpy(wx->data,uu->data,uu->stride*uu->height*sizeof(float));
         memcpy(wy->data,vv->data,vv->stride*vv->height*sizeof(float));
+        ctx->stats.niter_outer++;
+        // the flow barely moves anymore, the next iterations would not change it either
+        if(params->outer_tol > 0.0f && increment < increment_max)
+            break;
     }   
-    // free memory
-    //image_delete(du); image_delete(dv);
-    //image_delete(mask);
-    //image_delete(smooth_horiz); image_delete(smooth_vert);
-    //image_delete(uu); image_delete(vv);
-    //image_delete(a11); image_delete(a12); image_delete(a22);
-    //image_delete(b1); image_delete(b2);
-    //image_delete(dpsis_weight);
-    //color_image_delete(w_im2); 
-    //color_image_delete(Ix); color_image_delete(Iy); color_image_delete(Iz);
-    //color_image_delete(Ixx); color_image_delete(Ixy); color_image_delete(Iyy); color_image_delete(Ixz); color_image_delete(Iyz);
+}
+
+/* free the images of a workspace, leaving it empty */
+static void variational_workspace_release(variational_workspace_t *ws){
+    int i;
+    image_delete(ws->du); image_delete(ws->dv);
+    image_delete(ws->mask);
+    image_delete(ws->smooth_horiz); image_delete(ws->smooth_vert);
+    image_delete(ws->uu); image_delete(ws->vv);
+    image_delete(ws->a11); image_delete(ws->a12); image_delete(ws->a22);
+    image_delete(ws->b1); image_delete(ws->b2);
+    image_delete(ws->dpsis_weight);
+    for(i=0 ; i<4 ; i++)
+        image_delete(ws->tmp[i]);
+    color_image_delete(ws->smooth_im1); color_image_delete(ws->smooth_im2);
+    color_image_delete(ws->w_im2);
+    color_image_delete(ws->Ix); color_image_delete(ws->Iy); color_image_delete(ws->Iz);
+    color_image_delete(ws->Ixx); color_image_delete(ws->Ixy); color_image_delete(ws->Iyy); color_image_delete(ws->Ixz); color_image_delete(ws->Iyz);
+    color_image_delete(ws->mean_im);
+    image_delete(ws->wx); image_delete(ws->wy);
+    memset(ws, 0, sizeof(variational_workspace_t));
+}
+
+/* allocate an empty workspace, its images are allocated on first use */
+variational_workspace_t *variational_workspace_new(void){
+    variational_workspace_t *ws = (variational_workspace_t*) calloc(1, sizeof(variational_workspace_t));
+    if(!ws){
+        fprintf(stderr,"error: not enough memory\n");
+        exit(1);
+    }
+    return ws;
+}
+
+/* (re)allocate the images of a workspace if its size differs from width x height */
+void variational_workspace_resize(variational_workspace_t *ws, const int width, const int height){
+    if(ws->width == width && ws->height == height)
+        return;
+    variational_workspace_release(ws);
+    int i;
+    ws->width = width;
+    ws->height = height;
+    ws->du = image_new(width,height); ws->dv = image_new(width,height);
+    ws->mask = image_new(width,height);
+    ws->smooth_horiz = image_new(width,height); ws->smooth_vert = image_new(width,height);
+    ws->uu = image_new(width,height); ws->vv = image_new(width,height);
+    ws->a11 = image_new(width,height); ws->a12 = image_new(width,height); ws->a22 = image_new(width,height);
+    ws->b1 = image_new(width,height); ws->b2 = image_new(width,height);
+    ws->dpsis_weight = image_new(width,height);
+    for(i=0 ; i<4 ; i++)
+        ws->tmp[i] = image_new(width,height);
+    ws->smooth_im1 = color_image_new(width,height); ws->smooth_im2 = color_image_new(width,height);
+    ws->w_im2 = color_image_new(width,height);
+    ws->Ix = color_image_new(width,height); ws->Iy = color_image_new(width,height); ws->Iz = color_image_new(width,height);
+    ws->Ixx = color_image_new(width,height); ws->Ixy = color_image_new(width,height); ws->Iyy = color_image_new(width,height);
+    ws->Ixz = color_image_new(width,height); ws->Iyz = color_image_new(width,height);
+    ws->mean_im = color_image_new(width,height);
+    ws->wx = image_new(width,height); ws->wy = image_new(width,height);
+}
+
+/* free memory of a workspace and its images */
+void variational_workspace_delete(variational_workspace_t *ws){
+    if(ws){
+        variational_workspace_release(ws);
+        free(ws);
+    }
 }
 
 /* set flow parameters to default */
@@ -95,48 +153,120 @@ void variational_params_default(variational_params_t *params){
     params->niter_inner = 1;  
     params->niter_solver = 30;
     params->sor_omega = 1.9f;
+    params->sor_redblack = 0;
+    params->outer_tol = 0.0f;
+    params->solver_tol = 0.0f;
+    // when enabled, the pyramid makes most iterations at the coarse levels
+    params->nlevels = 1;
+    params->levels[0].niter_outer = 3; params->levels[0].niter_inner = 1; params->levels[0].niter_solver = 15;
+    params->levels[1].niter_outer = 3; params->levels[1].niter_inner = 1; params->levels[1].niter_solver = 20;
+    params->levels[2].niter_outer = 5; params->levels[2].niter_inner = 1; params->levels[2].niter_solver = 30;
 }
   
+/* allocate a context with its kernels and empty workspaces */
+variational_ctx_t *variational_ctx_new(void){
+    variational_ctx_t *ctx = (variational_ctx_t*) calloc(1, sizeof(variational_ctx_t));
+    if(!ctx){
+        fprintf(stderr,"error: not enough memory\n");
+        exit(1);
+    }
+    const float deriv_filter[3] = {0.0f, -8.0f/12.0f, 1.0f/12.0f};
+    ctx->deriv = convolution_new(2, deriv_filter, 0);
+    const float deriv_filter_flow[2] = {0.0f, -0.5f};
+    ctx->deriv_flow = convolution_new(1, deriv_filter_flow, 0);
+    int i;
+    for(i=0 ; i<VARIATIONAL_MAX_LEVELS ; i++)
+        ctx->ws[i] = variational_workspace_new();
+    return ctx;
+}
+
+/* free memory of a context */
+void variational_ctx_delete(variational_ctx_t *ctx){
+    if(ctx){
+        int i;
+        convolution_delete(ctx->deriv);
+        convolution_delete(ctx->deriv_flow);
+        for(i=0 ; i<VARIATIONAL_MAX_LEVELS ; i++)
+            variational_workspace_delete(ctx->ws[i]);
+        free(ctx);
+    }
+}
+
 /* Compute a refinement of the optical flow (wx and wy are modified) between im1 and im2 */
 void variational(image_t *wx, image_t *wy, const color_image_t *im1, const color_image_t *im2, variational_params_t *params){
+    variational_ctx_t *ctx = variational_ctx_new();
+    variational_ctx(ctx, wx, wy, im1, im2, params);
+    variational_ctx_delete(ctx);
+}
+
+/* same as variational() but with the state kept in ctx, whose workspaces are resized to the size of im1 and its pyramid if needed */
+void variational_ctx(variational_ctx_t *ctx, image_t *wx, image_t *wy, const color_image_t *im1, const color_image_t *im2, const variational_params_t *params){
   
     // Check parameters
+    variational_params_t default_params;
     if(!params){
-        params = (variational_params_t*) malloc(sizeof(variational_params_t));
-        if(!params){
-          fprintf(stderr,"error: not enough memory\n");
-          exit(1);
-        }
-        variational_params_default(params);
+        variational_params_default(&default_params);
+        params = &default_params;
     }
 
-    // initialize global variables
-    half_alpha = 0.5f*params->alpha;
-    half_gamma_over3 = params->gamma*0.5f/3.0f;
-    half_delta_over3 = params->delta*0.5f/3.0f;
-    
-    float deriv_filter[3] = {0.0f, -8.0f/12.0f, 1.0f/12.0f};
-    deriv = convolution_new(2, deriv_filter, 0);
-    float deriv_filter_flow[2] = {0.0f, -0.5f};
-    deriv_flow = convolution_new(1, deriv_filter_flow, 0);
+    // weights of the energy terms
+    ctx->half_alpha = 0.5f*params->alpha;
+    ctx->half_gamma_over3 = params->gamma*0.5f/3.0f;
+    ctx->half_delta_over3 = params->delta*0.5f/3.0f;
 
+    memset(&ctx->stats, 0, sizeof(variational_stats_t));
+    variational_workspace_resize(ctx->ws[0], im1->width, im1->height);
 
     // presmooth images
-    int width = im1->width, height = im1->height, filter_size;
-    color_image_t *smooth_im1 = color_image_new(width, height), *smooth_im2 = color_image_new(width, height);
+    int filter_size;
+    color_image_t *smooth_im1 = ctx->ws[0]->smooth_im1, *smooth_im2 = ctx->ws[0]->smooth_im2;
     float *presmooth_filter = gaussian_filter(params->sigma, &filter_size);
     convolution_t *presmoothing = convolution_new(filter_size, presmooth_filter, 1);
     color_image_convolve_hv(smooth_im1, im1, presmoothing, presmoothing);
     color_image_convolve_hv(smooth_im2, im2, presmoothing, presmoothing); 
     convolution_delete(presmoothing);
     free(presmooth_filter);
-    
-    compute_one_level(wx, wy, smooth_im1, smooth_im2, params);
-  
-    // free memory
-    color_image_delete(smooth_im1);
-    color_image_delete(smooth_im2);
-    convolution_delete(deriv);
-    convolution_delete(deriv_flow);
-}
 
+    if(params->nlevels <= 1){
+        variational_schedule_t schedule;
+        schedule.niter_outer = params->niter_outer;
+        schedule.niter_inner = params->niter_inner;
+        schedule.niter_solver = params->niter_solver;
+        compute_one_level(ctx, ctx->ws[0], wx, wy, smooth_im1, smooth_im2, &schedule, params);
+        return;
+    }
+
+    // downscale the images and the flow, stopping before a level gets too small to be refined
+    int nlevels = (params->nlevels < VARIATIONAL_MAX_LEVELS) ? params->nlevels : VARIATIONAL_MAX_LEVELS;
+    int level;
+    for(level=1 ; level<nlevels ; level++){
+        const variational_workspace_t *finer = ctx->ws[level-1];
+        const int width = (finer->width+1)/2, height = (finer->height+1)/2;
+        if(width < VARIATIONAL_MIN_LEVEL_SIZE || height < VARIATIONAL_MIN_LEVEL_SIZE)
+            break;
+        variational_workspace_t *ws = ctx->ws[level];
+        variational_workspace_resize(ws, width, height);
+        color_image_downscale_half(ws->smooth_im1, finer->smooth_im1);
+        color_image_downscale_half(ws->smooth_im2, finer->smooth_im2);
+        image_downscale_half(ws->wx, (level==1) ? wx : finer->wx);
+        image_downscale_half(ws->wy, (level==1) ? wy : finer->wy);
+        image_mul_scalar(ws->wx, 0.5f);
+        image_mul_scalar(ws->wy, 0.5f);
+    }
+    nlevels = level;
+
+    // refine from coarse to fine, each level adding its upscaled correction to the finer flow
+    for(level=nlevels-1 ; level>0 ; level--){
+        variational_workspace_t *ws = ctx->ws[level];
+        image_t *finer_wx = (level==1) ? wx : ctx->ws[level-1]->wx, *finer_wy = (level==1) ? wy : ctx->ws[level-1]->wy;
+        compute_one_level(ctx, ws, ws->wx, ws->wy, ws->smooth_im1, ws->smooth_im2, &params->levels[level], params);
+        // the correction is the refined flow minus the downscaled finer flow, which is not modified yet
+        image_downscale_half(ws->tmp[0], finer_wx);
+        image_downscale_half(ws->tmp[1], finer_wy);
+        image_sub_scaled(ws->wx, ws->tmp[0], 0.5f);
+        image_sub_scaled(ws->wy, ws->tmp[1], 0.5f);
+        image_add_upsampled(finer_wx, ws->wx, 2.0f);
+        image_add_upsampled(finer_wy, ws->wy, 2.0f);
+    }
+    compute_one_level(ctx, ctx->ws[0], wx, wy, smooth_im1, smooth_im2, &params->levels[0], params);
+}
@@ -12,6 +12,15 @@ extern "C" {
 #include "image.h"
 #include "array_types.h"
 
+#define VARIATIONAL_MAX_LEVELS 3 // maximum number of levels of the refinement pyramid
+
+/* iterations run at one level of the refinement pyramid */
+typedef struct variational_schedule_s {
+  int niter_outer;         // number of outer fixed point iterations
+  int niter_inner;         // number of inner fixed point iterations
+  int niter_solver;        // number of solver iterations
+} variational_schedule_t;
+
 typedef struct variational_params_s {
   float alpha;             // smoothness weight
   float gamma;             // gradient constancy assumption weight
@@ -21,14 +30,75 @@ typedef struct variational_params_s {
   int niter_inner;         // number of inner fixed point iterations
   int niter_solver;        // number of solver iterations 
   float sor_omega;         // omega parameter of sor method
+  int sor_redblack;        // use the parallel red-black sor instead of the lexicographic one
+  int nlevels;             // number of pyramid levels, 1 refines at full resolution only with niter_outer/inner/solver
+  variational_schedule_t levels[VARIATIONAL_MAX_LEVELS]; // iterations of each level if nlevels>1, levels[0] is the full resolution
+  float outer_tol;         // end the outer iterations of a level once the rms of the flow increment is below, 0 runs all of them
+  float solver_tol;        // end the solver once the rms change of a sweep is below, 0 runs all of them
 } variational_params_t;
 
+/* iterations done by the last refinement of a context */
+typedef struct variational_stats_s {
+  int niter_outer;         // outer fixed point iterations, summed over the levels
+  int niter_solver;        // solver iterations, summed over the levels and the fixed point iterations
+  int niter_solver_max;    // solver iterations the schedule allows
+} variational_stats_t;
+
+/* scratch images of the refinement, allocated for one resolution and reused across calls */
+typedef struct variational_workspace_s {
+  int width;               // size the images are allocated for, 0 if none
+  int height;
+  image_t *du, *dv;        // the flow increment
+  image_t *mask;           // 0 if a point goes outside image boundary, 1 otherwise
+  image_t *smooth_horiz, *smooth_vert; // diffusivity coefficients to the right and bottom neighbours
+  image_t *uu, *vv;        // flow plus flow increment
+  image_t *a11, *a12, *a22, *b1, *b2; // system Ax=b for each pixel
+  image_t *dpsis_weight;   // local smoothness weight
+  image_t *tmp[4];         // scratch of compute_smoothness and compute_dpsis_weight
+  color_image_t *smooth_im1, *smooth_im2; // presmoothed images
+  color_image_t *w_im2;    // warped second image
+  color_image_t *Ix, *Iy, *Iz; // first order derivatives
+  color_image_t *Ixx, *Ixy, *Iyy, *Ixz, *Iyz; // second order derivatives
+  color_image_t *mean_im;  // mean of the first and the warped second image
+  image_t *wx, *wy;        // flow downscaled to this level, unused at full resolution
+} variational_workspace_t;
+
+/* state of one refinement: convolution kernels, weights derived from the parameters and scratch images.
+   A context is used by one thread at a time, concurrent refinements each use their own context */
+typedef struct variational_ctx_s {
+  convolution_t *deriv;    // 5-point derivative filter of the images
+  convolution_t *deriv_flow; // central derivative filter of the flow
+  float half_alpha;        // 0.5*alpha
+  float half_delta_over3;  // 0.5*delta/3, per channel color constancy weight
+  float half_gamma_over3;  // 0.5*gamma/3, per channel gradient constancy weight
+  variational_workspace_t *ws[VARIATIONAL_MAX_LEVELS]; // scratch images of each pyramid level, ws[0] at full resolution
+  variational_stats_t stats; // iterations done by the last call of variational_ctx
+} variational_ctx_t;
+
 /* set flow parameters to default */
 void variational_params_default(variational_params_t *params);
 
+/* allocate an empty workspace, its images are allocated on first use */
+variational_workspace_t *variational_workspace_new(void);
+
+/* (re)allocate the images of a workspace if its size differs from width x height */
+void variational_workspace_resize(variational_workspace_t *ws, const int width, const int height);
+
+/* free memory of a workspace and its images */
+void variational_workspace_delete(variational_workspace_t *ws);
+
 /* Compute a refinement of the optical flow (wx and wy are modified) between im1 and im2 */
 void variational(image_t *wx, image_t *wy, const color_image_t *im1, const color_image_t *im2, variational_params_t *params);
 
+/* allocate a context with its kernels and an empty workspace */
+variational_ctx_t *variational_ctx_new(void);
+
+/* free memory of a context */
+void variational_ctx_delete(variational_ctx_t *ctx);
+
+/* same as variational() but with the state kept in ctx, whose workspaces are resized to the size of im1 and its pyramid if needed */
+void variational_ctx(variational_ctx_t *ctx, image_t *wx, image_t *wy, const color_image_t *im1, const color_image_t *im2, const variational_params_t *params);
+
 #endif
 
 #ifdef __cplusplus
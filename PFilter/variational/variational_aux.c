@@ -3,9 +3,7 @@
 #include <malloc.h>
 #include <string.h>
 #include "variational_aux.h"
-
-#include <xmmintrin.h>
-typedef __v4sf v4sf;
+#include "simd.h"
 
 #define datanorm 0.1f*0.1f//0.01f // square of the normalization factor
 #define epsilon_color (0.001f*0.001f)//0.000001f
@@ -14,49 +12,312 @@ typedef __v4sf v4sf;
 
 #define RECTIFY(a,b) (((a)<0) ? (0) : ( ((a)<(b)-1) ? (a) : ((b)-1) ) )
 
+/* smoothness weight between two pixels from the forward difference of the flow (d1u, d1v) and the central derivatives
+   of the flow in the other direction at both pixels */
+static inline float smoothness_weight(const float d1u, const float d1v, const float u2a, const float u2b, const float v2a, const float v2b, const float wa, const float wb, const float half_alpha){
+    float tmp = 0.5f*(u2a+u2b);
+    const float usq = d1u*d1u + tmp*tmp;
+    tmp = 0.5f*(v2a+v2b);
+    const float vsq = d1v*d1v + tmp*tmp;
+    return (wa+wb)*half_alpha / sqrtf( usq + vsq + epsilon_smooth );
+}
+
+/* horizontal part of sub_laplacian for the pixel i of a line */
+static inline void sub_laplacian_horiz_pixel(float *dst, const float *src, const float *weight_horiz, const int i, const int width){
+    if(i>0)
+        dst[i] -= weight_horiz[i-1]*(src[i]-src[i-1]);
+    if(i<width-1)
+        dst[i] += weight_horiz[i]*(src[i+1]-src[i]);
+}
+
+/* vector kernels, one instance per instruction set */
+#define VSF v4sf
+#define VSF_U v4sf_u
+#define VSF_N 4
+#define VSF_SQRT(x) __builtin_ia32_sqrtps(x)
+#define SIMD_FN(name) name##_sse
+#include "variational_aux_simd.h"
+#undef VSF
+#undef VSF_U
+#undef VSF_N
+#undef VSF_SQRT
+#undef SIMD_FN
+
+#ifdef SIMD_DISPATCH
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define VSF v8sf
+#define VSF_U v8sf_u
+#define VSF_N 8
+#define VSF_SQRT(x) ((v8sf) _mm256_sqrt_ps(x))
+#define SIMD_FN(name) name##_avx2
+#include "variational_aux_simd.h"
+#undef VSF
+#undef VSF_U
+#undef VSF_N
+#undef VSF_SQRT
+#undef SIMD_FN
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define VSF v16sf
+#define VSF_U v16sf_u
+#define VSF_N 16
+#define VSF_SQRT(x) ((v16sf) _mm512_sqrt_ps(x))
+#define SIMD_FN(name) name##_avx512
+#include "variational_aux_simd.h"
+#undef VSF
+#undef VSF_U
+#undef VSF_N
+#undef VSF_SQRT
+#undef SIMD_FN
+#pragma GCC pop_options
+#endif
+
+/* warp the pixel i of line j, offset being its position in the images */
+static inline void image_warp_pixel(color_image_t *dst, image_t *mask, const color_image_t *src, const image_t *wx, const image_t *wy, const int i, const int j, const int offset){
+    const float xx = i+wx->data[offset];
+    const float yy = j+wy->data[offset];
+    const int x = floor(xx);
+    const int y = floor(yy);
+    const float dx = xx-x;
+    const float dy = yy-y;
+    mask->data[offset] = (xx>=0 && xx<=src->width-1 && yy>=0 && yy<=src->height-1);
+    const int x1 = RECTIFY(x, src->width);
+    const int x2 = RECTIFY(x+1, src->width);
+    const int y1 = RECTIFY(y, src->height);
+    const int y2 = RECTIFY(y+1, src->height);
+    const int o11 = y1*src->stride+x1, o12 = y1*src->stride+x2, o21 = y2*src->stride+x1, o22 = y2*src->stride+x2;
+    const float w11 = (1.0f-dx)*(1.0f-dy), w12 = dx*(1.0f-dy), w21 = (1.0f-dx)*dy, w22 = dx*dy;
+    dst->c1[offset] = src->c1[o11]*w11 + src->c1[o12]*w12 + src->c1[o21]*w21 + src->c1[o22]*w22;
+    dst->c2[offset] = src->c2[o11]*w11 + src->c2[o12]*w12 + src->c2[o21]*w21 + src->c2[o22]*w22;
+    dst->c3[offset] = src->c3[o11]*w11 + src->c3[o12]*w12 + src->c3[o21]*w21 + src->c3[o22]*w22;
+}
+
+#ifdef SIMD_DISPATCH
+/* warp the pixels of line j by blocks of 8 with gathers, return the first pixel not processed */
+__attribute__((target("avx2,fma")))
+static int image_warp_row_avx2(color_image_t *dst, image_t *mask, const color_image_t *src, const image_t *wx, const image_t *wy, const int j){
+    const int o = j*src->stride;
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    const __m256 wmax = _mm256_set1_ps(src->width-1), hmax = _mm256_set1_ps(src->height-1);
+    const __m256 yj = _mm256_set1_ps(j), iota = _mm256_setr_ps(0,1,2,3,4,5,6,7);
+    const __m256i stride = _mm256_set1_epi32(src->stride);
+    int i;
+    for(i=0 ; i+8<=src->width ; i+=8){
+        const __m256 xx = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(i), iota), _mm256_load_ps(wx->data+o+i));
+        const __m256 yy = _mm256_add_ps(yj, _mm256_load_ps(wy->data+o+i));
+        const __m256 xf = _mm256_floor_ps(xx), yf = _mm256_floor_ps(yy);
+        const __m256 dx = _mm256_sub_ps(xx, xf), dy = _mm256_sub_ps(yy, yf);
+        const __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(xx, zero, _CMP_GE_OQ), _mm256_cmp_ps(xx, wmax, _CMP_LE_OQ)),
+                                            _mm256_and_ps(_mm256_cmp_ps(yy, zero, _CMP_GE_OQ), _mm256_cmp_ps(yy, hmax, _CMP_LE_OQ)));
+        _mm256_store_ps(mask->data+o+i, _mm256_and_ps(inside, one));
+        // clamping in float first keeps the conversions in range for any flow
+        const __m256i x1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(xf, zero), wmax));
+        const __m256i x2 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_add_ps(xf, one), zero), wmax));
+        const __m256i y1 = _mm256_mullo_epi32(_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(yf, zero), hmax)), stride);
+        const __m256i y2 = _mm256_mullo_epi32(_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_add_ps(yf, one), zero), hmax)), stride);
+        const __m256i o11 = _mm256_add_epi32(y1, x1), o12 = _mm256_add_epi32(y1, x2), o21 = _mm256_add_epi32(y2, x1), o22 = _mm256_add_epi32(y2, x2);
+        const __m256 ndx = _mm256_sub_ps(one, dx), ndy = _mm256_sub_ps(one, dy);
+        const __m256 w11 = _mm256_mul_ps(ndx, ndy), w12 = _mm256_mul_ps(dx, ndy), w21 = _mm256_mul_ps(ndx, dy), w22 = _mm256_mul_ps(dx, dy);
+        const float *planes[3] = {src->c1, src->c2, src->c3};
+        float *dplanes[3] = {dst->c1, dst->c2, dst->c3};
+        int c;
+        for(c=0 ; c<3 ; c++){
+            __m256 v = _mm256_mul_ps(_mm256_i32gather_ps(planes[c], o11, 4), w11);
+            v = _mm256_fmadd_ps(_mm256_i32gather_ps(planes[c], o12, 4), w12, v);
+            v = _mm256_fmadd_ps(_mm256_i32gather_ps(planes[c], o21, 4), w21, v);
+            v = _mm256_fmadd_ps(_mm256_i32gather_ps(planes[c], o22, 4), w22, v);
+            _mm256_store_ps(dplanes[c]+o+i, v);
+        }
+    }
+    return i;
+}
+
+/* same as image_warp_row_avx2 by blocks of 16 */
+__attribute__((target("avx512f")))
+static int image_warp_row_avx512(color_image_t *dst, image_t *mask, const color_image_t *src, const image_t *wx, const image_t *wy, const int j){
+    const int o = j*src->stride;
+    const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f);
+    const __m512 wmax = _mm512_set1_ps(src->width-1), hmax = _mm512_set1_ps(src->height-1);
+    const __m512 yj = _mm512_set1_ps(j), iota = _mm512_setr_ps(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    const __m512i stride = _mm512_set1_epi32(src->stride);
+    int i;
+    for(i=0 ; i+16<=src->width ; i+=16){
+        const __m512 xx = _mm512_add_ps(_mm512_add_ps(_mm512_set1_ps(i), iota), _mm512_load_ps(wx->data+o+i));
+        const __m512 yy = _mm512_add_ps(yj, _mm512_load_ps(wy->data+o+i));
+        const __m512 xf = _mm512_roundscale_ps(xx, _MM_FROUND_TO_NEG_INF), yf = _mm512_roundscale_ps(yy, _MM_FROUND_TO_NEG_INF);
+        const __m512 dx = _mm512_sub_ps(xx, xf), dy = _mm512_sub_ps(yy, yf);
+        const __mmask16 inside = _mm512_cmp_ps_mask(xx, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(xx, wmax, _CMP_LE_OQ)
+                               & _mm512_cmp_ps_mask(yy, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(yy, hmax, _CMP_LE_OQ);
+        _mm512_store_ps(mask->data+o+i, _mm512_maskz_mov_ps(inside, one));
+        // clamping in float first keeps the conversions in range for any flow
+        const __m512i x1 = _mm512_cvttps_epi32(_mm512_min_ps(_mm512_max_ps(xf, zero), wmax));
+        const __m512i x2 = _mm512_cvttps_epi32(_mm512_min_ps(_mm512_max_ps(_mm512_add_ps(xf, one), zero), wmax));
+        const __m512i y1 = _mm512_mullo_epi32(_mm512_cvttps_epi32(_mm512_min_ps(_mm512_max_ps(yf, zero), hmax)), stride);
+        const __m512i y2 = _mm512_mullo_epi32(_mm512_cvttps_epi32(_mm512_min_ps(_mm512_max_ps(_mm512_add_ps(yf, one), zero), hmax)), stride);
+        const __m512i o11 = _mm512_add_epi32(y1, x1), o12 = _mm512_add_epi32(y1, x2), o21 = _mm512_add_epi32(y2, x1), o22 = _mm512_add_epi32(y2, x2);
+        const __m512 ndx = _mm512_sub_ps(one, dx), ndy = _mm512_sub_ps(one, dy);
+        const __m512 w11 = _mm512_mul_ps(ndx, ndy), w12 = _mm512_mul_ps(dx, ndy), w21 = _mm512_mul_ps(ndx, dy), w22 = _mm512_mul_ps(dx, dy);
+        const float *planes[3] = {src->c1, src->c2, src->c3};
+        float *dplanes[3] = {dst->c1, dst->c2, dst->c3};
+        int c;
+        for(c=0 ; c<3 ; c++){
+            __m512 v = _mm512_mul_ps(_mm512_i32gather_ps(o11, planes[c], 4), w11);
+            v = _mm512_fmadd_ps(_mm512_i32gather_ps(o12, planes[c], 4), w12, v);
+            v = _mm512_fmadd_ps(_mm512_i32gather_ps(o21, planes[c], 4), w21, v);
+            v = _mm512_fmadd_ps(_mm512_i32gather_ps(o22, planes[c], 4), w22, v);
+            _mm512_store_ps(dplanes[c]+o+i, v);
+        }
+    }
+    return i;
+}
+#endif
+
+typedef int (*image_warp_row_fn)(color_image_t *dst, image_t *mask, const color_image_t *src, const image_t *wx, const image_t *wy, const int j);
+
 /* warp a color image according to a flow. src is the input image, wx and wy, the input flow. dst is the warped image and mask contains 0 or 1 if the pixels goes outside/inside image boundaries */
+/* the three planes and the mask are written in one pass, lines are split between threads */
 void image_warp(color_image_t *dst, image_t *mask, const color_image_t *src, const image_t *wx, const image_t *wy) {
-    int i, j, offset, x, y, x1, x2, y1, y2;
-    float xx, yy, dx, dy;
+    image_warp_row_fn row_fn = NULL;
+#ifdef SIMD_DISPATCH
+    switch(simd_width()){
+    case 16: row_fn = image_warp_row_avx512; break;
+    case 8: row_fn = image_warp_row_avx2; break;
+    }
+#endif
+    int j;
+#pragma omp parallel for schedule(static)
     for(j=0 ; j<src->height ; j++){
-        offset = j*src->stride;
-        for(i=0 ; i<src->width ; i++,offset++){
-	        xx = i+wx->data[offset];
-	        yy = j+wy->data[offset];
-	        x = floor(xx);
-	        y = floor(yy);
-	        dx = xx-x;
-	        dy = yy-y;
-	        mask->data[offset] = (xx>=0 && xx<=src->width-1 && yy>=0 && yy<=src->height-1);
-	        x1 = RECTIFY(x, src->width);
-	        x2 = RECTIFY(x+1, src->width);
-	        y1 = RECTIFY(y, src->height);
-	        y2 = RECTIFY(y+1, src->height);
-	        dst->c1[offset] = 
-	            src->c1[y1*src->stride+x1]*(1.0f-dx)*(1.0f-dy) +
-	            src->c1[y1*src->stride+x2]*dx*(1.0f-dy) +
-	            src->c1[y2*src->stride+x1]*(1.0f-dx)*dy +
-	            src->c1[y2*src->stride+x2]*dx*dy;
-	        dst->c2[offset] = 
-	            src->c2[y1*src->stride+x1]*(1.0f-dx)*(1.0f-dy) +
-	            src->c2[y1*src->stride+x2]*dx*(1.0f-dy) +
-	            src->c2[y2*src->stride+x1]*(1.0f-dx)*dy +
-	            src->c2[y2*src->stride+x2]*dx*dy;
-	        dst->c3[offset] = 
-	            src->c3[y1*src->stride+x1]*(1.0f-dx)*(1.0f-dy) +
-	            src->c3[y1*src->stride+x2]*dx*(1.0f-dy) +
-	            src->c3[y2*src->stride+x1]*(1.0f-dx)*dy +
-	            src->c3[y2*src->stride+x2]*dx*dy;
-	    }
+        int i = row_fn ? row_fn(dst, mask, src, wx, wy, j) : 0;
+        for( ; i<src->width ; i++)
+            image_warp_pixel(dst, mask, src, wx, wy, i, j, j*src->stride+i);
     }
 }
 
-/* compute image first and second order spatio-temporal derivatives of a color image */
+/* line kernels of get_derivatives for one instruction set */
+typedef struct derivatives_kernels_s {
+    void (*mean_diff)(float *m, float *d, const float *a, const float *b, const int stride);
+    void (*horiz)(float *dst, const float *ext, const float *c, const int stride);
+    void (*vert)(float *dst, const float *const *rows, const float *c, const int stride);
+} derivatives_kernels_t;
+
+#define DERIV_TILE_LINES 64 // lines of a tile of get_derivatives
+
+/* line r of a first order derivative in a tile of lines j0 to j1-1: the lines of the tile are in plane,
+   the 2 lines above and below the tile are recomputed by each tile in halo */
+static inline float *derivatives_line(float *plane, float *halo, const int r, const int j0, const int j1, const int stride){
+    if(r < j0) return halo+(j0-1-r)*stride;
+    if(r >= j1) return halo+(2+r-j1)*stride;
+    return plane+r*stride;
+}
+
+/* repeat the last pixel of a line on its padding, as convolve_horiz does on its source before the vertical filters read it */
+static inline void derivatives_pad(float *line, const int width, const int stride){
+    int i;
+    for(i=width ; i<stride ; i++)
+        line[i] = line[width-1];
+}
+
+/* horizontal filter of a line, replicating its border pixels as convolve_horiz */
+static inline void derivatives_horiz(const derivatives_kernels_t *k, float *dst, const float *src, float *ext, const float *c, const int width, const int stride){
+    int i;
+    ext[0] = ext[1] = src[0];
+    memcpy(ext+2, src, width*sizeof(float));
+    for(i=width ; i<stride+2 ; i++)
+        ext[2+i] = src[width-1];
+    k->horiz(dst, ext, c, stride);
+}
+
+/* vertical filter at line j of the lines given by line(r), replicating the first and last lines as convolve_vert */
+#define DERIVATIVES_VERT(k, dst, line, c, j, height, stride) do{ \
+        const float *rows_[5]; int l_; \
+        for(l_=0 ; l_<5 ; l_++) rows_[l_] = line(RECTIFY((j)+l_-2, height)); \
+        (k)->vert(dst, rows_, c, stride); \
+    }while(0)
+
+/* derivatives of the lines j0 to j1-1 of one plane. The lines are streamed from top to bottom, the mean of line t,
+   the first order derivatives of line t-2 and the second order ones of line t-4 being computed at step t, so that
+   every line is reused while in cache. scratch holds stride+4 + 8*stride + 12*stride floats */
+static void derivatives_tile(const derivatives_kernels_t *k, const float *c, float *scratch, const float *p1, const float *p2,
+                             float *dx, float *dy, float *dt, float *dxx, float *dxy, float *dyy, float *dxt, float *dyt,
+                             const int width, const int height, const int stride, const int j0, const int j1){
+    float *mean = scratch, *halo_x = mean+8*stride, *halo_y = halo_x+4*stride, *halo_t = halo_y+4*stride, *ext = halo_t+4*stride;
+    const int mlo = (j0-4>0) ? j0-4 : 0, mhi = (j1+4<height) ? j1+4 : height;
+    const int lo = (j0-2>0) ? j0-2 : 0, hi = (j1+2<height) ? j1+2 : height;
+    int t;
+#define MEAN_LINE(r) (mean+((r)&7)*stride)
+#define DX_LINE(r) derivatives_line(dx, halo_x, r, j0, j1, stride)
+#define DY_LINE(r) derivatives_line(dy, halo_y, r, j0, j1, stride)
+#define DT_LINE(r) derivatives_line(dt, halo_t, r, j0, j1, stride)
+    for(t=mlo ; t<mhi+4 ; t++){
+        const int s = t-2, q = t-4;
+        // mean of the images, and their difference where it is needed
+        if(t < mhi){
+            k->mean_diff(MEAN_LINE(t), (t>=lo && t<hi) ? DT_LINE(t) : NULL, p1+t*stride, p2+t*stride, stride);
+            derivatives_pad(MEAN_LINE(t), width, stride);
+            if(t>=lo && t<hi)
+                derivatives_pad(DT_LINE(t), width, stride);
+        }
+        // first order derivatives of the mean
+        if(s >= lo && s < hi){
+            derivatives_horiz(k, DX_LINE(s), MEAN_LINE(s), ext, c, width, stride);
+            derivatives_pad(DX_LINE(s), width, stride);
+            DERIVATIVES_VERT(k, DY_LINE(s), MEAN_LINE, c, s, height, stride);
+        }
+        // second order derivatives
+        if(q >= j0 && q < j1){
+            derivatives_horiz(k, dxx+q*stride, DX_LINE(q), ext, c, width, stride);
+            derivatives_horiz(k, dxt+q*stride, DT_LINE(q), ext, c, width, stride);
+            DERIVATIVES_VERT(k, dxy+q*stride, DX_LINE, c, q, height, stride);
+            DERIVATIVES_VERT(k, dyy+q*stride, DY_LINE, c, q, height, stride);
+            DERIVATIVES_VERT(k, dyt+q*stride, DT_LINE, c, q, height, stride);
+        }
+    }
+#undef MEAN_LINE
+#undef DX_LINE
+#undef DY_LINE
+#undef DT_LINE
+}
+
+/* compute image first and second order spatio-temporal derivatives of a color image.
+   With a 5 taps deriv, the images are split in tiles of lines of one plane, computed in one pass each and shared between threads.
+   Other filters go through color_image_convolve_hv, tmp_im2 receiving the mean of im1 and im2 */
 void get_derivatives(const color_image_t *im1, const color_image_t *im2, const convolution_t *deriv,
 		     color_image_t *dx, color_image_t *dy, color_image_t *dt, 
-		     color_image_t *dxx, color_image_t *dxy, color_image_t *dyy, color_image_t *dxt, color_image_t *dyt) {
+		     color_image_t *dxx, color_image_t *dxy, color_image_t *dyy, color_image_t *dxt, color_image_t *dyt,
+		     color_image_t *tmp_im2) {
+    if(deriv->order == 2){
+        derivatives_kernels_t k = {mean_diff_line_sse, filter5_horiz_line_sse, filter5_vert_line_sse};
+#ifdef SIMD_DISPATCH
+        switch(simd_width()){
+        case 16: k.mean_diff = mean_diff_line_avx512; k.horiz = filter5_horiz_line_avx512; k.vert = filter5_vert_line_avx512; break;
+        case 8: k.mean_diff = mean_diff_line_avx2; k.horiz = filter5_horiz_line_avx2; k.vert = filter5_vert_line_avx2; break;
+        }
+#endif
+        const int width = im1->width, height = im1->height, stride = im1->stride, plane = stride*height;
+        const int ntiles = (height+DERIV_TILE_LINES-1)/DERIV_TILE_LINES;
+#pragma omp parallel
+        {
+            float *scratch = (float*) memalign(SIMD_ALIGN, (21*stride+SIMD_MAX_WIDTH)*sizeof(float));
+            if(scratch == NULL){
+                fprintf(stderr, "error in get_derivatives(): not enough memory\n");
+                exit(1);
+            }
+            int tile;
+#pragma omp for schedule(dynamic)
+            for(tile=0 ; tile<3*ntiles ; tile++){
+                const int o = (tile/ntiles)*plane, j0 = (tile%ntiles)*DERIV_TILE_LINES;
+                const int j1 = (j0+DERIV_TILE_LINES<height) ? j0+DERIV_TILE_LINES : height;
+                derivatives_tile(&k, deriv->coeffs, scratch, im1->c1+o, im2->c1+o, dx->c1+o, dy->c1+o, dt->c1+o,
+                                 dxx->c1+o, dxy->c1+o, dyy->c1+o, dxt->c1+o, dyt->c1+o, width, height, stride, j0, j1);
+            }
+            free(scratch);
+        }
+        return;
+    }
     // derivatives are computed on the mean of the first image and the warped second image
-    color_image_t *tmp_im2 = color_image_new(im2->width,im2->height);
     v4sf *tmp_im2p = (v4sf*) tmp_im2->c1, *dtp = (v4sf*) dt->c1, *im1p = (v4sf*) im1->c1, *im2p = (v4sf*) im2->c1;
     const v4sf half = {0.5f,0.5f,0.5f,0.5f};
     int i=0;
@@ -73,115 +334,55 @@ void get_derivatives(const color_image_t *im1, const color_image_t *im2, const c
     color_image_convolve_hv(dyy, dy, NULL, deriv);
     color_image_convolve_hv(dxt, dt, deriv, NULL);
     color_image_convolve_hv(dyt, dt, NULL, deriv);
-    // free memory
-    //color_image_delete(tmp_im2);
 }
 
 /* compute the smoothness term */
 /* It is represented as two images, the first one for horizontal smoothness, the second for vertical
    in dst_horiz, the pixel i,j represents the smoothness weight between pixel i,j and i,j+1
-   in dst_vert, the pixel i,j represents the smoothness weight between pixel i,j and i+1,j */
-void compute_smoothness(image_t *dst_horiz, image_t *dst_vert, const image_t *uu, const image_t *vv, const image_t *dpsis_weight, const convolution_t *deriv_flow, const float half_alpha) {
-  int w = uu->width, h = uu->height, s = uu->stride, i, j, offset;
-  image_t *ux1 = image_new(w,h), *uy1 = image_new(w,h), *vx1 = image_new(w,h), *vy1 = image_new(w,h), 
-    *ux2 = image_new(w,h), *uy2 = image_new(w,h), *vx2 = image_new(w,h), *vy2 = image_new(w,h);  
-  // compute ux1, vx1, filter [-1 1]
-  for( j=0 ; j<h ; j++)
-    {
-      offset = j*s;
-      for( i=0 ; i<w-1 ; i++, offset++)
-	{
-	  ux1->data[offset] = uu->data[offset+1] - uu->data[offset];
-	  vx1->data[offset] = vv->data[offset+1] - vv->data[offset];
-	}
-    }
-  // compute uy1, vy1, filter [-1;1]
-  for( j=0 ; j<h-1 ; j++)
-    {
-      offset = j*s;
-      for( i=0 ; i<w ; i++, offset++)
-	{
-	  uy1->data[offset] = uu->data[offset+s] - uu->data[offset];
-	  vy1->data[offset] = vv->data[offset+s] - vv->data[offset];
-	}
-    }
+   in dst_vert, the pixel i,j represents the smoothness weight between pixel i,j and i+1,j
+   ux2, uy2, vx2 and vy2 are scratch images of the size of uu receiving the central derivatives */
+void compute_smoothness(image_t *dst_horiz, image_t *dst_vert, const image_t *uu, const image_t *vv, const image_t *dpsis_weight, const convolution_t *deriv_flow, const float half_alpha,
+			image_t *ux2, image_t *uy2, image_t *vx2, image_t *vy2) {
   // compute ux2, uy2, vx2, vy2, filter [-0.5 0 0.5]
   convolve_horiz(ux2,uu,deriv_flow);
   convolve_horiz(vx2,vv,deriv_flow);
   convolve_vert(uy2,uu,deriv_flow);
   convolve_vert(vy2,vv,deriv_flow);
-  // compute final value, horiz
-  for( j=0 ; j<h ; j++)
-    {
-      offset = j*s;
-      for( i=0 ; i<w-1 ; i++, offset++)
-	{
-	  float tmp = 0.5f*(uy2->data[offset]+uy2->data[offset+1]);
-	  float uxsq = ux1->data[offset]*ux1->data[offset] + tmp*tmp;
-	  tmp = 0.5f*(vy2->data[offset]+vy2->data[offset+1]);
-	  float vxsq = vx1->data[offset]*vx1->data[offset] + tmp*tmp;
-	  tmp = uxsq + vxsq;
-	  dst_horiz->data[offset] = (dpsis_weight->data[offset]+dpsis_weight->data[offset+1])*half_alpha / sqrt( tmp + epsilon_smooth ) ;
-	}
-	memset( &dst_horiz->data[j*s+w-1], 0, sizeof(float)*(s-w+1));
-    }
-  // compute final value, vert
-  for( j=0 ; j<h-1 ; j++)
-    {
-      offset = j*s;
-      for( i=0 ; i<w ; i++, offset++)
-	{
-	  float tmp = 0.5f*(ux2->data[offset]+ux2->data[offset+s]);
-	  float uysq = uy1->data[offset]*uy1->data[offset] + tmp*tmp;
-	  tmp = 0.5f*(vx2->data[offset]+vx2->data[offset+s]);
-	  float vysq = vy1->data[offset]*vy1->data[offset] + tmp*tmp;
-	  tmp = uysq + vysq;
-	  dst_vert->data[offset] = (dpsis_weight->data[offset]+dpsis_weight->data[offset+s])*half_alpha / sqrt( tmp + epsilon_smooth ) ;
-	  /*if( dpsis_weight->data[offset]<dpsis_weight->data[offset+s])
-	    dst_vert->data[offset] = dpsis_weight->data[offset]*half_alpha / sqrt( tmp + epsilon_smooth ) ;
-	  else
-	  dst_vert->data[offset] = dpsis_weight->data[offset+s]*half_alpha / sqrt( tmp + epsilon_smooth ) ;*/
-	}
-    }
-  memset( &dst_vert->data[(h-1)*s], 0, sizeof(float)*s);
-  image_delete(ux1); image_delete(uy1); image_delete(vx1); image_delete(vy1);
-  image_delete(ux2); image_delete(uy2); image_delete(vx2); image_delete(vy2);
+  // compute final value
+  switch(simd_width()){
+#ifdef SIMD_DISPATCH
+  case 16: smoothness_weights_avx512(dst_horiz, dst_vert, uu, vv, dpsis_weight, ux2, uy2, vx2, vy2, half_alpha); break;
+  case 8: smoothness_weights_avx2(dst_horiz, dst_vert, uu, vv, dpsis_weight, ux2, uy2, vx2, vy2, half_alpha); break;
+#endif
+  default: smoothness_weights_sse(dst_horiz, dst_vert, uu, vv, dpsis_weight, ux2, uy2, vx2, vy2, half_alpha);
+  }
 }
 
 
 /* sub the laplacian (smoothness term) to the right-hand term */
 void sub_laplacian(image_t *dst, const image_t *src, const image_t *weight_horiz, const image_t *weight_vert){
-    int j;
-    const int offsetline = src->stride-src->width;
-    float *src_ptr = src->data, *dst_ptr = dst->data, *weight_horiz_ptr = weight_horiz->data;
-    // horizontal filtering
-    for(j=src->height+1;--j;){ // faster than for(j=0;j<src->height;j++)
-        int i;
-        for(i=src->width;--i;){
-	        const float tmp = (*weight_horiz_ptr)*((*(src_ptr+1))-(*src_ptr));
-	        *dst_ptr += tmp;
-	        *(dst_ptr+1) -= tmp;
-	        dst_ptr++;
-	        src_ptr++;
-	        weight_horiz_ptr++;
-	    }
-        dst_ptr += offsetline+1;
-        src_ptr += offsetline+1;
-        weight_horiz_ptr += offsetline+1;
+    switch(simd_width()){
+#ifdef SIMD_DISPATCH
+    case 16: sub_laplacian_avx512(dst, src, weight_horiz, weight_vert); break;
+    case 8: sub_laplacian_avx2(dst, src, weight_horiz, weight_vert); break;
+#endif
+    default: sub_laplacian_sse(dst, src, weight_horiz, weight_vert);
     }
-  
-    v4sf *wvp = (v4sf*) weight_vert->data, *srcp = (v4sf*) src->data, *srcp_s = (v4sf*) (src->data+src->stride), *dstp = (v4sf*) dst->data, *dstp_s = (v4sf*) (dst->data+src->stride);
-    for(j=1+(src->height-1)*src->stride/4 ; --j ;){
-        const v4sf tmp = (*wvp) * ((*srcp_s)-(*srcp));
-        *dstp += tmp;
-        *dstp_s -= tmp;
-        wvp+=1; srcp+=1; srcp_s+=1; dstp+=1; dstp_s+=1;
+}
+
+/* uu = wx+du and vv = wy+dv, return the sum of du^2+dv^2 over the image */
+float add_flow_increment(image_t *uu, image_t *vv, const image_t *wx, const image_t *wy, const image_t *du, const image_t *dv){
+    switch(simd_width()){
+#ifdef SIMD_DISPATCH
+    case 16: return add_flow_increment_avx512(uu, vv, wx, wy, du, dv);
+    case 8: return add_flow_increment_avx2(uu, vv, wx, wy, du, dv);
+#endif
+    default: return add_flow_increment_sse(uu, vv, wx, wy, du, dv);
     }
 }
 
-/* compute local smoothness weight as a sigmoid on image gradient*/
-image_t* compute_dpsis_weight(color_image_t *im, float coef, const convolution_t *deriv) {
-    image_t* lum = image_new(im->width, im->height), *lum_x = image_new(im->width, im->height), *lum_y = image_new(im->width, im->height);
+/* compute local smoothness weight as a sigmoid on image gradient into lum, lum_x and lum_y are scratch images of the same size */
+void compute_dpsis_weight(image_t *lum, color_image_t *im, float coef, const convolution_t *deriv, image_t *lum_x, image_t *lum_y) {
     int i;
     // ocompute luminance
     v4sf *im1p = (v4sf*) im->c1, *im2p = (v4sf*) im->c2, *im3p = (v4sf*) im->c3, *lump = (v4sf*) lum->data;
@@ -203,9 +404,6 @@ image_t* compute_dpsis_weight(color_image_t *im, float coef, const convolution_t
         lump[0][3] = 0.5f*expf(lump[0][3]);
         lump+=1; lumxp+=1; lumyp+=1;
     }
-    image_delete(lum_x);
-    image_delete(lum_y);
-    return lum;
 }
 
 
@@ -213,90 +411,11 @@ image_t* compute_dpsis_weight(color_image_t *im, float coef, const convolution_t
    a11 a12 a22 represents the 2x2 diagonal matrix, b1 and b2 the right hand side
    other (color) images are input */
 void compute_data_and_match(image_t *a11, image_t *a12, image_t *a22, image_t *b1, image_t *b2, image_t *mask, image_t *du, image_t *dv, color_image_t *Ix, color_image_t *Iy, color_image_t *Iz, color_image_t *Ixx, color_image_t *Ixy, color_image_t *Iyy, color_image_t *Ixz, color_image_t *Iyz, const float half_delta_over3, const float half_gamma_over3){
- 
-    const v4sf dnorm = {datanorm, datanorm, datanorm, datanorm};
-    const v4sf hdover3 = {half_delta_over3, half_delta_over3, half_delta_over3, half_delta_over3};
-    const v4sf epscolor = {epsilon_color, epsilon_color, epsilon_color, epsilon_color};
-    const v4sf hgover3 = {half_gamma_over3, half_gamma_over3, half_gamma_over3, half_gamma_over3};
-    const v4sf epsgrad = {epsilon_grad, epsilon_grad, epsilon_grad, epsilon_grad};
-
-    
-    v4sf *dup = (v4sf*) du->data, *dvp = (v4sf*) dv->data,
-        *maskp = (v4sf*) mask->data,
-        *a11p = (v4sf*) a11->data, *a12p = (v4sf*) a12->data, *a22p = (v4sf*) a22->data, 
-        *b1p = (v4sf*) b1->data, *b2p = (v4sf*) b2->data, 
-        *ix1p=(v4sf*)Ix->c1, *iy1p=(v4sf*)Iy->c1, *iz1p=(v4sf*)Iz->c1, *ixx1p=(v4sf*)Ixx->c1, *ixy1p=(v4sf*)Ixy->c1, *iyy1p=(v4sf*)Iyy->c1, *ixz1p=(v4sf*)Ixz->c1, *iyz1p=(v4sf*) Iyz->c1, 
-        *ix2p=(v4sf*)Ix->c2, *iy2p=(v4sf*)Iy->c2, *iz2p=(v4sf*)Iz->c2, *ixx2p=(v4sf*)Ixx->c2, *ixy2p=(v4sf*)Ixy->c2, *iyy2p=(v4sf*)Iyy->c2, *ixz2p=(v4sf*)Ixz->c2, *iyz2p=(v4sf*) Iyz->c2, 
-        *ix3p=(v4sf*)Ix->c3, *iy3p=(v4sf*)Iy->c3, *iz3p=(v4sf*)Iz->c3, *ixx3p=(v4sf*)Ixx->c3, *ixy3p=(v4sf*)Ixy->c3, *iyy3p=(v4sf*)Iyy->c3, *ixz3p=(v4sf*)Ixz->c3, *iyz3p=(v4sf*) Iyz->c3;
-        
-    memset(a11->data, 0, sizeof(float)*du->height*du->stride);
-    memset(a12->data, 0, sizeof(float)*du->height*du->stride);
-    memset(a22->data, 0, sizeof(float)*du->height*du->stride);
-    memset(b1->data , 0, sizeof(float)*du->height*du->stride);
-    memset(b2->data , 0, sizeof(float)*du->height*du->stride);
-              
-    int i;
-    for(i = 0 ; i<du->height*du->stride/4 ; i++){
-        v4sf tmp, tmp2, tmp3, tmp4, tmp5, tmp6, n1, n2, n3, n4, n5, n6;
-        // dpsi color
-        if(half_delta_over3){
-            tmp  = *iz1p + (*ix1p)*(*dup) + (*iy1p)*(*dvp);
-            n1 = (*ix1p) * (*ix1p) + (*iy1p) * (*iy1p) + dnorm;
-            tmp2 = *iz2p + (*ix2p)*(*dup) + (*iy2p)*(*dvp);
-            n2 = (*ix2p) * (*ix2p) + (*iy2p) * (*iy2p) + dnorm;
-            tmp3 = *iz3p + (*ix3p)*(*dup) + (*iy3p)*(*dvp);
-            n3 = (*ix3p) * (*ix3p) + (*iy3p) * (*iy3p) + dnorm;
-            tmp = (*maskp) * hdover3 / __builtin_ia32_sqrtps(tmp*tmp/n1 + tmp2*tmp2/n2 + tmp3*tmp3/n3 + epscolor);
-            tmp3 = tmp/n3; tmp2 = tmp/n2; tmp /= n1;
-            *a11p += tmp  * (*ix1p) * (*ix1p);
-            *a12p += tmp  * (*ix1p) * (*iy1p);
-            *a22p += tmp  * (*iy1p) * (*iy1p);
-            *b1p -=  tmp  * (*iz1p) * (*ix1p);
-            *b2p -=  tmp  * (*iz1p) * (*iy1p);
-            *a11p += tmp2 * (*ix2p) * (*ix2p);
-            *a12p += tmp2 * (*ix2p) * (*iy2p);
-            *a22p += tmp2 * (*iy2p) * (*iy2p);
-            *b1p -=  tmp2 * (*iz2p) * (*ix2p);
-            *b2p -=  tmp2 * (*iz2p) * (*iy2p);
-            *a11p += tmp3 * (*ix3p) * (*ix3p);
-            *a12p += tmp3 * (*ix3p) * (*iy3p);
-            *a22p += tmp3 * (*iy3p) * (*iy3p);
-            *b1p -=  tmp3 * (*iz3p) * (*ix3p);
-            *b2p -=  tmp3 * (*iz3p) * (*iy3p);
-        }
-        // dpsi gradient
-        n1 = (*ixx1p) * (*ixx1p) + (*ixy1p) * (*ixy1p) + dnorm;
-        n2 = (*iyy1p) * (*iyy1p) + (*ixy1p) * (*ixy1p) + dnorm;
-        tmp  = *ixz1p + (*ixx1p) * (*dup) + (*ixy1p) * (*dvp);
-        tmp2 = *iyz1p + (*ixy1p) * (*dup) + (*iyy1p) * (*dvp);
-        n3 = (*ixx2p) * (*ixx2p) + (*ixy2p) * (*ixy2p) + dnorm;
-        n4 = (*iyy2p) * (*iyy2p) + (*ixy2p) * (*ixy2p) + dnorm;
-        tmp3 = *ixz2p + (*ixx2p) * (*dup) + (*ixy2p) * (*dvp);
-        tmp4 = *iyz2p + (*ixy2p) * (*dup) + (*iyy2p) * (*dvp);
-        n5 = (*ixx3p) * (*ixx3p) + (*ixy3p) * (*ixy3p) + dnorm;
-        n6 = (*iyy3p) * (*iyy3p) + (*ixy3p) * (*ixy3p) + dnorm;
-        tmp5 = *ixz3p + (*ixx3p) * (*dup) + (*ixy3p) * (*dvp);
-        tmp6 = *iyz3p + (*ixy3p) * (*dup) + (*iyy3p) * (*dvp);
-        tmp = (*maskp) * hgover3 / __builtin_ia32_sqrtps(tmp*tmp/n1 + tmp2*tmp2/n2 + tmp3*tmp3/n3 + tmp4*tmp4/n4 + tmp5*tmp5/n5 + tmp6*tmp6/n6 + epsgrad);
-        tmp6 = tmp/n6; tmp5 = tmp/n5; tmp4 = tmp/n4; tmp3 = tmp/n3; tmp2 = tmp/n2; tmp /= n1;      
-        *a11p += tmp *(*ixx1p)*(*ixx1p) + tmp2*(*ixy1p)*(*ixy1p);
-        *a12p += tmp *(*ixx1p)*(*ixy1p) + tmp2*(*ixy1p)*(*iyy1p);
-        *a22p += tmp2*(*iyy1p)*(*iyy1p) + tmp *(*ixy1p)*(*ixy1p);
-        *b1p -=  tmp *(*ixx1p)*(*ixz1p) + tmp2*(*ixy1p)*(*iyz1p);
-        *b2p -=  tmp2*(*iyy1p)*(*iyz1p) + tmp *(*ixy1p)*(*ixz1p);
-        *a11p += tmp3*(*ixx2p)*(*ixx2p) + tmp4*(*ixy2p)*(*ixy2p);
-        *a12p += tmp3*(*ixx2p)*(*ixy2p) + tmp4*(*ixy2p)*(*iyy2p);
-        *a22p += tmp4*(*iyy2p)*(*iyy2p) + tmp3*(*ixy2p)*(*ixy2p);
-        *b1p -=  tmp3*(*ixx2p)*(*ixz2p) + tmp4*(*ixy2p)*(*iyz2p);
-        *b2p -=  tmp4*(*iyy2p)*(*iyz2p) + tmp3*(*ixy2p)*(*ixz2p);
-        *a11p += tmp5*(*ixx3p)*(*ixx3p) + tmp6*(*ixy3p)*(*ixy3p);
-        *a12p += tmp5*(*ixx3p)*(*ixy3p) + tmp6*(*ixy3p)*(*iyy3p);
-        *a22p += tmp6*(*iyy3p)*(*iyy3p) + tmp5*(*ixy3p)*(*ixy3p);
-        *b1p -=  tmp5*(*ixx3p)*(*ixz3p) + tmp6*(*ixy3p)*(*iyz3p);
-        *b2p -=  tmp6*(*iyy3p)*(*iyz3p) + tmp5*(*ixy3p)*(*ixz3p);  
-        dup+=1; dvp+=1; maskp+=1; a11p+=1; a12p+=1; a22p+=1; b1p+=1; b2p+=1; 
-        ix1p+=1; iy1p+=1; iz1p+=1; ixx1p+=1; ixy1p+=1; iyy1p+=1; ixz1p+=1; iyz1p+=1;
-        ix2p+=1; iy2p+=1; iz2p+=1; ixx2p+=1; ixy2p+=1; iyy2p+=1; ixz2p+=1; iyz2p+=1;
-        ix3p+=1; iy3p+=1; iz3p+=1; ixx3p+=1; ixy3p+=1; iyy3p+=1; ixz3p+=1; iyz3p+=1;
+    switch(simd_width()){
+#ifdef SIMD_DISPATCH
+    case 16: compute_data_and_match_avx512(a11, a12, a22, b1, b2, mask, du, dv, Ix, Iy, Iz, Ixx, Ixy, Iyy, Ixz, Iyz, half_delta_over3, half_gamma_over3); break;
+    case 8: compute_data_and_match_avx2(a11, a12, a22, b1, b2, mask, du, dv, Ix, Iy, Iz, Ixx, Ixy, Iyy, Ixz, Iyz, half_delta_over3, half_gamma_over3); break;
+#endif
+    default: compute_data_and_match_sse(a11, a12, a22, b1, b2, mask, du, dv, Ix, Iy, Iz, Ixx, Ixy, Iyy, Ixz, Iyz, half_delta_over3, half_gamma_over3);
     }
 }
@@ -11,17 +11,20 @@ extern "C" {
 /* warp a color image according to a flow. src is the input image, wx and wy, the input flow. dst is the warped image and mask contains 0 or 1 if the pixels goes outside/inside image boundaries */
 void image_warp(color_image_t *dst, image_t *mask, const color_image_t *src, const image_t *wx, const image_t *wy);
 
-/* compute image first and second order spatio-temporal derivatives of a color image */
-void get_derivatives(const color_image_t *im1, const color_image_t *im2, const convolution_t *deriv, color_image_t *dx, color_image_t *dy, color_image_t *dt, color_image_t *dxx, color_image_t *dxy, color_image_t *dyy, color_image_t *dxt, color_image_t *dyt);
+/* compute image first and second order spatio-temporal derivatives of a color image, tmp_im2 is a scratch image receiving the mean of im1 and im2 */
+void get_derivatives(const color_image_t *im1, const color_image_t *im2, const convolution_t *deriv, color_image_t *dx, color_image_t *dy, color_image_t *dt, color_image_t *dxx, color_image_t *dxy, color_image_t *dyy, color_image_t *dxt, color_image_t *dyt, color_image_t *tmp_im2);
 
-/* compute the smoothness term */
-void compute_smoothness(image_t *dst_horiz, image_t *dst_vert, const image_t *uu, const image_t *vv, const image_t *dpsis_weight, const convolution_t *deriv_flow, const float half_alpha);
+/* compute the smoothness term, ux2 uy2 vx2 and vy2 are scratch images of the size of uu */
+void compute_smoothness(image_t *dst_horiz, image_t *dst_vert, const image_t *uu, const image_t *vv, const image_t *dpsis_weight, const convolution_t *deriv_flow, const float half_alpha, image_t *ux2, image_t *uy2, image_t *vx2, image_t *vy2);
 
 /* sub the laplacian (smoothness term) to the right-hand term */
 void sub_laplacian(image_t *dst, const image_t *src, const image_t *weight_horiz, const image_t *weight_vert);
 
-/* compute local smoothness weight as a sigmoid on image gradient*/
-image_t* compute_dpsis_weight(color_image_t *im, float coef, const convolution_t *deriv);
+/* uu = wx+du and vv = wy+dv, return the sum of du^2+dv^2 over the image */
+float add_flow_increment(image_t *uu, image_t *vv, const image_t *wx, const image_t *wy, const image_t *du, const image_t *dv);
+
+/* compute local smoothness weight as a sigmoid on image gradient into lum, lum_x and lum_y are scratch images */
+void compute_dpsis_weight(image_t *lum, color_image_t *im, float coef, const convolution_t *deriv, image_t *lum_x, image_t *lum_y);
 
 /* compute the dataterm and the matching term
    a11 a12 a22 represents the 2x2 diagonal matrix, b1 and b2 the right hand side
@@ -0,0 +1,234 @@
+/* Vector kernels of variational_aux.c, written once for a vector type and included once per instruction set.
+   The includer defines
+   VSF             the float vector type (v4sf, v8sf or v16sf), VSF_U its unaligned version
+   VSF_N           its number of lanes
+   VSF_SQRT(x)     the square root of a vector
+   SIMD_FN(name)   the name of the kernel for this instruction set
+   Images have a stride multiple of SIMD_MAX_WIDTH and are aligned on SIMD_ALIGN, so whole images are processed
+   with aligned vectors, and lines with unaligned vectors when neighbouring pixels are involved. */
+
+#define VSF_LOADU(p) (*(const VSF_U*) (p))
+
+/* uu = wx+du and vv = wy+dv, return the sum of du^2+dv^2 over the image */
+static float SIMD_FN(add_flow_increment)(image_t *uu, image_t *vv, const image_t *wx, const image_t *wy, const image_t *du, const image_t *dv){
+    const int w = uu->width, s = uu->stride;
+    const VSF zero = {0.0f};
+    VSF acc = zero;
+    float norm = 0.0f;
+    int i, j, k;
+    for( j=0 ; j<uu->height ; j++){
+        const int o = j*s;
+        VSF *uup = (VSF*) (uu->data+o), *vvp = (VSF*) (vv->data+o);
+        const VSF *wxp = (const VSF*) (wx->data+o), *wyp = (const VSF*) (wy->data+o), *dup = (const VSF*) (du->data+o), *dvp = (const VSF*) (dv->data+o);
+        for( i=0 ; i<(w/VSF_N) ; i++){
+            uup[i] = wxp[i] + dup[i];
+            vvp[i] = wyp[i] + dvp[i];
+            acc += dup[i]*dup[i] + dvp[i]*dvp[i];
+        }
+        // the last block lies partly on the padding, only its pixels inside the image are counted
+        for( ; i<s/VSF_N ; i++){
+            uup[i] = wxp[i] + dup[i];
+            vvp[i] = wyp[i] + dvp[i];
+        }
+        for( k=(w/VSF_N)*VSF_N ; k<w ; k++)
+            norm += du->data[o+k]*du->data[o+k] + dv->data[o+k]*dv->data[o+k];
+    }
+    for( k=0 ; k<VSF_N ; k++)
+        norm += acc[k];
+    return norm;
+}
+
+/* final weights of compute_smoothness from the flow and its central derivatives */
+static void SIMD_FN(smoothness_weights)(image_t *dst_horiz, image_t *dst_vert, const image_t *uu, const image_t *vv, const image_t *dpsis_weight,
+                                        const image_t *ux2, const image_t *uy2, const image_t *vx2, const image_t *vy2, const float half_alpha){
+    const int w = uu->width, h = uu->height, s = uu->stride;
+    const VSF zero = {0.0f};
+    const VSF half = zero+0.5f, halpha = zero+half_alpha, eps = zero+epsilon_smooth;
+    int i, j;
+    // horiz, the pixel i is linked to i+1
+    for( j=0 ; j<h ; j++){
+        const int o = j*s;
+        const float *u = uu->data+o, *v = vv->data+o, *uy = uy2->data+o, *vy = vy2->data+o, *wp = dpsis_weight->data+o;
+        float *dst = dst_horiz->data+o;
+        for( i=0 ; i+VSF_N<=w-1 ; i+=VSF_N){
+            const VSF ux1 = VSF_LOADU(u+i+1) - VSF_LOADU(u+i);
+            const VSF vx1 = VSF_LOADU(v+i+1) - VSF_LOADU(v+i);
+            const VSF tu = half*(VSF_LOADU(uy+i)+VSF_LOADU(uy+i+1));
+            const VSF tv = half*(VSF_LOADU(vy+i)+VSF_LOADU(vy+i+1));
+            const VSF tmp = ux1*ux1 + tu*tu + vx1*vx1 + tv*tv;
+            *(VSF_U*) (dst+i) = (VSF_LOADU(wp+i)+VSF_LOADU(wp+i+1))*halpha / VSF_SQRT(tmp+eps);
+        }
+        for( ; i<w-1 ; i++)
+            dst[i] = smoothness_weight(u[i+1]-u[i], v[i+1]-v[i], uy[i], uy[i+1], vy[i], vy[i+1], wp[i], wp[i+1], half_alpha);
+        memset(dst+w-1, 0, sizeof(float)*(s-w+1));
+    }
+    // vert, the pixel i of line j is linked to the pixel i of line j+1
+    for( j=0 ; j<h-1 ; j++){
+        const int o = j*s;
+        const float *u = uu->data+o, *v = vv->data+o, *ux = ux2->data+o, *vx = vx2->data+o, *wp = dpsis_weight->data+o;
+        float *dst = dst_vert->data+o;
+        for( i=0 ; i+VSF_N<=w ; i+=VSF_N){
+            const VSF uy1 = VSF_LOADU(u+i+s) - VSF_LOADU(u+i);
+            const VSF vy1 = VSF_LOADU(v+i+s) - VSF_LOADU(v+i);
+            const VSF tu = half*(VSF_LOADU(ux+i)+VSF_LOADU(ux+i+s));
+            const VSF tv = half*(VSF_LOADU(vx+i)+VSF_LOADU(vx+i+s));
+            const VSF tmp = uy1*uy1 + tu*tu + vy1*vy1 + tv*tv;
+            *(VSF_U*) (dst+i) = (VSF_LOADU(wp+i)+VSF_LOADU(wp+i+s))*halpha / VSF_SQRT(tmp+eps);
+        }
+        for( ; i<w ; i++)
+            dst[i] = smoothness_weight(u[i+s]-u[i], v[i+s]-v[i], ux[i], ux[i+s], vx[i], vx[i+s], wp[i], wp[i+s], half_alpha);
+        memset(dst+w, 0, sizeof(float)*(s-w));
+    }
+    memset( &dst_vert->data[(h-1)*s], 0, sizeof(float)*s);
+}
+
+/* sub the laplacian (smoothness term) to the right-hand term */
+static void SIMD_FN(sub_laplacian)(image_t *dst, const image_t *src, const image_t *weight_horiz, const image_t *weight_vert){
+    const int w = src->width, s = src->stride;
+    int i, j;
+    // horizontal filtering, the pixel i receives the flux from i-1 then the one to i+1
+    for( j=0 ; j<src->height ; j++){
+        const float *sp = src->data+j*s, *hp = weight_horiz->data+j*s;
+        float *dp = dst->data+j*s;
+        sub_laplacian_horiz_pixel(dp, sp, hp, 0, w);
+        for( i=1 ; i+VSF_N<=w-1 ; i+=VSF_N){
+            const VSF si = VSF_LOADU(sp+i);
+            *(VSF_U*) (dp+i) = (VSF_LOADU(dp+i) - VSF_LOADU(hp+i-1)*(si-VSF_LOADU(sp+i-1))) + VSF_LOADU(hp+i)*(VSF_LOADU(sp+i+1)-si);
+        }
+        for( ; i<w ; i++)
+            sub_laplacian_horiz_pixel(dp, sp, hp, i, w);
+    }
+    // vertical filtering
+    VSF *wvp = (VSF*) weight_vert->data, *srcp = (VSF*) src->data, *srcp_s = (VSF*) (src->data+s), *dstp = (VSF*) dst->data, *dstp_s = (VSF*) (dst->data+s);
+    for( i=0 ; i<(src->height-1)*s/VSF_N ; i++){
+        const VSF tmp = wvp[i] * (srcp_s[i]-srcp[i]);
+        dstp[i] += tmp;
+        dstp_s[i] -= tmp;
+    }
+}
+
+/* m = (a+b)/2 and, if d is not null, d = b-a over lines of stride floats */
+static void SIMD_FN(mean_diff_line)(float *m, float *d, const float *a, const float *b, const int stride){
+    const VSF zero = {0.0f};
+    const VSF half = zero+0.5f;
+    const VSF *ap = (const VSF*) a, *bp = (const VSF*) b;
+    VSF *mp = (VSF*) m, *dp = (VSF*) d;
+    int i;
+    if(d){
+        for( i=0 ; i<stride/VSF_N ; i++){
+            mp[i] = half*(bp[i]+ap[i]);
+            dp[i] = bp[i]-ap[i];
+        }
+    }else{
+        for( i=0 ; i<stride/VSF_N ; i++)
+            mp[i] = half*(bp[i]+ap[i]);
+    }
+}
+
+/* 5 taps horizontal filter c of a line of stride floats, ext being the line with its first and last pixels repeated twice on each side */
+static void SIMD_FN(filter5_horiz_line)(float *dst, const float *ext, const float *c, const int stride){
+    const VSF zero = {0.0f};
+    const VSF c0 = zero+c[0], c1 = zero+c[1], c2 = zero+c[2], c3 = zero+c[3], c4 = zero+c[4];
+    int i;
+    for( i=0 ; i<stride ; i+=VSF_N)
+        *(VSF*) (dst+i) = c0*VSF_LOADU(ext+i) + c1*VSF_LOADU(ext+i+1) + c2*VSF_LOADU(ext+i+2) + c3*VSF_LOADU(ext+i+3) + c4*VSF_LOADU(ext+i+4);
+}
+
+/* 5 taps vertical filter c of the 5 lines of stride floats of rows */
+static void SIMD_FN(filter5_vert_line)(float *dst, const float *const *rows, const float *c, const int stride){
+    const VSF zero = {0.0f};
+    const VSF c0 = zero+c[0], c1 = zero+c[1], c2 = zero+c[2], c3 = zero+c[3], c4 = zero+c[4];
+    const VSF *r0 = (const VSF*) rows[0], *r1 = (const VSF*) rows[1], *r2 = (const VSF*) rows[2], *r3 = (const VSF*) rows[3], *r4 = (const VSF*) rows[4];
+    VSF *dp = (VSF*) dst;
+    int i;
+    for( i=0 ; i<stride/VSF_N ; i++)
+        dp[i] = c0*r0[i] + c1*r1[i] + c2*r2[i] + c3*r3[i] + c4*r4[i];
+}
+
+/* compute the dataterm and the matching term */
+static void SIMD_FN(compute_data_and_match)(image_t *a11, image_t *a12, image_t *a22, image_t *b1, image_t *b2, image_t *mask, image_t *du, image_t *dv, color_image_t *Ix, color_image_t *Iy, color_image_t *Iz, color_image_t *Ixx, color_image_t *Ixy, color_image_t *Iyy, color_image_t *Ixz, color_image_t *Iyz, const float half_delta_over3, const float half_gamma_over3){
+    const VSF zero = {0.0f};
+    const VSF dnorm = zero+datanorm;
+    const VSF hdover3 = zero+half_delta_over3;
+    const VSF epscolor = zero+epsilon_color;
+    const VSF hgover3 = zero+half_gamma_over3;
+    const VSF epsgrad = zero+epsilon_grad;
+
+    VSF *dup = (VSF*) du->data, *dvp = (VSF*) dv->data,
+        *maskp = (VSF*) mask->data,
+        *a11p = (VSF*) a11->data, *a12p = (VSF*) a12->data, *a22p = (VSF*) a22->data,
+        *b1p = (VSF*) b1->data, *b2p = (VSF*) b2->data,
+        *ix1p=(VSF*)Ix->c1, *iy1p=(VSF*)Iy->c1, *iz1p=(VSF*)Iz->c1, *ixx1p=(VSF*)Ixx->c1, *ixy1p=(VSF*)Ixy->c1, *iyy1p=(VSF*)Iyy->c1, *ixz1p=(VSF*)Ixz->c1, *iyz1p=(VSF*) Iyz->c1,
+        *ix2p=(VSF*)Ix->c2, *iy2p=(VSF*)Iy->c2, *iz2p=(VSF*)Iz->c2, *ixx2p=(VSF*)Ixx->c2, *ixy2p=(VSF*)Ixy->c2, *iyy2p=(VSF*)Iyy->c2, *ixz2p=(VSF*)Ixz->c2, *iyz2p=(VSF*) Iyz->c2,
+        *ix3p=(VSF*)Ix->c3, *iy3p=(VSF*)Iy->c3, *iz3p=(VSF*)Iz->c3, *ixx3p=(VSF*)Ixx->c3, *ixy3p=(VSF*)Ixy->c3, *iyy3p=(VSF*)Iyy->c3, *ixz3p=(VSF*)Ixz->c3, *iyz3p=(VSF*) Iyz->c3;
+
+    int i;
+    for(i = 0 ; i<du->height*du->stride/VSF_N ; i++){
+        VSF tmp, tmp2, tmp3, tmp4, tmp5, tmp6, n1, n2, n3, n4, n5, n6;
+        VSF a11v = zero, a12v = zero, a22v = zero, b1v = zero, b2v = zero;
+        // dpsi color
+        if(half_delta_over3){
+            tmp  = *iz1p + (*ix1p)*(*dup) + (*iy1p)*(*dvp);
+            n1 = (*ix1p) * (*ix1p) + (*iy1p) * (*iy1p) + dnorm;
+            tmp2 = *iz2p + (*ix2p)*(*dup) + (*iy2p)*(*dvp);
+            n2 = (*ix2p) * (*ix2p) + (*iy2p) * (*iy2p) + dnorm;
+            tmp3 = *iz3p + (*ix3p)*(*dup) + (*iy3p)*(*dvp);
+            n3 = (*ix3p) * (*ix3p) + (*iy3p) * (*iy3p) + dnorm;
+            tmp = (*maskp) * hdover3 / VSF_SQRT(tmp*tmp/n1 + tmp2*tmp2/n2 + tmp3*tmp3/n3 + epscolor);
+            tmp3 = tmp/n3; tmp2 = tmp/n2; tmp /= n1;
+            a11v += tmp  * (*ix1p) * (*ix1p);
+            a12v += tmp  * (*ix1p) * (*iy1p);
+            a22v += tmp  * (*iy1p) * (*iy1p);
+            b1v -=  tmp  * (*iz1p) * (*ix1p);
+            b2v -=  tmp  * (*iz1p) * (*iy1p);
+            a11v += tmp2 * (*ix2p) * (*ix2p);
+            a12v += tmp2 * (*ix2p) * (*iy2p);
+            a22v += tmp2 * (*iy2p) * (*iy2p);
+            b1v -=  tmp2 * (*iz2p) * (*ix2p);
+            b2v -=  tmp2 * (*iz2p) * (*iy2p);
+            a11v += tmp3 * (*ix3p) * (*ix3p);
+            a12v += tmp3 * (*ix3p) * (*iy3p);
+            a22v += tmp3 * (*iy3p) * (*iy3p);
+            b1v -=  tmp3 * (*iz3p) * (*ix3p);
+            b2v -=  tmp3 * (*iz3p) * (*iy3p);
+        }
+        // dpsi gradient
+        n1 = (*ixx1p) * (*ixx1p) + (*ixy1p) * (*ixy1p) + dnorm;
+        n2 = (*iyy1p) * (*iyy1p) + (*ixy1p) * (*ixy1p) + dnorm;
+        tmp  = *ixz1p + (*ixx1p) * (*dup) + (*ixy1p) * (*dvp);
+        tmp2 = *iyz1p + (*ixy1p) * (*dup) + (*iyy1p) * (*dvp);
+        n3 = (*ixx2p) * (*ixx2p) + (*ixy2p) * (*ixy2p) + dnorm;
+        n4 = (*iyy2p) * (*iyy2p) + (*ixy2p) * (*ixy2p) + dnorm;
+        tmp3 = *ixz2p + (*ixx2p) * (*dup) + (*ixy2p) * (*dvp);
+        tmp4 = *iyz2p + (*ixy2p) * (*dup) + (*iyy2p) * (*dvp);
+        n5 = (*ixx3p) * (*ixx3p) + (*ixy3p) * (*ixy3p) + dnorm;
+        n6 = (*iyy3p) * (*iyy3p) + (*ixy3p) * (*ixy3p) + dnorm;
+        tmp5 = *ixz3p + (*ixx3p) * (*dup) + (*ixy3p) * (*dvp);
+        tmp6 = *iyz3p + (*ixy3p) * (*dup) + (*iyy3p) * (*dvp);
+        tmp = (*maskp) * hgover3 / VSF_SQRT(tmp*tmp/n1 + tmp2*tmp2/n2 + tmp3*tmp3/n3 + tmp4*tmp4/n4 + tmp5*tmp5/n5 + tmp6*tmp6/n6 + epsgrad);
+        tmp6 = tmp/n6; tmp5 = tmp/n5; tmp4 = tmp/n4; tmp3 = tmp/n3; tmp2 = tmp/n2; tmp /= n1;
+        a11v += tmp *(*ixx1p)*(*ixx1p) + tmp2*(*ixy1p)*(*ixy1p);
+        a12v += tmp *(*ixx1p)*(*ixy1p) + tmp2*(*ixy1p)*(*iyy1p);
+        a22v += tmp2*(*iyy1p)*(*iyy1p) + tmp *(*ixy1p)*(*ixy1p);
+        b1v -=  tmp *(*ixx1p)*(*ixz1p) + tmp2*(*ixy1p)*(*iyz1p);
+        b2v -=  tmp2*(*iyy1p)*(*iyz1p) + tmp *(*ixy1p)*(*ixz1p);
+        a11v += tmp3*(*ixx2p)*(*ixx2p) + tmp4*(*ixy2p)*(*ixy2p);
+        a12v += tmp3*(*ixx2p)*(*ixy2p) + tmp4*(*ixy2p)*(*iyy2p);
+        a22v += tmp4*(*iyy2p)*(*iyy2p) + tmp3*(*ixy2p)*(*ixy2p);
+        b1v -=  tmp3*(*ixx2p)*(*ixz2p) + tmp4*(*ixy2p)*(*iyz2p);
+        b2v -=  tmp4*(*iyy2p)*(*iyz2p) + tmp3*(*ixy2p)*(*ixz2p);
+        a11v += tmp5*(*ixx3p)*(*ixx3p) + tmp6*(*ixy3p)*(*ixy3p);
+        a12v += tmp5*(*ixx3p)*(*ixy3p) + tmp6*(*ixy3p)*(*iyy3p);
+        a22v += tmp6*(*iyy3p)*(*iyy3p) + tmp5*(*ixy3p)*(*ixy3p);
+        b1v -=  tmp5*(*ixx3p)*(*ixz3p) + tmp6*(*ixy3p)*(*iyz3p);
+        b2v -=  tmp6*(*iyy3p)*(*iyz3p) + tmp5*(*ixy3p)*(*ixz3p);
+        // the system is written once instead of being erased then accumulated in memory
+        *a11p = a11v; *a12p = a12v; *a22p = a22v; *b1p = b1v; *b2p = b2v;
+        dup+=1; dvp+=1; maskp+=1; a11p+=1; a12p+=1; a22p+=1; b1p+=1; b2p+=1;
+        ix1p+=1; iy1p+=1; iz1p+=1; ixx1p+=1; ixy1p+=1; iyy1p+=1; ixz1p+=1; iyz1p+=1;
+        ix2p+=1; iy2p+=1; iz2p+=1; ixx2p+=1; ixy2p+=1; iyy2p+=1; ixz2p+=1; iyz2p+=1;
+        ix3p+=1; iy3p+=1; iz3p+=1; ixx3p+=1; ixy3p+=1; iyy3p+=1; ixz3p+=1; iyz3p+=1;
+    }
+}
+
+#undef VSF_LOADU
@@ -0,0 +1,75 @@
+// asyncWriter.cpp
+
+#include <stdio.h>
+#include <exception>
+
+#include "asyncWriter.h"
+
+AsyncWriter::AsyncWriter(size_t max_pending_bytes, int nthreads)
+    : max_pending_bytes_(max_pending_bytes)
+    , pending_bytes_(0)
+    , running_(0)
+    , stop_(false)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+    for (int i = 0; i < nthreads; i++)
+        threads_.push_back(std::thread(&AsyncWriter::Run, this));
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    job_pushed_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+        threads_[i].join();
+}
+
+void AsyncWriter::Push(std::function<void()> job, size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    // back-pressure: wait for the writers to release enough bytes
+    job_done_.wait(lock, [&] { return pending_bytes_ == 0 || pending_bytes_ + bytes <= max_pending_bytes_; });
+    Job queued = { std::move(job), bytes };
+    queue_.push_back(std::move(queued));
+    pending_bytes_ += bytes;
+    lock.unlock();
+    job_pushed_.notify_one();
+}
+
+void AsyncWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_done_.wait(lock, [&] { return queue_.empty() && running_ == 0; });
+}
+
+void AsyncWriter::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        job_pushed_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+        if (queue_.empty())
+            return;     // stopped and drained
+        Job job = std::move(queue_.front());
+        queue_.pop_front();
+        running_++;
+        lock.unlock();
+
+        try {
+            job.run();
+        }
+        catch (const std::exception &e) {
+            fprintf(stderr, "AsyncWriter: output job failed: %s\n", e.what());
+        }
+        // the buffers owned by the job are released before its bytes are
+        job.run = nullptr;
+
+        lock.lock();
+        running_--;
+        pending_bytes_ -= job.bytes;
+        job_done_.notify_all();
+    }
+}
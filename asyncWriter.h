@@ -0,0 +1,57 @@
+// asyncWriter.h
+//
+// background writer for the outputs (flows, previews, matches): the jobs own the buffers
+// they write, compute goes on while they run, and the queue is bounded in bytes so that
+// a slow disk blocks the producers instead of piling up frames in memory
+
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class AsyncWriter
+{
+public:
+    // max_pending_bytes bounds the buffers held by the queued and running jobs, nthreads writers run the jobs
+    explicit AsyncWriter(size_t max_pending_bytes, int nthreads = 1);
+
+    // runs the jobs still queued, then stops the writers
+    ~AsyncWriter();
+
+    // queue a job holding bytes of output buffers, blocks while the queue is full;
+    // a job larger than the bound is accepted once the queue is empty
+    void Push(std::function<void()> job, size_t bytes);
+
+    // wait until every job pushed so far is done, before the outputs are read back
+    void Flush();
+
+private:
+    struct Job
+    {
+        std::function<void()> run;
+        size_t bytes;
+    };
+
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable job_pushed_;    // a job is queued or the writer stops
+    std::condition_variable job_done_;      // a job is done, the bytes it held are released
+    std::deque<Job> queue_;
+    std::vector<std::thread> threads_;
+    size_t max_pending_bytes_;
+    size_t pending_bytes_;                  // held by the queued and running jobs
+    int running_;
+    bool stop_;
+
+    AsyncWriter(const AsyncWriter&);
+    AsyncWriter& operator=(const AsyncWriter&);
+};
+
+#endif
@@ -20,9 +20,7 @@
 //
 
 
-// first four bytes, should be the same in little endian
-#define TAG_FLOAT 202021.25  // check for this when READING the file
-#define TAG_STRING "PIEH"    // use this when WRITING the file
+// the header check and the bulk transfers are in PFilter/variational/flow_io.c
 
 //#include <opencv2/opencv.hpp>
 #include <stdio.h>
@@ -42,6 +40,16 @@ bool unknown_flow(float *f) {
     return unknown_flow(f[0],f[1]);
 }
 
+// copy an opened flow into a new 2-band image and release it
+static void ReadFlowMap(cv::Mat2f& img, flow_map_t& map)
+{
+    // the payload is already interleaved like a continuous 2-band image
+    cv::Mat2f img2(map.height, map.width);
+    memcpy(img2.ptr<float>(), map.data, (size_t)map.width * map.height * 2 * sizeof(float));
+    flow_map_close(&map);
+    img = img2;
+}
+
 // read a flow file into 2-band image
 int ReadFlowFile(cv::Mat2f& img, const char* filename)
 {
@@ -52,143 +60,85 @@ int ReadFlowFile(cv::Mat2f& img, const char* filename)
     }
 
     const char *dot = strrchr(filename, '.');
-    if (strcmp(dot, ".flo") != 0) {
-        printf("ReadFlowFile (%s): extension .flo expected\n", filename);
-        return 0;
-    }
-
-    FILE *stream = fopen(filename, "rb");
-    if (stream == 0) {
-        printf("ReadFlowFile: could not open %s\n", filename);
+    if (dot == NULL || (strcmp(dot, ".flo") != 0 && strcmp(dot, ".cflo") != 0)) {
+        printf("ReadFlowFile (%s): extension .flo or .cflo expected\n", filename);
         return 0;
     }
-    
-    int width, height;
-    float tag;
 
-    if ((int)fread(&tag,    sizeof(float), 1, stream) != 1 ||
-        (int)fread(&width,  sizeof(int),   1, stream) != 1 ||
-        (int)fread(&height, sizeof(int),   1, stream) != 1) {    // read file head
+    flow_map_t map;
+    if (flow_map_open(&map, filename) != 0) {
         printf("ReadFlowFile: problem reading file %s\n", filename);
         return 0;
     }
-    printf("width in file is %d\n",width);
-    printf("height in file is %d\n",height);
-    //printf("channels is %d\n",tag);
-
+    ReadFlowMap(img, map);
+    return 1;
+}
 
-    if (tag != TAG_FLOAT) { // simple test for correct endian-ness
-        printf("ReadFlowFile(%s): wrong tag (possibly due to big-endian machine?)\n", filename);
+// write a 2-band image into flow file
+int WriteFlowFile(cv::Mat2f& img, const char* filename, int codec)
+{
+    if (filename == NULL) {
+        printf("WriteFlowFile: empty filename\n");
         return 0;
     }
 
-    // another sanity check to see that integers were read correctly (99999 should do the trick...)
-    if (width < 1 || width > 99999) {
-        printf("ReadFlowFile(%s): illegal width %d\n", filename, width);
+    const char *dot = strrchr(filename, '.');
+    if (dot == NULL) {
+        printf("WriteFlowFile: extension required in filename '%s'\n", filename);
         return 0;
     }
 
-    if (height < 1 || height > 99999) {
-        printf("ReadFlowFile(%s): illegal height %d\n", filename, height);
+    bool packed = strcmp(dot, ".cflo") == 0;
+    if (strcmp(dot, ".flo") != 0 && !packed) {
+        printf("WriteFlowFile: filename '%s' should have extension '.flo' or '.cflo'\n", filename);
         return 0;
     }
 
-    int nBands = 2;
-
-    //printf("bp1.2\n");
-    cv::Mat2f img2(height,width,nBands);
-
-    //printf("bp1.3\n");
-    //printf("reading %d x %d x 2 = %d floats\n", width, height, width*height*2);
-    
-    for (int j=0; j<height; j++) {
-        for (int i=0; i<width; i++) {
-            float tmp[nBands];
-            if ((int)fread(tmp, sizeof(float), nBands, stream) != nBands){
-                printf("ReadFlowFile(%s): file is too short\n", filename);
-                return 0;
-            }
-	    //printf("bp1.4\n");
-            img2.at<cv::Vec2f>(j,i)[0] = tmp[0];
-            img2.at<cv::Vec2f>(j,i)[1] = tmp[1];
-        }
+    if (img.channels() != 2) {
+        printf("WriteFlowFile(%s): image must have 2 bands\n", filename);
+        return 0;
     }
 
-    if (fgetc(stream) != EOF) {
-        printf("ReadFlowFile(%s): file is too long\n", filename);
+    int err = packed ? flow_pack_write(filename, img.ptr<float>(), img.cols, img.rows, (int)img.step1(), codec)
+                     : flow_write(filename, img.ptr<float>(), img.cols, img.rows, (int)img.step1());
+    if (err != 0) {
+        printf("WriteFlowFile(%s): problem writing file\n", filename);
         return 0;
     }
-    
-    fclose(stream);
-    img = img2.clone();
     return 1;
-
 }
 
-// write a 2-band image into flow file
-int WriteFlowFile(cv::Mat2f& img, const char* filename)
+// read the flow of a sequence archive record into 2-band image
+int ReadFlowArchive(cv::Mat2f& img, flow_archive_t* archive, int frame, int direction, int stage)
 {
-    if (filename == NULL) {
-        printf("WriteFlowFile: empty filename\n");
-        return 0;
-    }
-
-    const char *dot = strrchr(filename, '.');
-    if (dot == NULL) {
-        printf("WriteFlowFile: extension required in filename '%s'\n", filename);
+    const flow_archive_entry_t *entry = flow_archive_find(archive, frame, direction, stage);
+    if (entry == NULL) {
+        printf("ReadFlowArchive(%s): no flow %d/%d/%d\n", archive->filename, frame, direction, stage);
         return 0;
     }
 
-    if (strcmp(dot, ".flo") != 0) {
-        printf("WriteFlowFile: filename '%s' should have extension '.flo'\n", filename);
-        return 0;
-    }
-
-    //CShape sh = img.Shape();
-    //int width = sh.width, height = sh.height, nBands = sh.nBands;
-    cv::Size sze = img.size();
-    int width = sze.width, height = sze.height, nBands = img.channels();
-    //cout<<"width is"<<width<<endl;
-    printf("width is %d\n",width);
-    printf("height is %d\n",height);
-    printf("channels is %d\n",nBands);
-
-    if (nBands != 2) {
-        printf("WriteFlowFile(%s): image must have 2 bands\n", filename);
+    flow_map_t map;
+    if (flow_archive_map_flow(archive, entry, &map) != 0) {
+        printf("ReadFlowArchive(%s): problem reading flow %d/%d/%d\n", archive->filename, frame, direction, stage);
         return 0;
     }
+    ReadFlowMap(img, map);
+    return 1;
+}
 
-    FILE *stream = fopen(filename, "wb");
-    if (stream == 0) {
-        printf("WriteFlowFile: could not open %s\n", filename);
+// append a 2-band image to a sequence archive
+int WriteFlowArchive(cv::Mat2f& img, flow_archive_t* archive, int frame, int direction, int stage, int codec)
+{
+    if (img.channels() != 2) {
+        printf("WriteFlowArchive(%s): image must have 2 bands\n", archive->filename);
         return 0;
     }
 
-        // write the header
-    fprintf(stream, TAG_STRING);
-    if ((int)fwrite(&width,  sizeof(int),   1, stream) != 1 ||
-        (int)fwrite(&height, sizeof(int),   1, stream) != 1) {
-        printf("WriteFlowFile(%s): problem writing header\n", filename);
+    if (flow_archive_put_flow(archive, frame, direction, stage, img.ptr<float>(), img.cols, img.rows, (int)img.step1(), codec) != 0) {
+        printf("WriteFlowArchive(%s): problem writing flow %d/%d/%d\n", archive->filename, frame, direction, stage);
         return 0;
     }
-    
-    
-        // write the rows
-    
-        for (int j=0; j<height; j++) {
-            for (int i=0; i<width; i++) {
-                float tmp[nBands];
-                tmp[0] = img.at<cv::Vec2f>(j,i)[0];
-                tmp[1] = img.at<cv::Vec2f>(j,i)[1];
-                if ((int)fwrite(tmp, sizeof(float), nBands, stream) != nBands){
-                    printf("WriteFlowFile(%s): problem writing data\n", filename);
-                    return 0;
-                }
-            }
-        }
-    
-        fclose(stream);
-	return 1;
+    return 1;
 }
 
 /*
@@ -1,6 +1,11 @@
 // flowIO.h
 
+#ifndef FLOW_IO_H
+#define FLOW_IO_H
+
 #include <opencv2/opencv.hpp>
+#include "PFilter/variational/flow_io.h"
+#include "PFilter/variational/flow_archive.h"
 
 // the "official" threshold - if the absolute value of either 
 // flow component is greater, it's considered unknown
@@ -13,8 +18,16 @@
 bool unknown_flow(float u, float v);
 bool unknown_flow(float *f);
 
-// read a flow file into 2-band image
+// read a flow file (.flo or .cflo) into 2-band image
 int ReadFlowFile(cv::Mat2f& img, const char* filename);
 
-// write a 2-band image into flow file 
-int WriteFlowFile(cv::Mat2f& img, const char* filename);
+// write a 2-band image into flow file, a .cflo file is coded with codec (FLOW_CODEC_*)
+int WriteFlowFile(cv::Mat2f& img, const char* filename, int codec = FLOW_CODEC_FLOAT32);
+
+// read the flow of a sequence archive record into 2-band image
+int ReadFlowArchive(cv::Mat2f& img, flow_archive_t* archive, int frame, int direction, int stage);
+
+// append a 2-band image to a sequence archive, as a .flo payload or a .cflo one coded with codec when codec >= 0
+int WriteFlowArchive(cv::Mat2f& img, flow_archive_t* archive, int frame, int direction, int stage, int codec = -1);
+
+#endif
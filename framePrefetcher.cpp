@@ -0,0 +1,85 @@
+// framePrefetcher.cpp
+
+#include <stdio.h>
+#include <climits>
+#include <exception>
+
+#include "framePrefetcher.h"
+
+FramePrefetcher::FramePrefetcher(std::function<bool(int, cv::Mat&)> decode, int nthreads, int lookahead)
+    : decode_(decode)
+    , lookahead_(lookahead < 1 ? 1 : lookahead)
+    , next_(0)
+    , taken_(0)
+    , end_(INT_MAX)
+    , stop_(false)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > lookahead_)
+        nthreads = lookahead_;  // the others would never find a frame in the window
+    for (int i = 0; i < nthreads; i++)
+        threads_.push_back(std::thread(&FramePrefetcher::Run, this));
+}
+
+FramePrefetcher::~FramePrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    window_moved_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+        threads_[i].join();
+}
+
+bool FramePrefetcher::Get(int index, cv::Mat &frame)
+{
+    frame = cv::Mat();
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (index < taken_)
+        return false;   // taken already
+    // the frames skipped by the caller leave the window too
+    frames_.erase(frames_.begin(), frames_.lower_bound(index));
+    taken_ = index + 1;
+    window_moved_.notify_all();
+    frame_decoded_.wait(lock, [&] { return frames_.count(index) != 0 || index >= end_; });
+    if (index >= end_)
+        return false;
+    frame = frames_[index];
+    frames_.erase(index);
+    return true;
+}
+
+void FramePrefetcher::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        // the window ends lookahead frames past the one taken last, the one asked for included
+        window_moved_.wait(lock, [&] { return stop_ || (next_ < end_ && next_ < taken_ + lookahead_); });
+        if (stop_)
+            return;
+        int index = next_++;
+        lock.unlock();
+
+        cv::Mat frame;
+        bool decoded = true;
+        try {
+            decoded = decode_(index, frame);
+        }
+        catch (const std::exception &e) {
+            fprintf(stderr, "FramePrefetcher: decoding frame %d failed: %s\n", index, e.what());
+            frame = cv::Mat();
+        }
+
+        lock.lock();
+        if (!decoded) {
+            if (index < end_)
+                end_ = index;
+        }
+        // a frame the caller went past is not kept
+        else if (index >= taken_ - 1)
+            frames_[index] = frame;
+        frame_decoded_.notify_all();
+    }
+}
@@ -0,0 +1,54 @@
+// framePrefetcher.h
+//
+// background decoder for the input frames: nthreads decoders run ahead of the frame taken
+// last by at most lookahead frames, so that decoding overlaps the matching instead of
+// holding up the start, and the frames are handed out in order
+
+#ifndef FRAME_PREFETCHER_H
+#define FRAME_PREFETCHER_H
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+class FramePrefetcher
+{
+public:
+    // decode(i, frame) decodes frame i, left empty when it cannot be decoded, and returns false past
+    // the end of the sequence, which is only known once reached; it is called from nthreads threads
+    // at once, for frames up to lookahead past the one taken last
+    FramePrefetcher(std::function<bool(int, cv::Mat&)> decode, int nthreads, int lookahead);
+
+    // stops the decoders, the frames decoded and not taken are dropped
+    ~FramePrefetcher();
+
+    // frame index, blocks until it is decoded; the frames are taken in increasing order and
+    // the ones before index are released. Returns false past the end of the sequence, and for
+    // the frames taken or skipped already
+    bool Get(int index, cv::Mat &frame);
+
+private:
+    void Run();
+
+    std::function<bool(int, cv::Mat&)> decode_;
+    std::mutex mutex_;
+    std::condition_variable window_moved_;  // a frame is taken or the prefetcher stops
+    std::condition_variable frame_decoded_; // a frame is decoded or the end is found
+    std::map<int, cv::Mat> frames_;         // decoded and not taken yet
+    std::vector<std::thread> threads_;
+    int lookahead_;
+    int next_;                              // next frame to decode
+    int taken_;                             // frames before this one were taken
+    int end_;                               // first frame past the end, INT_MAX until found
+    bool stop_;
+
+    FramePrefetcher(const FramePrefetcher&);
+    FramePrefetcher& operator=(const FramePrefetcher&);
+};
+
+#endif
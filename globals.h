@@ -1,25 +1,89 @@
 #ifndef GLOBALS_H
 #define GLOBALS_H
 
+// flows selected for the variational refinement, var_refine_input_int is a combination of these bits
+#define VAR_REFINE_XY 1
+#define VAR_REFINE_XYT 2
+
 typedef struct cpm_pf_params_t
 {
     int max_displacement_input_int;
     int check_threshold_input_int;
     int cost_threshold_input_int;
     int iterations_input_int;
+    int export_text_matches_input_int;  // write the matches as text next to the binary .match files
+    int export_cpm_flow_input_int;      // also write the matches as dense flows and .png previews, the PF part uses the sparse matches
+    int preview_every_input_int;        // .png preview of the frames multiple of this, 0 for none
+    int preview_scale_input_int;        // previews at 1/scale of the resolution
+    int pack_flow_codec_input_int;      // -1 writes the intermediate flows as .flo, otherwise in .cflo files with this FLOW_CODEC_*
     float lambda_XY_input_float;
     float delta_XY_input_float;
     float alpha_XY_input_float;
+    int interpolation_T_input_int;      // cv::INTER_CUBIC (2) or cv::INTER_LINEAR (1)
+    int iterations_T_input_int;
+    float lambda_T_input_float;
+    float delta_photo_input_float;
+    float delta_grad_input_float;
+    float alpha_photo_input_float;
+    float alpha_grad_input_float;
+    // variational refinement, the defaults are the ones of variational_params_default()
+    int var_refine_input_int;           // flows refined: 0 none, VAR_REFINE_XY, VAR_REFINE_XYT or both
+    float var_alpha_input_float;
+    float var_gamma_input_float;
+    float var_delta_input_float;
+    float var_sigma_input_float;
+    int var_niter_outer_input_int;
+    int var_niter_inner_input_int;
+    int var_niter_solver_input_int;
+    float var_sor_omega_input_float;
+    int var_sor_redblack_input_int;
+    int var_nlevels_input_int;
+    int var_level_niter_outer_input_int[3];  // schedule of each level of the refinement pyramid, [0] is the full resolution
+    int var_level_niter_inner_input_int[3];
+    int var_level_niter_solver_input_int[3];
+    float var_outer_tol_input_float;
+    float var_solver_tol_input_float;
 
     cpm_pf_params_t()
     : max_displacement_input_int(400)
     , check_threshold_input_int(1)
     , cost_threshold_input_int(1880)
     , iterations_input_int(5)
+    , export_text_matches_input_int(0)
+    , export_cpm_flow_input_int(0)
+    , preview_every_input_int(1)
+    , preview_scale_input_int(1)
+    , pack_flow_codec_input_int(-1)
     , lambda_XY_input_float(0)
     , delta_XY_input_float(0.02)
     , alpha_XY_input_float(2)
+    , interpolation_T_input_int(2)
+    , iterations_T_input_int(1)
+    , lambda_T_input_float(0)
+    , delta_photo_input_float(0.3)
+    , delta_grad_input_float(1.0)
+    , alpha_photo_input_float(2)
+    , alpha_grad_input_float(2)
+    , var_refine_input_int(VAR_REFINE_XY | VAR_REFINE_XYT)
+    , var_alpha_input_float(1.0)
+    , var_gamma_input_float(0.71)
+    , var_delta_input_float(0)
+    , var_sigma_input_float(1.0)
+    , var_niter_outer_input_int(5)
+    , var_niter_inner_input_int(1)
+    , var_niter_solver_input_int(30)
+    , var_sor_omega_input_float(1.9)
+    , var_sor_redblack_input_int(0)
+    , var_nlevels_input_int(1)
+    , var_outer_tol_input_float(0)
+    , var_solver_tol_input_float(0)
     {
+        const int level_niter_outer[3] = {3, 3, 5}, level_niter_inner[3] = {1, 1, 1}, level_niter_solver[3] = {15, 20, 30};
+        for (int l = 0; l < 3; l++) {
+            var_level_niter_outer_input_int[l] = level_niter_outer[l];
+            var_level_niter_inner_input_int[l] = level_niter_inner[l];
+            var_level_niter_solver_input_int[l] = level_niter_solver[l];
+        }
     }
 };
 
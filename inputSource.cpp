@@ -0,0 +1,74 @@
+// inputSource.cpp
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sstream>
+
+#include "inputSource.h"
+
+InputSource* InputSource::Open(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG) {
+        VideoSource *video = new VideoSource(path);
+        if (!video->IsOpened()) {
+            fprintf(stderr, "InputSource: cannot open the video %s\n", path.c_str());
+            delete video;
+            return NULL;
+        }
+        return video;
+    }
+    return new FolderSource(path);
+}
+
+FolderSource::FolderSource(const std::string &folder)
+{
+    cv::glob(folder, names_);
+}
+
+bool FolderSource::Read(int k, cv::Mat &frame)
+{
+    if (k >= (int)names_.size())
+        return false;
+    frame = cv::imread(names_[k]);
+    return true;
+}
+
+VideoSource::VideoSource(const std::string &filename)
+    : filename_(filename)
+    , capture_(filename)
+    , position_(0)
+{
+}
+
+std::string VideoSource::Name(int k) const
+{
+    std::ostringstream name_builder;
+    name_builder << filename_ << " frame " << k;
+    return name_builder.str();
+}
+
+bool VideoSource::Read(int k, cv::Mat &frame)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    frame = cv::Mat();
+    if (k < position_) {
+        capture_.release();
+        if (!capture_.open(filename_)) {
+            fprintf(stderr, "VideoSource: cannot reopen %s\n", filename_.c_str());
+            return false;
+        }
+        position_ = 0;
+    }
+    for (; position_ < k; position_++) {
+        if (!capture_.grab())
+            return false;   // the stream ends before frame k
+    }
+    cv::Mat decoded;
+    if (!capture_.read(decoded))
+        return false;
+    position_++;
+    // the decoded frame may be reused by the capture
+    frame = decoded.clone();
+    return true;
+}
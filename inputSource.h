@@ -0,0 +1,70 @@
+// inputSource.h
+//
+// the input frames of a sequence, numbered from 0: the images of a folder in the cv::glob
+// order, or the frames of a video file decoded straight from the container, so that a
+// video does not have to be extracted to images first. The length of a sequence is only
+// known once its end is read: the frame count of a container is an estimate at best
+
+#ifndef INPUT_SOURCE_H
+#define INPUT_SOURCE_H
+
+#include <climits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+class InputSource
+{
+public:
+    virtual ~InputSource() {}
+
+    // a video source when path is a file, a folder one otherwise, NULL with a message on stderr on error
+    static InputSource* Open(const std::string &path);
+
+    // name of frame k in the messages
+    virtual std::string Name(int k) const = 0;
+
+    // decode frame k as 8-bit BGR, left empty when it cannot be decoded; false past the end of the sequence
+    virtual bool Read(int k, cv::Mat &frame) = 0;
+
+    // how many Read calls can run at once
+    virtual int MaxReaders() const = 0;
+};
+
+// the images of a folder, decoded independently
+class FolderSource : public InputSource
+{
+public:
+    explicit FolderSource(const std::string &folder);
+
+    std::string Name(int k) const { return names_[k]; }
+    bool Read(int k, cv::Mat &frame);
+    int MaxReaders() const { return INT_MAX; }
+
+private:
+    std::vector<cv::String> names_;
+};
+
+// the frames of a video, decoded in order until the stream ends: frame k is the k-th frame read
+// from the start, a jump forward skips the frames in between without seeking and a jump back
+// reopens the file, since seeking in compressed streams is not frame accurate with every backend
+class VideoSource : public InputSource
+{
+public:
+    explicit VideoSource(const std::string &filename);
+
+    bool IsOpened() const { return capture_.isOpened(); }
+    std::string Name(int k) const;
+    bool Read(int k, cv::Mat &frame);
+    int MaxReaders() const { return 1; }
+
+private:
+    std::string filename_;
+    std::mutex mutex_;
+    cv::VideoCapture capture_;
+    int position_;  // index of the next frame of the stream
+};
+
+#endif
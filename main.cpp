@@ -3,11 +3,21 @@
 #include "CPM_Tip2017Mod/OpticFlowIO.h"
 #include "PFilter/PermeabilityFilter.h"
 #include "flowIO.h"
+#include "asyncWriter.h"
+#include "framePrefetcher.h"
+#include "inputSource.h"
 extern "C" {
 #include "PFilter/variational/variational.h"
 #include "PFilter/variational/io.h"
+#include "PFilter/variational/flow_io.h"
+#include "PFilter/variational/flow_archive.h"
 }
 
+// bound of the output buffers waiting for the writer thread
+#define OUTPUT_QUEUE_BYTES ((size_t)512 << 20)
+// default input decoders and how many frames they decode ahead of the matching
+#define PREFETCH_THREADS 2
+#define PREFETCH_LOOKAHEAD 4
 
 // draw each match as a 3x3 color block
 void Match2Flow(FImage& inMat, FImage& ou, FImage& ov, int w, int h)
@@ -84,31 +94,133 @@ void FImage2image_t(FImage mu, image_t* wx) {
 }
 
 void Mat2f2image_t_uv(Mat2f flow, image_t* wx, image_t* wy) {
-    vector<Mat1f> flow_ch1_vec;
-    split(flow, flow_ch1_vec);
+    for (int y = 0; y < flow.rows; ++y)
+        flow_deinterleave(wx->data + y * wx->stride, wy->data + y * wy->stride, flow.ptr<float>(y), flow.cols);
+}
 
-    Mat1f u_flow_ch1 = flow_ch1_vec[0];
-    Mat1f v_flow_ch1 = flow_ch1_vec[1];
+// color image of the var part from a decoded BGR frame, c1 c2 c3 are R G B in [0,255] like color_image_load
+color_image_t *Mat2color_image_t(const Mat &frame)
+{
+    color_image_t *image = color_image_new(frame.cols, frame.rows);
+    for (int y = 0; y < frame.rows; ++y) {
+        const unsigned char *bgr = frame.ptr<unsigned char>(y);
+        float *r = image->c1 + y * image->stride, *g = image->c2 + y * image->stride, *b = image->c3 + y * image->stride;
+        for (int x = 0; x < frame.cols; ++x) {
+            b[x] = bgr[3 * x];
+            g[x] = bgr[3 * x + 1];
+            r[x] = bgr[3 * x + 2];
+        }
+    }
+    return image;
+}
 
+// a flow written by the PF part, from image image_index to image_index + 1
+struct FlowManifestEntry
+{
+    string name;        // file name without folder and extension, also used for the refined flow
+    string ext;         // extension of the file written, .flo or .cflo
+    int image_index;
+    bool is_xyt;
+    Mat2f flow;         // the flow itself when it is kept in memory: the XY flows, and the XYT ones with -disparity
+};
+
+// name of the flow of frame k (the one from image k - 1 to image k), e.g. 0003_XYT
+string FlowName(int k, const char *suffix)
+{
+    ostringstream name_builder;
+    name_builder << setw(4) << setfill('0') << k << suffix;
+    return name_builder.str();
+}
 
-    //memcpy(wx->data, u_flow_ch1.data, u_flow_ch1.total());
-    //memcpy(wy->data, v_flow_ch1.data, v_flow_ch1.total());
+// name of the CPM matches from image k to image l, e.g. 0003_0002
+string PairName(int k, int l)
+{
+    ostringstream name_builder;
+    name_builder << setw(4) << setfill('0') << k << '_' << setw(4) << setfill('0') << l;
+    return name_builder.str();
+}
 
+// extension of the intermediate flows (the CPM matches and the XY flows), .cflo when they are packed
+const char *IntermediateFlowExt(const cpm_pf_params_t &cpm_pf_params)
+{
+    return cpm_pf_params.pack_flow_codec_input_int < 0 ? ".flo" : ".cflo";
+}
 
-    for (size_t y = 0; y < u_flow_ch1.rows; ++y) {
-        for (size_t x = 0; x < u_flow_ch1.cols; ++x) {
-    //for (size_t y = 0; y < 4; ++y) {
-        //for (size_t x = 0; x < 4; ++x) {
-            wx->data[y * wx->stride + x] = u_flow_ch1(y, x);
-            wy->data[y * wy->stride + x] = v_flow_ch1(y, x);
-            //cout<<"y is "<< y <<endl;
-            //cout<<"x is "<< x <<endl;
-            //cout<<"stride is "<<wx->stride<<endl;
-            //cout<<"y * wx->stride + x is "<<y * wx->stride + x<<endl;
-            //cout<<"wx->data[y * wx->stride + x] is "<< wx->data[y * wx->stride + x] <<endl;
-            //cout<<"u_flow_ch1(y,x) is "<< u_flow_ch1(y, x) <<endl;
+// queue the horizontal component of a flow for writing as a .pfm disparity
+void WriteDisparityAsync(AsyncWriter &writer, Mat2f flow, const string &filename)
+{
+    size_t bytes = flow.total() * flow.elemSize();
+    writer.Push([=]() {
+        vector<Mat1f> uv;
+        split(flow, uv);
+        WriteFilePFM(uv[0], filename, 1);
+    }, bytes);
+}
+
+// variational refinement parameters from the command line ones
+void SetVariationalParams(const cpm_pf_params_t &cpm_pf_params, variational_params_t *var_params)
+{
+    variational_params_default(var_params);
+    var_params->alpha = cpm_pf_params.var_alpha_input_float;
+    var_params->gamma = cpm_pf_params.var_gamma_input_float;
+    var_params->delta = cpm_pf_params.var_delta_input_float;
+    var_params->sigma = cpm_pf_params.var_sigma_input_float;
+    var_params->niter_outer = cpm_pf_params.var_niter_outer_input_int;
+    var_params->niter_inner = cpm_pf_params.var_niter_inner_input_int;
+    var_params->niter_solver = cpm_pf_params.var_niter_solver_input_int;
+    var_params->sor_omega = cpm_pf_params.var_sor_omega_input_float;
+    var_params->sor_redblack = cpm_pf_params.var_sor_redblack_input_int;
+    var_params->nlevels = cpm_pf_params.var_nlevels_input_int;
+    for (int l = 0; l < VARIATIONAL_MAX_LEVELS; l++) {
+        var_params->levels[l].niter_outer = cpm_pf_params.var_level_niter_outer_input_int[l];
+        var_params->levels[l].niter_inner = cpm_pf_params.var_level_niter_inner_input_int[l];
+        var_params->levels[l].niter_solver = cpm_pf_params.var_level_niter_solver_input_int[l];
+    }
+    var_params->outer_tol = cpm_pf_params.var_outer_tol_input_float;
+    var_params->solver_tol = cpm_pf_params.var_solver_tol_input_float;
+}
+
+// mean (returned) and max endpoint difference between two flows
+double MeanEndpointDifference(const Mat2f& flow_a, const Mat2f& flow_b, double& max_difference)
+{
+    double sum = 0;
+    max_difference = 0;
+    for (int y = 0; y < flow_a.rows; y++) {
+        for (int x = 0; x < flow_a.cols; x++) {
+            Vec2f d = flow_a(y, x) - flow_b(y, x);
+            double epe = sqrt((double)d[0] * d[0] + (double)d[1] * d[1]);
+            sum += epe;
+            max_difference = max(max_difference, epe);
         }
     }
+    return sum / max(1, flow_a.rows * flow_a.cols);
+}
+
+// Runs filterT on the same inputs with cubic and with bilinear warps, prints the time of both and the
+// endpoint difference of the XYT flows, and adds them to the running totals
+void BenchmarkTemporalInterpolation(Mat3f It1, Mat3f It0, Mat2f It1_XY, Mat2f It0_XY, Mat2f flow_prev_XYT,
+                                    Mat2f l_prev, Mat2f l_normal_prev, cpm_pf_params_t cpm_pf_params, int frame,
+                                    double& total_cubic_ms, double& total_linear_ms, double& total_epe, double& max_epe)
+{
+    vector<Mat2f> results[2];
+    double elapsed_ms[2];
+    int modes[2] = { cv::INTER_CUBIC, cv::INTER_LINEAR };
+    for (int m = 0; m < 2; m++) {
+        cpm_pf_params.interpolation_T_input_int = modes[m];
+        int64 start = getTickCount();
+        results[m] = filterT<Vec3f, Vec2f>(It1, It0, It1_XY, It0_XY, It1_XY, flow_prev_XYT, l_prev, l_normal_prev, cpm_pf_params);
+        elapsed_ms[m] = (getTickCount() - start) * 1000. / getTickFrequency();
+    }
+
+    double frame_max_epe;
+    double frame_epe = MeanEndpointDifference(results[0][2], results[1][2], frame_max_epe);
+    printf("temporal filter frame %d: cubic %.2f ms, linear %.2f ms, mean EPE %.5f px, max EPE %.5f px\n",
+           frame, elapsed_ms[0], elapsed_ms[1], frame_epe, frame_max_epe);
+
+    total_cubic_ms += elapsed_ms[0];
+    total_linear_ms += elapsed_ms[1];
+    total_epe += frame_epe;
+    max_epe = max(max_epe, frame_max_epe);
 }
 
 void Usage()
@@ -118,35 +230,78 @@ void Usage()
         << endl
         << "Usage:" << endl
         << "  ./CPMPF <input_image_folder> <CPM_match_folder> <CPMPF_flow_folder> <refined_CPMPF_flow_folder> [options]" << endl
+        << "  <input_image_folder> can also be a video file, whose frames are decoded straight from the container" << endl
         << "options:" << endl
         << "    -h help                                     print this message" << endl
         << "  CPM parameters:" << endl
         << "    -m, -max                                    outlier handling maxdisplacement threshold" << endl
         << "    -t, -th                                     froward and backward consistency threshold" << endl
         << "    -c, -cth                                    matching cost check threshold" <<endl
+        << "    -txtmatches                                 also export the matches as text, x1 y1 x2 y2 per line" << endl
+        << "    -cpmflow                                    also export the CPM matches as dense flows with .png previews" << endl
+        << "    -preview <n>                                -cpmflow .png preview of every n-th frame only, 0 for none (default 1)" << endl
+        << "    -previewscale <k>                           -cpmflow previews at 1/k of the resolution (default 1)" << endl
+        << "    -packflow <none|f32|f16|q16>                store the exported CPM flows and the XY flows in compressed .cflo files," << endl
+        << "                                                lossless (f32), as half floats (f16) or in 1/16 px steps (q16), default none" << endl
+        << "    -archive <file>                             append the flows and the matches to a single sequence archive instead of" << endl
+        << "                                                one file per frame in the folders, which keep only the -cpmflow .png previews" << endl
+        << "    -prefetch <n>                               threads decoding the input frames ahead of the matching (default 2)" << endl
+        << "    -lookahead <n>                              frames decoded ahead of the one matched (default 4)" << endl
         << "  PF parameters:" << endl
         << "    -i, -iter                                   number of iterantions for spatial permeability filter" << endl
         << "    -l, -lambda                                 lambda para for spatial permeability filter" << endl
         << "    -d, -delta                                  delta para for spatial permeability filter" << endl
         << "    -a, -alpha                                  alpha para for spatial permeability filter" << endl
+        << "    -it, -iterT                                 number of iterations for temporal permeability filter" << endl
+        << "    -lt, -lambdaT                               lambda para for temporal permeability filter" << endl
+        << "    -dp, -deltaphoto                            photometric delta para for temporal permeability filter" << endl
+        << "    -dg, -deltagrad                             flow gradient delta para for temporal permeability filter" << endl
+        << "    -ap, -alphaphoto                            photometric alpha para for temporal permeability filter" << endl
+        << "    -ag, -alphagrad                             flow gradient alpha para for temporal permeability filter" << endl
+        << "    -interp <cubic|linear>                      interpolation of the temporal filter warps (default cubic)" << endl
+        << "    -tbench                                     benchmark cubic against linear temporal warps on every frame" << endl
+        << "  variational refinement parameters:" << endl
+        << "    -va, -varalpha                              smoothness weight" << endl
+        << "    -vg, -vargamma                              gradient constancy assumption weight" << endl
+        << "    -vd, -vardelta                              color constancy assumption weight" << endl
+        << "    -vs, -varsigma                              presmoothing of the images" << endl
+        << "    -vo, -varouter                              number of outer fixed point iterations" << endl
+        << "    -vi, -varinner                              number of inner fixed point iterations" << endl
+        << "    -vn, -varsolver                             number of solver iterations" << endl
+        << "    -vw, -varomega                              omega parameter of the sor solver" << endl
+        << "    -vrb, -varredblack                          use the parallel red-black sor solver" << endl
+        << "    -vl, -varlevels                             number of pyramid levels (1 to 3), 1 refines at full resolution only" << endl
+        << "    -vsched <level> <outer> <inner> <solver>    iterations of a pyramid level when -vl > 1, level 0 is the full resolution" << endl
+        << "    -vot, -varoutertol                          end the outer iterations once the rms flow increment is below (0 disables)" << endl
+        << "    -vst, -varsolvertol                         end the solver once the rms change of a sweep is below (0 disables)" << endl
+        << "    -refine <xy|xyt|both|none>                  flows passed to the variational refinement (default both)" << endl
+        << "    -disparity                                  stereo and light field runs: write the horizontal flow of the results as .pfm" << endl
+        << "                                                disparities, the XY and XYT flows stay in memory instead of being written" << endl
+        << "    -novar                                      skip the variational refinement, same as -refine none" << endl
         << "  predefined parameters:" << endl
         << "    -sintel                                     set the parameters to the one optimized on (a subset of) the MPI-Sintel dataset" << endl
         << "    -hcilf                                      set the parameters to the one optimized on (a subset of) the HCI light field dataset" << endl
+        << "    -fast                                       fast variational refinement: 3 level pyramid, red-black solver and early stopping" << endl
+        << "    -quality                                    thorough variational refinement: full iterations on each level of a 3 level pyramid" << endl
         << endl;
 }
 
-void run_CPM(FImage img1, FImage img2, int seq_num_of_img1, bool is_forward_matching, cpm_pf_params_t &cpm_pf_params, string output_matches_folder)
+// the sparse matches are returned for the PF part, and written to a .match file; the dense flow
+// and its preview are only exported on request
+std::shared_ptr<FImage> run_CPM(FImage img1, FImage img2, int seq_num_of_img1, bool is_forward_matching, cpm_pf_params_t &cpm_pf_params,
+                                string output_matches_folder, AsyncWriter &writer, flow_archive_t *archive)
 {
     int step = 3;
     int w = img1.width();
     int h = img1.height();
 
     CTimer totalT;
-    FImage matches;
+    // the outputs are handed over to the writer, which releases them once written
+    std::shared_ptr<FImage> matches(new FImage), costs(new FImage), u, v;
 
     CPM cpm(cpm_pf_params);
     cpm.SetStep(step);
-    cpm.Matching(img1, img2, matches);
+    cpm.Matching(img1, img2, *matches, costs.get());
 
     totalT.toc("CPM total time: ");
 
@@ -154,33 +309,85 @@ void run_CPM(FImage img1, FImage img2, int seq_num_of_img1, bool is_forward_matc
     //char tmpName[256];
 
     ostringstream cpm_matches_name_builder;
-    if ( is_forward_matching ) {
-        cpm_matches_name_builder << setw(4) << setfill('0') << seq_num_of_img1 << '_' << setw(4) << setfill('0') << seq_num_of_img1 + 1;
-    }
-    else {
-        cpm_matches_name_builder << setw(4) << setfill('0') << seq_num_of_img1 << '_' << setw(4) << setfill('0') << seq_num_of_img1 - 1;
-    }
+    cpm_matches_name_builder << PairName(seq_num_of_img1, is_forward_matching ? seq_num_of_img1 + 1 : seq_num_of_img1 - 1);
+    int direction = is_forward_matching ? FLOW_FORWARD : FLOW_BACKWARD;
 
-    ostringstream cpm_matches_name_flo_builder, cpm_matches_name_png_builder, cpm_matches_name_txt_builder;
-    cpm_matches_name_flo_builder << output_matches_folder << cpm_matches_name_builder.str() << ".flo";
+    ostringstream cpm_matches_name_flo_builder, cpm_matches_name_png_builder, cpm_matches_name_match_builder, cpm_matches_name_txt_builder;
+    cpm_matches_name_flo_builder << output_matches_folder << cpm_matches_name_builder.str() << IntermediateFlowExt(cpm_pf_params);
     cpm_matches_name_png_builder << output_matches_folder << cpm_matches_name_builder.str() << ".png";
+    cpm_matches_name_match_builder << output_matches_folder << cpm_matches_name_builder.str() << ".match";
     cpm_matches_name_txt_builder << output_matches_folder << cpm_matches_name_builder.str() << ".txt";
     string cpm_matches_name_flo = cpm_matches_name_flo_builder.str();
     string cpm_matches_name_png = cpm_matches_name_png_builder.str();
+    string cpm_matches_name_match = cpm_matches_name_match_builder.str();
     string cpm_matches_name_txt = cpm_matches_name_txt_builder.str();
+    bool export_text_matches = cpm_pf_params.export_text_matches_input_int != 0;
+    int codec = cpm_pf_params.pack_flow_codec_input_int;
+    int preview_every = cpm_pf_params.preview_every_input_int;
+    bool preview = preview_every > 0 && seq_num_of_img1 % preview_every == 0;
+    int preview_scale = cpm_pf_params.preview_scale_input_int;
+
+    size_t bytes = sizeof(float) * (matches->nelements() + costs->nelements());
+    if (cpm_pf_params.export_cpm_flow_input_int) {
+        u.reset(new FImage);
+        v.reset(new FImage);
+        Match2Flow(*matches, *u, *v, w, h);
+        bytes += sizeof(float) * (u->nelements() + v->nelements());
+    }
+    writer.Push([=]() {
+        if (archive)
+            flow_archive_put_matches(archive, seq_num_of_img1, direction, matches->pData, matches->height(), costs->pData, w, h);
+        else
+            match_write(cpm_matches_name_match.c_str(), matches->pData, matches->height(), costs->pData, w, h);
+        if (u) {
+            if (archive)
+                flow_archive_put_flow_planar(archive, seq_num_of_img1, direction, FLOW_STAGE_CPM, u->pData, v->pData, w, h, w, codec);
+            else
+                OpticFlowIO::WriteFlowFile(u->pData, v->pData, w, h, cpm_matches_name_flo.c_str(), codec);
+            if (preview)
+                OpticFlowIO::SaveFlowAsImage(cpm_matches_name_png.c_str(), u->pData, v->pData, w, h, -1, preview_scale);
+        }
+        if (export_text_matches)
+            WriteMatches(cpm_matches_name_txt.c_str(), *matches);
+    }, bytes);
+    return matches;
 
-    FImage u, v;
-    Match2Flow(matches, u, v, w, h);
-    OpticFlowIO::WriteFlowFile(u.pData, v.pData, w, h, cpm_matches_name_flo.c_str());
-    OpticFlowIO::SaveFlowAsImage(cpm_matches_name_png.c_str(), u.pData, v.pData, w, h);
-    WriteMatches(cpm_matches_name_txt.c_str(), matches);
 
+}
 
-    //vector<FImage> output_vec;
-    //output_vec.push_back(u);
-    //output_vec.push_back(v);
+// the matches x1 y1 x2 y2 of run_CPM as rows of a Mat1f, without copy
+Mat1f MatchesMat(FImage &matches)
+{
+    return Mat1f(matches.height(), 4, matches.pData);
+}
 
-    //return output_vec;
+// queue a flow of frame for writing, to the archive when there is one, to filename otherwise;
+// the writer keeps a reference to its data instead of a copy
+void WriteFlowAsync(AsyncWriter &writer, flow_archive_t *archive, Mat2f flow, const string &filename, int frame, int stage, int codec = -1)
+{
+    size_t bytes = flow.total() * flow.elemSize();
+    writer.Push([=]() mutable {
+        if (archive)
+            WriteFlowArchive(flow, archive, frame, FLOW_FORWARD, stage, codec);
+        else
+            WriteFlowFile(flow, filename.c_str(), codec);
+    }, bytes);
+}
+
+// read a flow back, from the archive when there is one, from filename otherwise
+bool ReadFlow(Mat2f &flow, flow_archive_t *archive, const string &filename, int frame, int direction, int stage)
+{
+    if (archive)
+        return ReadFlowArchive(flow, archive, frame, direction, stage) != 0;
+    return ReadFlowFile(flow, filename.c_str()) != 0;
+}
+
+// wait for the outputs, then write the index of the archive
+void FinishOutputs(AsyncWriter &writer, flow_archive_t *archive)
+{
+    writer.Flush();
+    if (archive)
+        flow_archive_close(archive);
 }
 
 //void run_PF(Mat3f target_img, Mat2f flow_forward, Mat2f flow_backward)
@@ -199,7 +406,7 @@ int main(int argc, char** argv)
 	}
 
     // load inputs
-    char* input_images_folder = argv[1];
+    char* input_images_folder = argv[1];   // or a video file
     char* CPM_matches_folder = argv[2];
     //char* refined_CPM_matches_folder = argv[3];
     char* CPMPF_flows_folder = argv[3];
@@ -211,6 +418,11 @@ int main(int argc, char** argv)
     // prepare variables
     cpm_pf_params_t params;
     cpm_pf_params_t &cpm_pf_params = params;
+    bool benchmark_temporal = false;
+    bool disparity_output = false;
+    const char* archive_filename = NULL;
+    int prefetch_threads = PREFETCH_THREADS;
+    int prefetch_lookahead = PREFETCH_LOOKAHEAD;
 
     // load options
     #define isarg(key)  !strcmp(a,key)
@@ -233,6 +445,117 @@ int main(int argc, char** argv)
             cpm_pf_params.delta_XY_input_float = atof(argv[current_arg++]);
         else if( isarg("-a") || isarg("-alpha") )
             cpm_pf_params.alpha_XY_input_float = atof(argv[current_arg++]);
+        else if( isarg("-it") || isarg("-iterT") )
+            cpm_pf_params.iterations_T_input_int = atoi(argv[current_arg++]);
+        else if( isarg("-lt") || isarg("-lambdaT") )
+            cpm_pf_params.lambda_T_input_float = atof(argv[current_arg++]);
+        else if( isarg("-dp") || isarg("-deltaphoto") )
+            cpm_pf_params.delta_photo_input_float = atof(argv[current_arg++]);
+        else if( isarg("-dg") || isarg("-deltagrad") )
+            cpm_pf_params.delta_grad_input_float = atof(argv[current_arg++]);
+        else if( isarg("-ap") || isarg("-alphaphoto") )
+            cpm_pf_params.alpha_photo_input_float = atof(argv[current_arg++]);
+        else if( isarg("-ag") || isarg("-alphagrad") )
+            cpm_pf_params.alpha_grad_input_float = atof(argv[current_arg++]);
+        else if( isarg("-interp") ) {
+            const char* mode = argv[current_arg++];
+            if( !strcmp(mode, "cubic") )
+                cpm_pf_params.interpolation_T_input_int = cv::INTER_CUBIC;
+            else if( !strcmp(mode, "linear") )
+                cpm_pf_params.interpolation_T_input_int = cv::INTER_LINEAR;
+            else {
+                fprintf(stderr, "unknown interpolation %s\n", mode);
+                Usage();
+                exit(1);
+            }
+        }
+        else if( isarg("-packflow") ) {
+            const char* codec = argv[current_arg++];
+            if( !strcmp(codec, "none") )
+                cpm_pf_params.pack_flow_codec_input_int = -1;
+            else if( !strcmp(codec, "f32") )
+                cpm_pf_params.pack_flow_codec_input_int = FLOW_CODEC_FLOAT32;
+            else if( !strcmp(codec, "f16") )
+                cpm_pf_params.pack_flow_codec_input_int = FLOW_CODEC_FLOAT16;
+            else if( !strcmp(codec, "q16") )
+                cpm_pf_params.pack_flow_codec_input_int = FLOW_CODEC_FIXED16;
+            else {
+                fprintf(stderr, "unknown flow packing %s\n", codec);
+                Usage();
+                exit(1);
+            }
+        }
+        else if( isarg("-archive") )
+            archive_filename = argv[current_arg++];
+        else if( isarg("-prefetch") )
+            prefetch_threads = std::max(atoi(argv[current_arg++]), 1);
+        else if( isarg("-lookahead") )
+            prefetch_lookahead = std::max(atoi(argv[current_arg++]), 1);
+        else if( isarg("-cpmflow") )
+            cpm_pf_params.export_cpm_flow_input_int = 1;
+        else if( isarg("-preview") )
+            cpm_pf_params.preview_every_input_int = std::max(atoi(argv[current_arg++]), 0);
+        else if( isarg("-previewscale") )
+            cpm_pf_params.preview_scale_input_int = std::max(atoi(argv[current_arg++]), 1);
+        else if( isarg("-txtmatches") )
+            cpm_pf_params.export_text_matches_input_int = 1;
+        else if( isarg("-tbench") )
+            benchmark_temporal = true;
+        else if( isarg("-disparity") )
+            disparity_output = true;
+        else if( isarg("-va") || isarg("-varalpha") )
+            cpm_pf_params.var_alpha_input_float = atof(argv[current_arg++]);
+        else if( isarg("-vg") || isarg("-vargamma") )
+            cpm_pf_params.var_gamma_input_float = atof(argv[current_arg++]);
+        else if( isarg("-vd") || isarg("-vardelta") )
+            cpm_pf_params.var_delta_input_float = atof(argv[current_arg++]);
+        else if( isarg("-vs") || isarg("-varsigma") )
+            cpm_pf_params.var_sigma_input_float = atof(argv[current_arg++]);
+        else if( isarg("-vo") || isarg("-varouter") )
+            cpm_pf_params.var_niter_outer_input_int = atoi(argv[current_arg++]);
+        else if( isarg("-vi") || isarg("-varinner") )
+            cpm_pf_params.var_niter_inner_input_int = atoi(argv[current_arg++]);
+        else if( isarg("-vn") || isarg("-varsolver") )
+            cpm_pf_params.var_niter_solver_input_int = atoi(argv[current_arg++]);
+        else if( isarg("-vw") || isarg("-varomega") )
+            cpm_pf_params.var_sor_omega_input_float = atof(argv[current_arg++]);
+        else if( isarg("-vrb") || isarg("-varredblack") )
+            cpm_pf_params.var_sor_redblack_input_int = 1;
+        else if( isarg("-vl") || isarg("-varlevels") )
+            cpm_pf_params.var_nlevels_input_int = atoi(argv[current_arg++]);
+        else if( isarg("-vsched") ) {
+            int level = atoi(argv[current_arg++]);
+            if( level < 0 || level >= VARIATIONAL_MAX_LEVELS ) {
+                fprintf(stderr, "pyramid level %d out of range\n", level);
+                Usage();
+                exit(1);
+            }
+            cpm_pf_params.var_level_niter_outer_input_int[level] = atoi(argv[current_arg++]);
+            cpm_pf_params.var_level_niter_inner_input_int[level] = atoi(argv[current_arg++]);
+            cpm_pf_params.var_level_niter_solver_input_int[level] = atoi(argv[current_arg++]);
+        }
+        else if( isarg("-vot") || isarg("-varoutertol") )
+            cpm_pf_params.var_outer_tol_input_float = atof(argv[current_arg++]);
+        else if( isarg("-vst") || isarg("-varsolvertol") )
+            cpm_pf_params.var_solver_tol_input_float = atof(argv[current_arg++]);
+        else if( isarg("-novar") )
+            cpm_pf_params.var_refine_input_int = 0;
+        else if( isarg("-refine") ) {
+            const char* flows = argv[current_arg++];
+            if( !strcmp(flows, "xy") )
+                cpm_pf_params.var_refine_input_int = VAR_REFINE_XY;
+            else if( !strcmp(flows, "xyt") )
+                cpm_pf_params.var_refine_input_int = VAR_REFINE_XYT;
+            else if( !strcmp(flows, "both") )
+                cpm_pf_params.var_refine_input_int = VAR_REFINE_XY | VAR_REFINE_XYT;
+            else if( !strcmp(flows, "none") )
+                cpm_pf_params.var_refine_input_int = 0;
+            else {
+                fprintf(stderr, "unknown refined flows %s\n", flows);
+                Usage();
+                exit(1);
+            }
+        }
         else if( isarg("-sintel") ) {
             cpm_pf_params.max_displacement_input_int = 400;
             cpm_pf_params.check_threshold_input_int = 1;
@@ -251,40 +574,77 @@ int main(int argc, char** argv)
             cpm_pf_params.delta_XY_input_float = 0.017;
             cpm_pf_params.alpha_XY_input_float = 2;
         }
+        else if( isarg("-fast") ) {
+            cpm_pf_params.var_sor_redblack_input_int = 1;
+            cpm_pf_params.var_nlevels_input_int = 3;
+            const int level_niter_outer[3] = {3, 3, 5}, level_niter_solver[3] = {15, 20, 30};
+            for (int l = 0; l < 3; l++) {
+                cpm_pf_params.var_level_niter_outer_input_int[l] = level_niter_outer[l];
+                cpm_pf_params.var_level_niter_inner_input_int[l] = 1;
+                cpm_pf_params.var_level_niter_solver_input_int[l] = level_niter_solver[l];
+            }
+            cpm_pf_params.var_outer_tol_input_float = 0.02;
+            cpm_pf_params.var_solver_tol_input_float = 0.003;
+        }
+        else if( isarg("-quality") ) {
+            cpm_pf_params.var_sor_redblack_input_int = 0;
+            cpm_pf_params.var_nlevels_input_int = 3;
+            for (int l = 0; l < 3; l++) {
+                cpm_pf_params.var_level_niter_outer_input_int[l] = 5;
+                cpm_pf_params.var_level_niter_inner_input_int[l] = 1;
+                cpm_pf_params.var_level_niter_solver_input_int[l] = 30;
+            }
+            cpm_pf_params.var_outer_tol_input_float = 0;
+            cpm_pf_params.var_solver_tol_input_float = 0;
+        }
         else {
-            fprintf(stderr, "unknown argument %s", a);
+            fprintf(stderr, "unknown argument %s\n", a);
             Usage();
             exit(1);
         }
     }
 
     // perpare inputs/outputs folders
-    String input_images_folder_string = input_images_folder;
     String CPM_matches_folder_string = CPM_matches_folder;
     String CPMPF_flows_folder_string = CPMPF_flows_folder;
     String refined_CPMPF_flow_folder_string = refined_CPMPF_flow_folder;
 
-    vector<String> input_images_name_vec;
-    glob(input_images_folder_string, input_images_name_vec);
+    std::unique_ptr<InputSource> input_source(InputSource::Open(input_images_folder));
+    if (!input_source)
+        exit(1);
 
-    // preapre inputs/outputs for CPM part and var part
-    vector<FImage> cpm_input_images_vec;
-    for (size_t i = 0; i < input_images_name_vec.size(); i++) {
-        FImage tmp_img;
-        tmp_img.imread(input_images_name_vec[i].c_str());
-        if ( tmp_img.IsEmpty() ) {
-            cout << input_images_name_vec[i] << " is invalid!" << endl;
-            continue;
-        }
-        cpm_input_images_vec.push_back( tmp_img );
+    // the input frames are decoded in the background ahead of the matching, each one once for the three parts;
+    // the frames of a video are decoded in order, by a single thread
+    FramePrefetcher prefetcher([&](int k, Mat &frame) { return input_source->Read(k, frame); },
+                               std::min(prefetch_threads, input_source->MaxReaders()), prefetch_lookahead);
+
+    // the outputs are written in the background while the next frames are computed
+    AsyncWriter writer(OUTPUT_QUEUE_BYTES);
+    flow_archive_t archive_storage;
+    flow_archive_t *archive = NULL;
+    if (archive_filename) {
+        if (flow_archive_open(&archive_storage, archive_filename, 1) != 0)
+            exit(1);
+        archive = &archive_storage;
     }
 
+    // run CPM part and var part, the forward and backward matches of each pair stay in memory for the PF part
+    vector<std::shared_ptr<FImage> > cpm_matches_vec;
+    vector<Mat> input_frames_vec;  // the valid frames, decoded
+    Mat frame;
+    for (int k = 0; prefetcher.Get(k, frame); ++k) {
+        if ( frame.empty() ) {
+            cout << input_source->Name(k) << " is invalid!" << endl;
+            continue;
+        }
+        input_frames_vec.push_back(frame);
+        if (input_frames_vec.size() < 2)
+            continue;
+        size_t i = input_frames_vec.size() - 2;
 
-    // run CPM part and var part
-    for (size_t i = 0; i < cpm_input_images_vec.size() - 1; ++i) {
         FImage img1, img2;
-        img1.copy(cpm_input_images_vec[i]);
-        img2.copy(cpm_input_images_vec[i+1]);
+        img1.imread(input_frames_vec[i]);
+        img2.imread(input_frames_vec[i+1]);
 
         int w = img1.width();
         int h = img1.height();
@@ -297,54 +657,38 @@ int main(int argc, char** argv)
         //img1_uv_vec = run_CPM(img1, img2, i + 1, true, cpm_pf_params, CPM_matches_folder_string);
         //img2_uv_vec = run_CPM(img2, img1, i + 2, false, cpm_pf_params, CPM_matches_folder_string);
 
-        run_CPM(img1, img2, i + 1, true, cpm_pf_params, CPM_matches_folder_string);
-        run_CPM(img2, img1, i + 2, false, cpm_pf_params, CPM_matches_folder_string);
+        cpm_matches_vec.push_back(run_CPM(img1, img2, i + 1, true, cpm_pf_params, CPM_matches_folder_string, writer, archive));
+        cpm_matches_vec.push_back(run_CPM(img2, img1, i + 2, false, cpm_pf_params, CPM_matches_folder_string, writer, archive));
+    }
+    if (input_frames_vec.size() < 2) {
+        printf("at least two valid input frames are needed!\n");
+        return -1;
     }
 
 
     // perpare inputs/outputs for PF part
     vector<Mat3f> pf_input_images_vec;
-    vector<Mat2f> pf_input_matches_vec; // same as cpm_output_matches
-
-    vector<String> pf_input_matches_name_vec;
-    glob(CPM_matches_folder_string, pf_input_matches_name_vec);
-
-    for (size_t i = 0; i < input_images_name_vec.size(); i++) {
-        Mat tmp_img = imread(input_images_name_vec[i]);
-        if ( tmp_img.empty() ) {
-            cout << input_images_name_vec[i] << " is invalid!" << endl;
-            continue;
-        }
 
+    for (size_t i = 0; i < input_frames_vec.size(); i++) {
         Mat3f tmp_img3f;
-        tmp_img.convertTo(tmp_img3f, CV_32F, 1/255.);
-        pf_input_images_vec.push_back( tmp_img3f.clone() );
-    }
-
-    for (size_t i = 0; i < pf_input_matches_name_vec.size(); i++) {
-        Mat2f tmp_flo;
-        string tmp_flo_name = pf_input_matches_name_vec[i];
-        const char* tmp_flo_name_char = tmp_flo_name.c_str();
-        ReadFlowFile(tmp_flo, tmp_flo_name_char);
-        if( tmp_flo.empty() ) {
-            cout<< pf_input_matches_name_vec[i] << " is invalid!" << endl;
-            continue;
-        }
-        pf_input_matches_vec.push_back( tmp_flo.clone() );
+        input_frames_vec[i].convertTo(tmp_img3f, CV_32F, 1/255.);
+        pf_input_images_vec.push_back( tmp_img3f );
     }
 
 
-    // run PF part
+    // run PF part, every flow written is listed in the manifest read by the var part
+    vector<FlowManifestEntry> flow_manifest;
     // spatial filter
-    for (size_t i = 0; i * 2 < pf_input_matches_vec.size(); ++i) {
+    Mat1f flow_confidence;      // reused across frames
+    Mat2f confidenced_flow;
+    MatchOwners match_owners;
+    for (size_t i = 0; i * 2 < cpm_matches_vec.size(); ++i) {
         Mat3f target_img = pf_input_images_vec[i];
-        Mat2f flow_forward = pf_input_matches_vec[i * 2];
-        Mat2f flow_backward = pf_input_matches_vec[i * 2 + 1];
+        Mat1f matches_forward = MatchesMat(*cpm_matches_vec[i * 2]);
+        Mat1f matches_backward = MatchesMat(*cpm_matches_vec[i * 2 + 1]);
 
-        // compute flow confidence map
-        Mat1f flow_confidence = getFlowConfidence(flow_forward, flow_backward);
-        Mat flow_confidence_mat;
-        flow_confidence.convertTo(flow_confidence_mat, CV_32FC1);
+        // compute flow confidence map and the confidence weighted forward flow on the pixels covered by the matches
+        getFlowConfidence(matches_forward, matches_backward, target_img.rows, target_img.cols, flow_confidence, confidenced_flow, match_owners);
 
         // start of filtering flow confidence map by copy 1 channel to 2 channel
         vector<Mat1f> flow_confidence_2chs_vec;
@@ -353,7 +697,9 @@ int main(int argc, char** argv)
         Mat2f flow_confidence_2chs;
         merge(flow_confidence_2chs_vec, flow_confidence_2chs);
 
-        Mat2f flow_confidence_2chs_filtered = filterXY<Vec3f, Vec2f>(target_img, flow_confidence_2chs, cpm_pf_params);
+        // permeability maps of target_img, shared by both spatial filterings below
+        SpatialPermeability target_perm;
+        Mat2f flow_confidence_2chs_filtered = filterXY<Vec3f, Vec2f>(target_img, flow_confidence_2chs, cpm_pf_params, target_perm);
 
         vector<Mat1f> flow_confidence_2chs_filtered_vec;
         split(flow_confidence_2chs_filtered, flow_confidence_2chs_filtered_vec);
@@ -364,20 +710,11 @@ int main(int argc, char** argv)
         //end of filtering flow confidence map by copy 1 channel to 2 channel
 
 
-        // multiply initial confidence and sparse flow
-        Mat2f confidenced_flow = Mat2f::zeros(flow_confidence.rows,flow_confidence.cols);
-        for(int y = 0; y < confidenced_flow.rows; y++) {
-            for(int x = 0; x < confidenced_flow.cols; x++) {
-                for(int c = 0; c < confidenced_flow.channels(); c++) {
-                    confidenced_flow(y,x)[c] = flow_forward(y,x)[c] * flow_confidence(y,x);
-                }
-            }
-        }
         //string temp_str1 = format("00%d_confidenced_flow.flo", i);
         //WriteFlowFile(confidenced_flow, temp_str1.c_str());
 
         //filter confidenced sparse flow
-        Mat2f confidenced_flow_XY = filterXY<Vec3f, Vec2f>(target_img, confidenced_flow, cpm_pf_params);
+        Mat2f confidenced_flow_XY = filterXY<Vec3f, Vec2f>(target_img, confidenced_flow, cpm_pf_params, target_perm);
         //string temp_str2 = format("00%d_confidenced_flow_XY.flo", i);
         //WriteFlowFile(confidenced_flow_XY, temp_str2.c_str());
 
@@ -392,42 +729,36 @@ int main(int argc, char** argv)
         }
         //string temp_str3 = format("00%d_Normalized_Flow_XY.flo", i);
         ostringstream temp_str3_builder;
-        temp_str3_builder << CPMPF_flows_folder_string << setw(4) << setfill('0') << i + 1 << "_Normalized_Flow_XY.flo";
+        temp_str3_builder << CPMPF_flows_folder_string << setw(4) << setfill('0') << i + 1 << "_Normalized_Flow_XY" << IntermediateFlowExt(cpm_pf_params);
         string temp_str3 = temp_str3_builder.str();
-        WriteFlowFile(normalized_confidenced_flow_filtered, temp_str3.c_str());
+        // the XY flows stay in memory for the temporal filter, reading them back from an archive would
+        // overlap the appends of the XYT flows by the writer
+        FlowManifestEntry entry = { FlowName(i + 1, "_Normalized_Flow_XY"), IntermediateFlowExt(cpm_pf_params), (int)i, false };
+        entry.flow = normalized_confidenced_flow_filtered;
+        if (!disparity_output)
+            WriteFlowAsync(writer, archive, normalized_confidenced_flow_filtered, temp_str3, i + 1, FLOW_STAGE_XY, cpm_pf_params.pack_flow_codec_input_int);
+        flow_manifest.push_back(entry);
     }
 
-    // temporal filter
+    // temporal filter, on the XY flows kept in memory
     Mat2f l_prev = Mat2f::zeros(pf_input_images_vec[0].rows,pf_input_images_vec[0].cols);
     Mat2f l_normal_prev = Mat2f::zeros(pf_input_images_vec[0].rows,pf_input_images_vec[0].cols);
     Mat2f It0_XYT, It1_XYT;
     vector<Mat2f> It1_XYT_vector;
-    for (size_t i = 1; i * 2 < pf_input_matches_vec.size(); ++i)
+    double bench_cubic_ms = 0, bench_linear_ms = 0, bench_epe = 0, bench_max_epe = 0;
+    for (size_t i = 1; i * 2 < cpm_matches_vec.size(); ++i)
     {
         Mat3f It0 = pf_input_images_vec[i - 1];
         Mat3f It1 = pf_input_images_vec[i];
-        Mat2f It0_XY, It1_XY;
-
-        //string flowXY0_name = format("00%d_Normalized_Flow_XY.flo", i - 1);
-        ostringstream flowXY0_name_builder;
-        flowXY0_name_builder << CPMPF_flows_folder_string << setw(4) << setfill('0') << i << "_Normalized_Flow_XY.flo";
-        string flowXY0_name = flowXY0_name_builder.str();
-        ReadFlowFile(It0_XY, flowXY0_name.c_str());
-
-        //string flowXY1_name = format("00%d_Normalized_Flow_XY.flo", i);
-        ostringstream flowXY1_name_builder;
-        flowXY1_name_builder << CPMPF_flows_folder_string << setw(4) << setfill('0') << i + 1 << "_Normalized_Flow_XY.flo";
-        string flowXY1_name = flowXY1_name_builder.str();
-        ReadFlowFile(It1_XY, flowXY1_name.c_str());
-
-        if(i == 1) {
-            //printf("i==1");
-            It1_XYT_vector = filterT<Vec3f, Vec2f>(It1, It0, It1_XY, It0_XY, It1_XY, It0_XY, l_prev, l_normal_prev);
-        }
-        else {
-            //printf("i!=1");
-            It1_XYT_vector = filterT<Vec3f, Vec2f>(It1, It0, It1_XY, It0_XY, It1_XY, It0_XYT, l_prev, l_normal_prev);
+        Mat2f It0_XY = flow_manifest[i - 1].flow;
+        Mat2f It1_XY = flow_manifest[i].flow;
+
+        Mat2f flow_prev_XYT = (i == 1) ? It0_XY : It0_XYT;
+        if (benchmark_temporal) {
+            BenchmarkTemporalInterpolation(It1, It0, It1_XY, It0_XY, flow_prev_XYT, l_prev, l_normal_prev, cpm_pf_params, i + 1,
+                                           bench_cubic_ms, bench_linear_ms, bench_epe, bench_max_epe);
         }
+        It1_XYT_vector = filterT<Vec3f, Vec2f>(It1, It0, It1_XY, It0_XY, It1_XY, flow_prev_XYT, l_prev, l_normal_prev, cpm_pf_params);
 
         It1_XYT = It1_XYT_vector[2];
         l_prev = It1_XYT_vector[0];
@@ -437,88 +768,113 @@ int main(int argc, char** argv)
         ostringstream flowXYT1_name_builder;
         flowXYT1_name_builder << CPMPF_flows_folder_string << setw(4) << setfill('0') << i + 1 << "_XYT.flo";
         string flowXYT1_name = flowXYT1_name_builder.str();
-        WriteFlowFile(It1_XYT, flowXYT1_name.c_str());
+        FlowManifestEntry entry = { FlowName(i + 1, "_XYT"), ".flo", (int)i, true };
+        if (disparity_output)
+            entry.flow = It1_XYT;
+        else
+            WriteFlowAsync(writer, archive, It1_XYT, flowXYT1_name, i + 1, FLOW_STAGE_XYT);
+        flow_manifest.push_back(entry);
         It0_XYT = It1_XYT;
     }
+    if (benchmark_temporal && cpm_matches_vec.size() > 2) {
+        int frames = (cpm_matches_vec.size() - 1) / 2;
+        printf("temporal interpolation benchmark over %d frames: cubic %.2f ms/frame, linear %.2f ms/frame (%.2fx), mean EPE %.5f px, max EPE %.5f px\n",
+               frames, bench_cubic_ms / frames, bench_linear_ms / frames, bench_cubic_ms / max(bench_linear_ms, 1e-9),
+               bench_epe / frames, bench_max_epe);
+    }
 
-    //preapre inputs for var part
+    // the variational refinement is skipped, the PF flows are the results
+    if (cpm_pf_params.var_refine_input_int == 0) {
+        if (disparity_output) {
+            for (size_t i = 0; i < flow_manifest.size(); i++)
+                WriteDisparityAsync(writer, flow_manifest[i].flow, CPMPF_flows_folder_string + flow_manifest[i].name + ".pfm");
+        }
+        FinishOutputs(writer, archive);
+        return 0;
+    }
+    // it reads the XYT flows back unless they stay in memory, once the writer is done with the archive
+    writer.Flush();
+
+    //preapre inputs for var part, only the flows of the manifest selected by -refine are read
     vector<color_image_t*> var_input_images_vec;
+    vector<FlowManifestEntry> var_input_flows_entry_vec;
     vector<Mat2f> var_input_flows_vec;
 
-    vector<String> var_input_flows_name_vec;
-    glob(CPMPF_flows_folder_string, var_input_flows_name_vec);
-
-    for (size_t i = 0; i < input_images_name_vec.size(); i++) {
-        color_image_t *tmp_img;
-        tmp_img = color_image_load(input_images_name_vec[i].c_str());
-        if ( tmp_img->stride == 0 ) {
-            cout << input_images_name_vec[i] << " is invalid!" << endl;
-            continue;
-        }
-        var_input_images_vec.push_back( tmp_img );
-    }
+    for (size_t i = 0; i < input_frames_vec.size(); i++)
+        var_input_images_vec.push_back( Mat2color_image_t(input_frames_vec[i]) );
 
 
-    for (size_t i = 0; i < var_input_flows_name_vec.size(); i++) {
-        Mat2f tmp_flo;
-        string tmp_flo_name = var_input_flows_name_vec[i];
-        const char* tmp_flo_name_char = tmp_flo_name.c_str();
-        ReadFlowFile(tmp_flo, tmp_flo_name_char);
+    for (size_t i = 0; i < flow_manifest.size(); i++) {
+        if (!(cpm_pf_params.var_refine_input_int & (flow_manifest[i].is_xyt ? VAR_REFINE_XYT : VAR_REFINE_XY)))
+            continue;
+        if (flow_manifest[i].image_index + 1 >= (int)var_input_images_vec.size())
+            continue;
+        Mat2f tmp_flo = flow_manifest[i].flow;
+        ostringstream tmp_flo_name_builder;
+        tmp_flo_name_builder << CPMPF_flows_folder_string << flow_manifest[i].name << flow_manifest[i].ext;
+        string tmp_flo_name = tmp_flo_name_builder.str();
+        if (tmp_flo.empty())
+            ReadFlow(tmp_flo, archive, tmp_flo_name, flow_manifest[i].image_index + 1, FLOW_FORWARD, flow_manifest[i].is_xyt ? FLOW_STAGE_XYT : FLOW_STAGE_XY);
         if( tmp_flo.empty() ) {
-            cout<< var_input_flows_name_vec[i] << " is invalid!" << endl;
+            cout<< tmp_flo_name << " is invalid!" << endl;
             continue;
         }
+        var_input_flows_entry_vec.push_back( flow_manifest[i] );
         var_input_flows_vec.push_back( tmp_flo.clone() );
     }
 
-    //run var part
-    for (size_t i = 0; i < var_input_flows_vec.size(); ++i) {
-        color_image_t *im1, *im2;
-        Mat2f flo;
-        ostringstream refined_cpmpf_flows_name_builder;
-
-        if (i == 0) {
-            im1 = color_image_cpy(var_input_images_vec[i]);
-            im2 = color_image_cpy(var_input_images_vec[i + 1]);
-            refined_cpmpf_flows_name_builder << setw(4) << setfill('0') << i + 1 << "_Normalized_Flow_XY";
-        }
-        else {
-            if (i % 2 != 0) {
-                im1 = color_image_cpy(var_input_images_vec[(i + 1) / 2]);
-                im2 = color_image_cpy(var_input_images_vec[(i + 1) / 2 + 1]);
-                refined_cpmpf_flows_name_builder << setw(4) << setfill('0') << (i + 1) / 2 + 1 << "_Normalized_Flow_XY";
-            }
-            else {
-                im1 = color_image_cpy(var_input_images_vec[i / 2]);
-                im2 = color_image_cpy(var_input_images_vec[i / 2 + 1]);
-                refined_cpmpf_flows_name_builder << setw(4) << setfill('0') << i / 2 + 1 << "_XYT";
-            }
+    //run var part, the flows are independent and each thread refines its share with its own context
+    variational_params_t flow_params;
+    SetVariationalParams(cpm_pf_params, &flow_params);
+#pragma omp parallel
+    {
+        variational_ctx_t *var_ctx = variational_ctx_new();
+#pragma omp for schedule(dynamic)
+        for (int i = 0; i < (int)var_input_flows_vec.size(); ++i) {
+            const FlowManifestEntry &entry = var_input_flows_entry_vec[i];
+            const color_image_t *im1 = var_input_images_vec[entry.image_index];
+            const color_image_t *im2 = var_input_images_vec[entry.image_index + 1];
+            Mat2f flo = var_input_flows_vec[i];
+
+            image_t *wx = image_new(im1->width, im1->height), *wy = image_new(im1->width, im1->height);
+            //FImage2image_t(img1_uv_vec[0], wx);
+            //FImage2image_t(img1_uv_vec[1], wy);
+
+            Mat2f2image_t_uv(flo, wx, wy);
+
+            variational_ctx(var_ctx, wx, wy, im1, im2, &flow_params);
+#pragma omp critical
+            cout << entry.name << " refined with " << var_ctx->stats.niter_outer << " outer and "
+                 << var_ctx->stats.niter_solver << "/" << var_ctx->stats.niter_solver_max << " solver iterations" << endl;
+
+
+            ostringstream refined_cpmpf_flows_name_flo_builder, refined_cpmpf_flows_name_png_builder, refined_cpmpf_flows_name_pfm_builder;
+            refined_cpmpf_flows_name_flo_builder << refined_CPMPF_flow_folder_string << entry.name << ".flo";
+            refined_cpmpf_flows_name_png_builder << refined_CPMPF_flow_folder_string << entry.name << ".png";
+            refined_cpmpf_flows_name_pfm_builder << refined_CPMPF_flow_folder_string << entry.name << ".pfm";
+
+            string refined_cpm_matches_name_flo = refined_cpmpf_flows_name_flo_builder.str();
+            string refined_cpm_matches_name_png = refined_cpmpf_flows_name_png_builder.str();
+            string refined_cpm_matches_name_pfm = refined_cpmpf_flows_name_pfm_builder.str();
+
+
+            writer.Push([=]() {
+                if (disparity_output)
+                    pfm_write(refined_cpm_matches_name_pfm.c_str(), wx->data, wx->width, wx->height, 1, wx->stride, 1.0f);
+                else if (archive)
+                    flow_archive_put_flow_planar(archive, entry.image_index + 1, FLOW_FORWARD, entry.is_xyt ? FLOW_STAGE_REFINED_XYT : FLOW_STAGE_REFINED_XY,
+                                                 wx->data, wy->data, wx->width, wx->height, wx->stride, -1);
+                else
+                    writeFlowFile(refined_cpm_matches_name_flo.c_str(), wx, wy);
+                image_delete(wx);
+                image_delete(wy);
+            }, 2 * sizeof(float) * wx->stride * wx->height);
         }
-
-        flo = var_input_flows_vec[i];
-
-        variational_params_t flow_params;
-        variational_params_default(&flow_params);
-        image_t *wx = image_new(im1->width, im1->height), *wy = image_new(im1->width, im1->height);
-        //FImage2image_t(img1_uv_vec[0], wx);
-        //FImage2image_t(img1_uv_vec[1], wy);
-
-        Mat2f2image_t_uv(flo, wx, wy);
-
-        variational(wx, wy, im1, im2, &flow_params);
-
-
-        ostringstream refined_cpmpf_flows_name_flo_builder, refined_cpmpf_flows_name_png_builder;
-        refined_cpmpf_flows_name_flo_builder << refined_CPMPF_flow_folder_string << refined_cpmpf_flows_name_builder.str() << ".flo";
-        refined_cpmpf_flows_name_png_builder << refined_CPMPF_flow_folder_string << refined_cpmpf_flows_name_builder.str() << ".png";
-
-        string refined_cpm_matches_name_flo = refined_cpmpf_flows_name_flo_builder.str();
-        string refined_cpm_matches_name_png = refined_cpmpf_flows_name_png_builder.str();
-
-
-        writeFlowFile(refined_cpm_matches_name_flo.c_str(), wx, wy);
-
+        variational_ctx_delete(var_ctx);
     }
+    for (size_t i = 0; i < var_input_images_vec.size(); i++)
+        color_image_delete(var_input_images_vec[i]);
+    FinishOutputs(writer, archive);
 
     printf("Hello World!");
     return 0;